@@ -0,0 +1,488 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Reliable delivery (selective repeat ARQ) for tty and pipe tunnels
+ * over UDP.
+ *
+ * Sits between the linker and the UDP transport (udp_* or mpath_*).
+ * Every data frame gets a sequence number and is kept until the other
+ * end acknowledges it. Acknowledgements carry the next expected
+ * sequence number plus up to ARQ_MAX_SACK ranges of frames received
+ * beyond it. A frame is sent again when it times out (RFC 6298 style
+ * RTO with exponential backoff) or, earlier, when frames sent after it
+ * have been selectively acknowledged and a round trip has passed.
+ * The receiver delivers frames strictly in order.
+ *
+ * The device is not read while ARQ_WIN frames are in flight. Frames
+ * the modules still produce once the ring is full wait in a queue
+ * until acknowledgements make room, none of them is dropped.
+ *
+ * Frame formats:
+ *   ARQ_DATA: type | seq(4) | ack(4) | payload
+ *   ARQ_ACK:  type | ack(4) | n | n * (offset(2) | len(2))
+ * Frames with flags (echo, close) are passed to the transport as is.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "vtun.h"
+#include "linkfd.h"
+#include "lib.h"
+#include "driver.h"
+
+#define ARQ_RING	128	/* Frames the buffers can hold */
+#define ARQ_WIN		64	/* Frames in flight */
+#define ARQ_MAX_SACK	4
+#define ARQ_RTO_INIT	500	/* ms */
+#define ARQ_RTO_MIN	50
+#define ARQ_RTO_MAX	4000
+#define ARQ_MAX_TRIES	16
+
+/* Frame types */
+#define ARQ_DATA	0
+#define ARQ_ACK		1
+
+#define ARQ_HDR		9
+#define ARQ_SLOT	(VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD)
+
+struct arq_frame {
+     char *buf;
+     int  len;
+     unsigned long sent;
+     int  tries;
+     int  sacked;
+};
+
+struct arq_held {
+     struct arq_held *next;
+     int  len;
+     char buf[ARQ_SLOT];
+};
+
+/* Sender */
+static struct arq_frame snd[ARQ_RING];
+static unsigned int snd_una, snd_next;
+static struct arq_held *held, **held_tail = &held;
+static unsigned long srtt, rttvar, rto;
+static unsigned long arq_rexmit;
+
+/* Receiver */
+static char *rcv_buf;
+static int rcv_len[ARQ_RING];	/* Payload length + 1, 0 - empty */
+static unsigned int rcv_next;
+static int rcv_ooo, ack_pending;
+static char *ack_buf;
+
+static int arq_fd, arq_loc_fd, arq_failed;
+
+/* Transport underneath */
+static int  (*lower_write)(int fd, char *buf, int len);
+static int  (*lower_read)(int fd, char *buf);
+static void (*lower_fdset)(fd_set *fds, int *maxfd, struct timeval *tv);
+static int  (*lower_ready)(fd_set *fds);
+
+static unsigned long arq_now(void)
+{
+     struct timeval tv;
+
+     gettimeofday(&tv, NULL);
+     return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+static inline void arq_put32(char *p, unsigned int v)
+{
+     p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline unsigned int arq_get32(const char *p)
+{
+     const unsigned char *u = (const unsigned char *) p;
+
+     return ((unsigned int)u[0] << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+static void arq_rtt(unsigned long r)
+{
+     unsigned long d;
+
+     if( !srtt ){
+	srtt = r ? r : 1;
+	rttvar = r / 2;
+     } else {
+	d = srtt > r ? srtt - r : r - srtt;
+	rttvar = (rttvar * 3 + d) / 4;
+	srtt = (srtt * 7 + r) / 8;
+     }
+     rto = srtt + (4 * rttvar > 1 ? 4 * rttvar : 1);
+     if( rto < ARQ_RTO_MIN )
+	rto = ARQ_RTO_MIN;
+     if( rto > ARQ_RTO_MAX )
+	rto = ARQ_RTO_MAX;
+}
+
+static void arq_send(struct arq_frame *f, unsigned long now)
+{
+     /* Acknowledge whatever we have by now */
+     arq_put32(f->buf + 5, rcv_next);
+     if( !rcv_ooo )
+	ack_pending = 0;
+
+     lower_write(arq_fd, f->buf, f->len);
+     f->sent = now;
+     f->tries++;
+}
+
+static void arq_send_ack(void)
+{
+     unsigned int s, start = 0;
+     char *p = ack_buf + 6;
+     int n = 0, in = 0;
+
+     ack_buf[0] = ARQ_ACK;
+     arq_put32(ack_buf + 1, rcv_next);
+
+     /* Ranges received beyond the cumulative ack */
+     for(s = 1; rcv_ooo && s < ARQ_RING && n < ARQ_MAX_SACK; s++){
+	if( rcv_len[(rcv_next + s) % ARQ_RING] ){
+	   if( !in ){
+	      start = s;
+	      in = 1;
+	   }
+	} else if( in ){
+	   p[0] = start >> 8; p[1] = start;
+	   p[2] = (s - start) >> 8; p[3] = s - start;
+	   p += 4; n++;
+	   in = 0;
+	}
+     }
+     if( in && n < ARQ_MAX_SACK ){
+	p[0] = start >> 8; p[1] = start;
+	p[2] = (s - start) >> 8; p[3] = s - start;
+	p += 4; n++;
+     }
+     ack_buf[5] = n;
+
+     lower_write(arq_fd, ack_buf, p - ack_buf);
+     ack_pending = 0;
+}
+
+/* Put the frame into the ring and send it */
+static void arq_queue(char *buf, int len, unsigned long now)
+{
+     struct arq_frame *f = &snd[snd_next % ARQ_RING];
+
+     f->buf[0] = ARQ_DATA;
+     arq_put32(f->buf + 1, snd_next);
+     memcpy(f->buf + ARQ_HDR, buf, len);
+     f->len = len + ARQ_HDR;
+     f->tries = f->sacked = 0;
+     snd_next++;
+
+     arq_send(f, now);
+}
+
+/* Move held frames into the room acknowledgements made in the ring */
+static void arq_unhold(unsigned long now)
+{
+     struct arq_held *h;
+
+     while( held && snd_next - snd_una < ARQ_RING ){
+	h = held;
+	if( !(held = h->next) )
+	   held_tail = &held;
+	arq_queue(h->buf, h->len, now);
+	free(h);
+     }
+}
+
+/* Process acknowledgement, sack points to n ranges */
+static void arq_ack(unsigned int ack, const char *sack, int n, unsigned long now)
+{
+     const unsigned char *u = (const unsigned char *) sack;
+     unsigned int s, end, high;
+     struct arq_frame *f;
+
+     if( ack - snd_una > snd_next - snd_una )
+	return;	/* Stale or bogus */
+
+     for(; snd_una != ack; snd_una++){
+	f = &snd[snd_una % ARQ_RING];
+	/* Karn: no samples from retransmitted frames */
+	if( f->tries == 1 && !f->sacked )
+	   arq_rtt(now - f->sent);
+     }
+     high = snd_una;
+     arq_unhold(now);
+
+     for(; n > 0; n--, u += 4){
+	s   = ack + ((u[0] << 8) | u[1]);
+	end = s + ((u[2] << 8) | u[3]);
+	for(; s != end && s - snd_una < snd_next - snd_una; s++){
+	   f = &snd[s % ARQ_RING];
+	   if( !f->sacked && f->tries == 1 )
+	      arq_rtt(now - f->sent);
+	   f->sacked = 1;
+	   if( s + 1 - snd_una > high - snd_una )
+	      high = s + 1;
+	}
+     }
+
+     /* Frames below the highest sacked one are most likely lost,
+	once there is a round trip time to tell how long to wait */
+     for(s = snd_una; s != high; s++){
+	f = &snd[s % ARQ_RING];
+	if( srtt && !f->sacked && now - f->sent >= srtt ){
+	   arq_send(f, now);
+	   arq_rexmit++;
+	}
+     }
+}
+
+int arq_write(int fd, char *buf, int len)
+{
+     struct arq_held *h;
+
+     if( len & ~VTUN_FSIZE_MASK )
+	return lower_write(fd, buf, len);
+
+     if( len + ARQ_HDR > ARQ_SLOT ){
+	vtun_syslog(LOG_ERR,"ARQ frame too long");
+	return -1;
+     }
+     if( held || snd_next - snd_una >= ARQ_RING ){
+	/* Ring is full, keep the frame until there is room */
+	if( !(h = malloc(sizeof(struct arq_held))) ){
+	   vtun_syslog(LOG_ERR,"Can't allocate ARQ frame");
+	   return -1;
+	}
+	memcpy(h->buf, buf, len);
+	h->len = len;
+	h->next = NULL;
+	*held_tail = h;
+	held_tail = &h->next;
+	return len;
+     }
+
+     arq_queue(buf, len, arq_now());
+     return len;
+}
+
+/* Next in order frame held by the receiver, 0 if none */
+static int arq_deliver(char *buf)
+{
+     int slot = rcv_next % ARQ_RING, len;
+
+     if( !rcv_len[slot] )
+	return 0;
+
+     len = rcv_len[slot] - 1;
+     memcpy(buf, rcv_buf + slot * ARQ_SLOT, len);
+     rcv_len[slot] = 0;
+     rcv_ooo--;
+     rcv_next++;
+     ack_pending = 1;
+     return len;
+}
+
+int arq_read(int fd, char *buf)
+{
+     unsigned long now;
+     unsigned int seq;
+     int len, d, slot;
+
+     if( arq_failed ){
+	vtun_syslog(LOG_ERR,"ARQ: peer does not acknowledge frames");
+	return -1;
+     }
+     if( (len = arq_deliver(buf)) > 0 )
+	return len;
+
+     len = lower_read(fd, buf);
+     if( len <= 0 || (len & ~VTUN_FSIZE_MASK) )
+	return len;
+
+     now = arq_now();
+     switch( buf[0] ){
+	case ARQ_ACK:
+	   d = (unsigned char) buf[5];
+	   if( len < 6 + 4 * d )
+	      return VTUN_BAD_FRAME;
+	   arq_ack(arq_get32(buf + 1), buf + 6, d, now);
+	   break;
+
+	case ARQ_DATA:
+	   if( len < ARQ_HDR )
+	      return VTUN_BAD_FRAME;
+	   seq = arq_get32(buf + 1);
+	   arq_ack(arq_get32(buf + 5), NULL, 0, now);
+	   len -= ARQ_HDR;
+
+	   ack_pending = 1;
+	   d = seq - rcv_next;
+	   if( d == 0 ){
+	      rcv_next++;
+	      if( !len )
+		 break;
+	      memmove(buf, buf + ARQ_HDR, len);
+	      return len;
+	   }
+	   if( d > 0 && d < ARQ_RING ){
+	      slot = seq % ARQ_RING;
+	      if( !rcv_len[slot] ){
+		 memcpy(rcv_buf + slot * ARQ_SLOT, buf + ARQ_HDR, len);
+		 rcv_len[slot] = len + 1;
+		 rcv_ooo++;
+	      }
+	   }
+	   break;
+
+	default:
+	   return VTUN_BAD_FRAME;
+     }
+
+     /* Nothing for the linker, treated as an ignored echo reply */
+     return VTUN_ECHO_REP;
+}
+
+void arq_fdset(fd_set *fds, int *maxfd, struct timeval *tv)
+{
+     unsigned long now = arq_now(), wait, t;
+     struct arq_frame *f;
+     unsigned int s;
+     int expired = 0;
+
+     if( lower_fdset )
+	lower_fdset(fds, maxfd, tv);
+
+     if( ack_pending )
+	arq_send_ack();
+
+     wait = tv->tv_sec * 1000UL + tv->tv_usec / 1000;
+     for(s = snd_una; s != snd_next; s++){
+	f = &snd[s % ARQ_RING];
+	if( f->sacked )
+	   continue;
+	if( now - f->sent >= rto ){
+	   if( f->tries >= ARQ_MAX_TRIES ){
+	      arq_failed = 1;
+	      break;
+	   }
+	   arq_send(f, now);
+	   arq_rexmit++;
+	   expired = 1;
+	}
+	t = f->sent + rto - now;
+	if( t < wait )
+	   wait = t;
+     }
+     if( expired ){
+	rto *= 2;
+	if( rto > ARQ_RTO_MAX )
+	   rto = ARQ_RTO_MAX;
+     }
+
+     /* Stop reading the device while the window is full */
+     if( snd_next - snd_una >= ARQ_WIN )
+	FD_CLR(arq_loc_fd, fds);
+
+     if( arq_failed || rcv_len[rcv_next % ARQ_RING] )
+	wait = 0;
+
+     tv->tv_sec  = wait / 1000;
+     tv->tv_usec = (wait % 1000) * 1000;
+}
+
+int arq_ready(fd_set *fds)
+{
+     return (lower_ready && lower_ready(fds)) || arq_failed ||
+	    rcv_len[rcv_next % ARQ_RING];
+}
+
+/* Put ARQ on top of the current transport */
+int arq_init(struct vtun_host *host)
+{
+     int i;
+
+     snd_una = snd_next = rcv_next = 0;
+     rcv_ooo = ack_pending = arq_failed = 0;
+     srtt = rttvar = 0;
+     rto = ARQ_RTO_INIT;
+     arq_rexmit = 0;
+     memset(rcv_len, 0, sizeof(rcv_len));
+
+     if( !(rcv_buf = malloc(ARQ_RING * ARQ_SLOT)) ||
+	 !(ack_buf = lfd_alloc(6 + 4 * ARQ_MAX_SACK)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate ARQ buffers");
+	return -1;
+     }
+     for(i = 0; i < ARQ_RING; i++)
+	if( !(snd[i].buf = lfd_alloc(ARQ_SLOT)) ){
+	   vtun_syslog(LOG_ERR,"Can't allocate ARQ buffers");
+	   return -1;
+	}
+
+     arq_fd = host->rmt_fd;
+     arq_loc_fd = host->loc_fd;
+
+     lower_write = proto_write;
+     lower_read  = proto_read;
+     lower_fdset = proto_fdset;
+     lower_ready = proto_ready;
+
+     proto_write = arq_write;
+     proto_read  = arq_read;
+     proto_fdset = arq_fdset;
+     proto_ready = arq_ready;
+
+     vtun_syslog(LOG_INFO,"ARQ initialized");
+     return 0;
+}
+
+void arq_close(void)
+{
+     struct arq_held *h;
+     int i;
+
+     if( arq_rexmit )
+	vtun_syslog(LOG_INFO,"ARQ retransmitted %lu of %u frames", arq_rexmit, snd_next);
+
+     for(i = 0; i < ARQ_RING; i++)
+	if( snd[i].buf ){
+	   lfd_free(snd[i].buf);
+	   snd[i].buf = NULL;
+	}
+     while( (h = held) ){
+	held = h->next;
+	free(h);
+     }
+     held_tail = &held;
+     free(rcv_buf); rcv_buf = NULL;
+     if( ack_buf ){
+	lfd_free(ack_buf);
+	ack_buf = NULL;
+     }
+}
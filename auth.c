@@ -33,6 +33,11 @@
 #include <signal.h>
 #include <syslog.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -53,11 +58,110 @@
 #include "lock.h"
 #include "auth.h"
 
-static int derive_key(struct vtun_host *host)
+static int hash_passwd(unsigned char *akey, const char *passwd)
 {
     unsigned char salt[crypto_pwhash_scryptsalsa208sha256_SALTBYTES];
+
+    memset(salt, 0xd1, sizeof salt);
+    return crypto_pwhash_scryptsalsa208sha256(akey, HOST_KEYBYTES,
+                                              passwd, strlen(passwd), salt,
+                                              crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE,
+                                              crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE);
+}
+
+/*
+ * Keys of all hosts are derived when the config is loaded, so
+ * handshakes don't run scrypt. Passwords are hashed by one process
+ * per CPU. Derived keys can be kept in a cache file which must be
+ * protected like the config file: it is as good as the passwords.
+ *
+ * Cache file format, one host per line:
+ *   host Hash_K(host || 0 || password) key
+ * The key K of the password ids is kept in file.secret, so the ids
+ * in the cache alone can't be used to guess the passwords.
+ */
+/* Longest host name kept in the cache */
+#define KEY_HOST_LEN 255
+
+struct key_job {
+    struct vtun_host *host;
+    unsigned char     id[crypto_generichash_BYTES];
+    int               done;
+};
+
+struct key_entry {
+    char              host[KEY_HOST_LEN + 1];
+    unsigned char     id[crypto_generichash_BYTES];
+    unsigned char     akey[HOST_KEYBYTES];
+};
+
+/* Max number of processes deriving keys */
+#define KEY_MAX_PROCS 64
+
+/* Key of the password ids, random for each process without a key cache */
+static unsigned char pwid_key[crypto_generichash_KEYBYTES];
+static int           pwid_key_set;
+
+static void pwid_key_init(void)
+{
+    char        file[255];
+    struct stat st;
+    int         fd;
+
+    if (pwid_key_set) {
+        return;
+    }
+    pwid_key_set = 1;
+    if (vtun.keycache == NULL) {
+        randombytes_buf(pwid_key, sizeof pwid_key);
+        return;
+    }
+    snprintf(file, sizeof file, "%s.secret", vtun.keycache);
+    if ((fd = open(file, O_RDONLY)) >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_uid == geteuid() && !(st.st_mode & 077) &&
+            read_n(fd, (char *) pwid_key, sizeof pwid_key) == sizeof pwid_key) {
+            close(fd);
+            return;
+        }
+        vtun_syslog(LOG_ERR, "Ignoring key cache secret %s, it must be private to the owner", file);
+        close(fd);
+    }
+
+    /* New secret, ids in the key cache don't match any more */
+    randombytes_buf(pwid_key, sizeof pwid_key);
+    unlink(file);
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 ||
+        write_n(fd, (char *) pwid_key, sizeof pwid_key) != sizeof pwid_key) {
+        vtun_syslog(LOG_ERR, "Can't write key cache secret %s", file);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void passwd_id(struct vtun_host *host, unsigned char *id)
+{
+    crypto_generichash_state st;
+
+    pwid_key_init();
+    crypto_generichash_init(&st, pwid_key, sizeof pwid_key, crypto_generichash_BYTES);
+    crypto_generichash_update(&st, (const unsigned char *) host->host, strlen(host->host) + 1);
+    crypto_generichash_update(&st, (const unsigned char *) host->passwd, strlen(host->passwd));
+    crypto_generichash_final(&st, id, crypto_generichash_BYTES);
+}
+
+/* Only the id of the password is kept once the key is derived */
+static void forget_passwd(struct vtun_host *host)
+{
+    passwd_id(host, host->pwid);
+    sodium_memzero(host->passwd, strlen(host->passwd));
+    free(host->passwd);
+    host->passwd = NULL;
+}
+
+static int derive_key(struct vtun_host *host)
+{
     int ret = -1;
-    size_t bin_len;
 
     if (host->akey != NULL) {
         return 0;
@@ -65,21 +169,272 @@ static int derive_key(struct vtun_host *host)
     if ((host->akey = sodium_malloc(crypto_generichash_KEYBYTES)) == NULL) {
         return -1;
     }
-    memset(salt, 0xd1, sizeof salt);
-    if (crypto_pwhash_scryptsalsa208sha256(host->akey, HOST_KEYBYTES,
-                                           host->passwd, strlen(host->passwd), salt,
-                                           crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE,
-                                           crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE) == 0) {
+    if (hash_passwd(host->akey, host->passwd) == 0) {
         ret = 0;
     }
-    sodium_memzero(host->passwd, strlen(host->passwd));
-    free(host->passwd);
-    host->passwd = NULL;
+    forget_passwd(host);
     vtun_syslog(LOG_DEBUG, "Key ready for host [%s]", host->host);
 
     return ret;
 }
 
+/* Returns 1 if h is defined with another password than host */
+int passwd_changed(struct vtun_host *host, struct vtun_host *h)
+{
+    unsigned char id[crypto_generichash_BYTES];
+
+    if (h->passwd == NULL) {
+        return 1;
+    }
+    if (host->passwd != NULL) {
+        return strcmp(host->passwd, h->passwd) != 0;
+    }
+    passwd_id(h, id);
+    return sodium_memcmp(id, host->pwid, sizeof id) != 0;
+}
+
+static int key_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct key_entry *) a)->host, ((const struct key_entry *) b)->host);
+}
+
+/* Returns number of entries, *entries has to be released with sodium_free() */
+static int load_key_cache(const char *file, struct key_entry **entries)
+{
+    char          line[KEY_HOST_LEN + 4 * crypto_generichash_BYTES + 8];
+    char          name[KEY_HOST_LEN + 1], id_hex[2 * crypto_generichash_BYTES + 1];
+    char          key_hex[2 * HOST_KEYBYTES + 1];
+    struct key_entry *e;
+    struct stat   st;
+    size_t        id_len, key_len;
+    FILE         *f;
+    int           n = 0, max = 0;
+
+    *entries = NULL;
+    if ((f = fopen(file, "r")) == NULL) {
+        return 0;
+    }
+    if (fstat(fileno(f), &st) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        vtun_syslog(LOG_ERR, "Ignoring key cache %s, it must be private to the owner", file);
+        fclose(f);
+        return 0;
+    }
+    while (fgets(line, sizeof line, f)) {
+        max++;
+    }
+    if (max == 0 || (*entries = sodium_malloc(max * sizeof(struct key_entry))) == NULL) {
+        fclose(f);
+        return 0;
+    }
+    rewind(f);
+    while (n < max && fgets(line, sizeof line, f)) {
+        e = *entries + n;
+        if (sscanf(line, "%255s %64s %64s",
+                   name, id_hex, key_hex) != 3) {
+            continue;
+        }
+        if (sodium_hex2bin(e->id, sizeof e->id, id_hex, strlen(id_hex), "", &id_len, NULL) != 0 ||
+            id_len != sizeof e->id ||
+            sodium_hex2bin(e->akey, sizeof e->akey, key_hex, strlen(key_hex), "", &key_len, NULL) != 0 ||
+            key_len != sizeof e->akey) {
+            continue;
+        }
+        strcpy(e->host, name);
+        n++;
+    }
+    sodium_memzero(line, sizeof line);
+    sodium_memzero(key_hex, sizeof key_hex);
+    fclose(f);
+
+    qsort(*entries, n, sizeof(struct key_entry), key_entry_cmp);
+
+    return n;
+}
+
+static void save_key_cache(const char *file, struct key_job *jobs, int n)
+{
+    char  tmp_file[255];
+    char  id_hex[2 * crypto_generichash_BYTES + 1];
+    char  key_hex[2 * HOST_KEYBYTES + 1];
+    FILE *f;
+    int   fd, i, err = 0;
+
+    snprintf(tmp_file, sizeof tmp_file, "%s.tmp", file);
+    unlink(tmp_file);
+    if ((fd = open(tmp_file, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 ||
+        (f = fdopen(fd, "w")) == NULL) {
+        vtun_syslog(LOG_ERR, "Can't write key cache %s. %s(%d)", tmp_file, strerror(errno), errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (!jobs[i].done || strlen(jobs[i].host->host) > KEY_HOST_LEN) {
+            continue;
+        }
+        sodium_bin2hex(id_hex, sizeof id_hex, jobs[i].id, sizeof jobs[i].id);
+        sodium_bin2hex(key_hex, sizeof key_hex, jobs[i].host->akey, HOST_KEYBYTES);
+        if (fprintf(f, "%s %s %s\n", jobs[i].host->host, id_hex, key_hex) < 0) {
+            err = 1;
+        }
+    }
+    sodium_memzero(key_hex, sizeof key_hex);
+    if (fclose(f) != 0 || err || rename(tmp_file, file) != 0) {
+        vtun_syslog(LOG_ERR, "Can't write key cache %s", file);
+        unlink(tmp_file);
+    }
+}
+
+/* Hash the passwords of the jobs which are not done yet */
+static void derive_parallel(struct key_job *jobs, int n)
+{
+    struct {
+        int           idx;
+        unsigned char akey[HOST_KEYBYTES];
+    } rec;
+    int   rfd[KEY_MAX_PROCS];
+    pid_t pid[KEY_MAX_PROCS];
+    int   p[2], nproc, k, i, left = 0;
+
+    for (i = 0; i < n; i++) {
+        left += !jobs[i].done;
+    }
+    if (left == 0) {
+        return;
+    }
+    nproc = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nproc < 1) {
+        nproc = 1;
+    }
+    if (nproc > KEY_MAX_PROCS) {
+        nproc = KEY_MAX_PROCS;
+    }
+    if (nproc > left) {
+        nproc = left;
+    }
+
+    for (k = 0; k < nproc; k++) {
+        rfd[k] = -1;
+        pid[k] = -1;
+        if (pipe(p) < 0) {
+            continue;
+        }
+        if ((pid[k] = fork()) == 0) {
+            close(p[0]);
+            for (i = k; i < n; i += nproc) {
+                if (jobs[i].done || hash_passwd(rec.akey, jobs[i].host->passwd) != 0) {
+                    continue;
+                }
+                rec.idx = i;
+                if (write_n(p[1], (char *) &rec, sizeof rec) != sizeof rec) {
+                    break;
+                }
+            }
+            sodium_memzero(&rec, sizeof rec);
+            _exit(0);
+        }
+        close(p[1]);
+        if (pid[k] < 0) {
+            close(p[0]);
+            continue;
+        }
+        rfd[k] = p[0];
+    }
+
+    for (k = 0; k < nproc; k++) {
+        if (rfd[k] < 0) {
+            continue;
+        }
+        while (read_n(rfd[k], (char *) &rec, sizeof rec) == sizeof rec) {
+            if (rec.idx < 0 || rec.idx >= n || rec.idx % nproc != k || jobs[rec.idx].done ||
+                (jobs[rec.idx].host->akey = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+                continue;
+            }
+            memcpy(jobs[rec.idx].host->akey, rec.akey, HOST_KEYBYTES);
+            jobs[rec.idx].done = 1;
+        }
+        close(rfd[k]);
+        waitpid(pid[k], NULL, 0);
+    }
+    sodium_memzero(&rec, sizeof rec);
+
+    /* Leftovers of failed processes */
+    for (i = 0; i < n; i++) {
+        if (jobs[i].done) {
+            continue;
+        }
+        if ((jobs[i].host->akey = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+            continue;
+        }
+        if (hash_passwd(jobs[i].host->akey, jobs[i].host->passwd) != 0) {
+            sodium_free(jobs[i].host->akey);
+            jobs[i].host->akey = NULL;
+            continue;
+        }
+        jobs[i].done = 1;
+    }
+}
+
+/* Derive keys of all hosts in the hosts list */
+void derive_host_keys(void)
+{
+    struct key_job   *jobs;
+    struct key_entry *cache = NULL, *e, key;
+    struct vtun_host *host;
+    llist_elm        *l;
+    int               n = 0, ncache = 0, hits = 0, i;
+
+    for (l = host_list.head; l; l = l->next) {
+        n++;
+    }
+    if (n == 0 || (jobs = calloc(n, sizeof(struct key_job))) == NULL) {
+        return;
+    }
+    n = 0;
+    for (l = host_list.head; l; l = l->next) {
+        host = l->data;
+        if (host->akey == NULL && host->passwd != NULL) {
+            jobs[n].host = host;
+            passwd_id(host, jobs[n].id);
+            n++;
+        }
+    }
+
+    if (vtun.keycache) {
+        ncache = load_key_cache(vtun.keycache, &cache);
+    }
+    for (i = 0; i < n && ncache; i++) {
+        if (strlen(jobs[i].host->host) > KEY_HOST_LEN) {
+            continue;
+        }
+        strcpy(key.host, jobs[i].host->host);
+        if ((e = bsearch(&key, cache, ncache, sizeof key, key_entry_cmp)) == NULL ||
+            sodium_memcmp(e->id, jobs[i].id, sizeof e->id) != 0 ||
+            (jobs[i].host->akey = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+            continue;
+        }
+        memcpy(jobs[i].host->akey, e->akey, HOST_KEYBYTES);
+        jobs[i].done = 1;
+        hits++;
+    }
+    sodium_free(cache);
+
+    derive_parallel(jobs, n);
+
+    for (i = 0; i < n; i++) {
+        if (jobs[i].done) {
+            forget_passwd(jobs[i].host);
+        }
+    }
+    if (vtun.keycache && (hits < n || ncache != n)) {
+        save_key_cache(vtun.keycache, jobs, n);
+    }
+    vtun_syslog(LOG_INFO, "Keys ready for %d hosts, %d from cache", n, hits);
+
+    free(jobs);
+}
+
 /*
  * Functions to convert binary flags to character string.
  * string format:  <CS64>
@@ -88,7 +443,8 @@ static int derive_key(struct vtun_host *host)
 
 static char *bf2cf(struct vtun_host *host)
 {
-    static char str[32], * ptr = str;
+    static char str[64];
+    char *ptr = str;
 
     *(ptr++) = '<';
 
@@ -127,10 +483,28 @@ static char *bf2cf(struct vtun_host *host)
     if (host->flags & VTUN_KEEP_ALIVE)
         *(ptr++) = 'K';
 
+    if (host->flags & VTUN_HCOMP)
+        *(ptr++) = 'H';
+
+    if (host->flags & VTUN_DEDUP)
+        ptr += sprintf(ptr, "R%d", host->dedup);
+
+    if (host->flags & VTUN_FEC)
+        ptr += sprintf(ptr, "P%d", host->fec);
+
+    if (host->flags & VTUN_MPATH)
+        *(ptr++) = 'M';
+
+    if (host->flags & VTUN_ARQ)
+        *(ptr++) = 'A';
+
     if (host->flags & VTUN_ENCRYPT) {
         ptr += sprintf(ptr, "E%d", host->cipher);
     }
 
+    if (host->sid)
+        ptr += sprintf(ptr, "X%u", host->sid);
+
     strcat(ptr, ">");
 
     return str;
@@ -145,7 +519,7 @@ static int cf2bf(char *str, struct vtun_host *host)
     char *ptr, *p;
     int s;
 
-    if (strlen(str) >= 32) {
+    if (strlen(str) >= 64) {
         return -1;
     }
     if ((ptr = strchr(str, '<'))) {
@@ -176,6 +550,32 @@ static int cf2bf(char *str, struct vtun_host *host)
             case 'K':
                 host->flags |= VTUN_KEEP_ALIVE;
                 break;
+            case 'H':
+                host->flags |= VTUN_HCOMP;
+                break;
+            case 'M':
+                host->flags |= VTUN_MPATH;
+                break;
+            case 'A':
+                host->flags |= VTUN_ARQ;
+                break;
+            case 'R':
+                if ((s = strtol(ptr, &p, 10)) == ERANGE || ptr == p ||
+                    s < 0 || s > VTUN_DEDUP_MAX) {
+                    return -1;
+                }
+                host->flags |= VTUN_DEDUP;
+                host->dedup = s;
+                ptr = p;
+                break;
+            case 'P':
+                if ((s = strtol(ptr, &p, 10)) == ERANGE || ptr == p) {
+                    return -1;
+                }
+                host->flags |= VTUN_FEC;
+                host->fec = s;
+                ptr = p;
+                break;
             case 'C':
                 if ((s = strtol(ptr, &p, 10)) == ERANGE || ptr == p) {
                     return -1;
@@ -213,6 +613,13 @@ static int cf2bf(char *str, struct vtun_host *host)
                 }
                 ptr = p;
                 break;
+            case 'X':
+                host->sid = strtoul(ptr, &p, 10);
+                if (ptr == p) {
+                    return -1;
+                }
+                ptr = p;
+                break;
             case 'F':
                 /* reserved for Feature transmit */
                 break;
@@ -226,142 +633,917 @@ static int cf2bf(char *str, struct vtun_host *host)
     return -1;
 }
 
-/* Authentication (Server side) */
-struct vtun_host *auth_server(int fd)
-{
-    char          buf[VTUN_MESG_SIZE], *str1, *str2, *str3;
-    unsigned char cack[crypto_generichash_BYTES];
+/*
+ * One round trip handshake. The client doesn't wait for the greeting
+ * and sends right after connect:
+ *   magic[4] time[4] client_pk[32] mac[32] len[1] host[len]
+ *     mac = H_akey(magic time client_pk len host)
+ * or, holding a ticket from an earlier session:
+ *   magic[4] time[4] nonce[32] mac[32] len[2] ticket[len]
+ *     mac = H_secret(magic time nonce len ticket)
+ * The server answers after the greeting with:
+ *   magic[4] status[1] server_pk[32] len[1] flags[len] mac[32]
+ *   len[2] ticket[len]
+ *     mac = H_psk(magic status server_pk len flags client_mac len ticket)
+ * where server_pk is the server nonce when resuming.
+ * Session key is H_akey(dh client_mac server_pk) or
+ * H_secret(client_mac nonce). Secret of the next ticket is
+ * derived from the session key.
+ * Servers which know it announce HS_TOKEN in the greeting, the first
+ * byte of the magic never starts a text message.
+ */
+#define HS_MAGIC     "\0VH1"
+#define HS_RESUME    "\0VR1"
+#define HS_UDP       "\0VU1"
+#define HS_COOKIE    "\0VC1"
+#define HS_TOKEN     " HS1"
+#define HS_HELLO_LEN (4 + 4 + crypto_scalarmult_BYTES + crypto_generichash_BYTES + 1)
+#define HS_RESUME_LEN (HS_HELLO_LEN + 1)
+#define HS_REPLY_LEN (4 + 1 + crypto_scalarmult_BYTES + 1)
+#define HS_MAX_FLAGS 63
+
+#define HS_OK        0
+#define HS_DENY      1
+#define HS_RETRY     2	/* Connect again without the ticket */
+
+/* Allowed clock difference and number of remembered hellos */
+#define HS_WINDOW    300
+#define HS_SEEN      256
+
+/* 
+ * Over UDP the hello goes in one datagram:
+ *   magic[4] cookie[16] hello
+ * A hello without the right cookie is answered with
+ *   magic[4] cookie[16]
+ * Cookies are valid for one or two HS_COOKIE_LIFE periods.
+ */
+#define HS_COOKIE_LEN  16
+#define HS_COOKIE_LIFE 120
+#define HS_UDP_TRIES   3
+
+/* 
+ * Ticket is nonce[24] box(expiry[4] secret[32] host).
+ * Only the server which issued it (or its workers) can open it.
+ */
+#define TICKET_LIFE  3600
+#define TICKET_PLAIN (4 + HOST_KEYBYTES)
+#define TICKET_MAX   (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + \
+                      TICKET_PLAIN + 255)
+
+/* Server side authentication state */
+struct vtun_auth {
+    int           fd;
+    int           stage;
+    struct        vtun_host *host;
     unsigned char client_pk[crypto_scalarmult_BYTES];
-    unsigned char server_pk[crypto_scalarmult_BYTES];
     unsigned char server_sk[crypto_scalarmult_SCALARBYTES];
-    unsigned char ckey[4 + crypto_scalarmult_BYTES + crypto_generichash_BYTES];
-    unsigned char dhkey[crypto_scalarmult_BYTES];
     unsigned char skey[crypto_scalarmult_BYTES + crypto_generichash_BYTES];
-    char          skey_hex[2 * (crypto_scalarmult_BYTES + crypto_generichash_BYTES) + 1];
-    unsigned char hash[crypto_generichash_BYTES];
-    unsigned char flhash[crypto_generichash_BYTES];
-    char          flhash_hex[2 * crypto_generichash_BYTES + 1];
-    struct        vtun_host *host = NULL;
-    char         *flags;
-    char         *host_name = NULL;
-    crypto_generichash_state st;
-    time_t        client_now;
-    size_t        bin_len;
-    int           stage;
-    int           success = 0;
-
-    set_title("authentication");
-
-    print_p(fd, "VTUN server ver %s\n", VTUN_VER);
+    /* Message being received, text or binary hello */
+    char          msg[HS_RESUME_LEN + TICKET_MAX];
+    int           have;
+    int           want;
+    /* Handshake over UDP, the reply is resent until the client talks */
+    int           udp;
+    unsigned char rep[HS_REPLY_LEN + HS_MAX_FLAGS + crypto_generichash_BYTES + 2 + TICKET_MAX];
+    int           rep_len;
+};
 
-    stage = ST_STEP2;
+/* 
+ * Get the host for the session. Forked server uses the entry
+ * of the hosts list, event server works on a private copy.
+ */
+static struct vtun_host *auth_find_host(char *name)
+{
+    struct vtun_host *host;
 
-    while (readn_t(fd, buf, VTUN_MESG_SIZE, vtun.timeout) > 0) {
-        buf[sizeof(buf) - 1] = '\0';
-        strtok(buf, "\r\n");
-        if (!(str1 = strtok(buf, " :"))) {
-            break;
+    if (vtun.svr_type != VTUN_EVENT) {
+        if ((host = find_host(name)) == NULL || derive_key(host) != 0) {
+            return NULL;
         }
-        if (!(str2 = strtok(NULL, " :"))) {
-            break;
+        return host;
+    }
+    if ((host = lookup_host(name)) == NULL || derive_key(host) != 0) {
+        return NULL;
+    }
+    return dup_host(host);
+}
+
+/* Lock authenticated host and get the flags for the client */
+static char *auth_accept(struct vtun_auth *a, struct vtun_host *host)
+{
+    if (lock_host(host) < 0) {
+        /* Multiple connections are denied */
+        return NULL;
+    }
+    if (a->udp) {
+        /* Session runs over the socket the client came to */
+        host->flags &= ~VTUN_PROT_MASK;
+        host->flags |= VTUN_UDP;
+    }
+    if (vtun.svr_type == VTUN_EVENT) {
+        /* Multipath and ARQ keep per-process state */
+        host->flags &= ~VTUN_MPATH;
+        /* Only clients of the binary handshake know session IDs */
+        if (a->stage != ST_STEP3) {
+            host->sid = ev_session_id(host);
         }
-        switch (stage) {
-        case ST_STEP2:
-            if (!strcmp(str1, "CKEY")) {
-                if (!(str3 = strtok(NULL, " \t"))) {
-                    break;
-                }
-                sodium_hex2bin(ckey, sizeof ckey, str3, strlen(str3), "", &bin_len, NULL);
-                if (bin_len != sizeof ckey) {
-                    break;
-                }
-                client_now = ((time_t) ckey[0]) << 24 | ((time_t) ckey[1]) << 16 |
-                    ((time_t) ckey[2]) << 9 | ((time_t) ckey[3]);
-                (void) client_now;
-                host_name = str2;
-                if ((host = find_host(host_name)) == NULL || derive_key(host) != 0) {
-                    break;
-                }
-                crypto_generichash(hash, sizeof hash,
-                                   ckey, 4 + crypto_scalarmult_BYTES,
-                                   host->akey, crypto_generichash_KEYBYTES);
-                if (sodium_memcmp(hash, ckey + 4 + crypto_scalarmult_BYTES, sizeof hash) != 0) {
-                    break;
-                }
-                memcpy(client_pk, ckey + 4, sizeof client_pk);
-                randombytes_buf(server_sk, crypto_scalarmult_SCALARBYTES);
-                crypto_scalarmult_base(server_pk, server_sk);
-                memcpy(skey, server_pk, sizeof server_pk);
-                memcpy(skey + crypto_scalarmult_BYTES, hash, sizeof hash);
-                crypto_generichash(skey + crypto_scalarmult_BYTES, crypto_scalarmult_BYTES,
-                                   skey, sizeof skey,
-                                   host->akey, crypto_generichash_KEYBYTES);
-                sodium_bin2hex(skey_hex, sizeof skey_hex, skey, sizeof skey);
-                print_p(fd, "SKEY: %s\n", skey_hex);
-                stage = ST_STEP3;
-                continue;
-            }
-            break;
+    } else if ((host->flags & VTUN_PROT_MASK) == VTUN_UDP &&
+               (host->flags & (VTUN_TTY | VTUN_PIPE))) {
+        /* Byte streams can't survive loss over UDP */
+        host->flags |= VTUN_ARQ;
+    }
+    return bf2cf(host);
+}
 
-        case ST_STEP3:
-            if (!strcmp(str1, "CACK")) {
-                sodium_hex2bin(cack, sizeof cack, str2, strlen(str2), "", &bin_len, NULL);
-                if (bin_len != sizeof cack) {
-                    break;
-                }
-                crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
-                                        crypto_generichash_BYTES);
-                crypto_generichash_update(&st, (const unsigned char *) "CACK", 4);
-                crypto_generichash_update(&st, skey, sizeof skey);
-                crypto_generichash_final(&st, hash, sizeof hash);
-                if (sodium_memcmp(hash, cack, sizeof hash) != 0) {
-                    break;
-                }
-                /* Lock host */
-                if (lock_host(host) < 0) {
-                    /* Multiple connections are denied */
-                    host = NULL;
-                    break;
-                }
-                flags = bf2cf(host);
-                crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
-                                        crypto_generichash_BYTES);
-                crypto_generichash_update(&st, (const unsigned char *) flags, strlen(flags));
-                crypto_generichash_update(&st, cack, sizeof cack);
-                crypto_generichash_final(&st, flhash, sizeof flhash);
-                sodium_bin2hex(flhash_hex, sizeof flhash_hex, flhash, sizeof flhash);
-                print_p(fd, "FLAGS: %s %s\n", flags, flhash_hex);
+/* 
+ * Hellos seen within the time window. A captured hello would
+ * bring the session up again, so each one is accepted only once.
+ * Forked server remembers them in the listener, see auth_gate().
+ */
+struct hs_seen {
+    struct {
+        unsigned char mac[crypto_generichash_BYTES];
+        time_t        tm;
+    } e[HS_SEEN];
+    int next;
+};
+static struct hs_seen hs_seen;
 
-                if (crypto_scalarmult(dhkey, server_sk, client_pk) != 0) {
-                    break;
-                }
-                sodium_memzero(server_sk, sizeof server_sk);
-                if ((host->key = sodium_malloc(HOST_KEYBYTES)) == NULL) {
-                    abort();
-                }
-                crypto_generichash(host->key, HOST_KEYBYTES, dhkey, sizeof dhkey,
-                                   host->akey, crypto_generichash_KEYBYTES);
-                sodium_memzero(dhkey, sizeof dhkey);
-                success = 1;
-            }
-            break;
+/* Connections were checked by the listener before the fork */
+static int hs_gated;
+
+static int hs_replayed(struct hs_seen *seen, const unsigned char *mac, time_t now)
+{
+    int i;
+
+    for (i = 0; i < HS_SEEN; i++) {
+        if (seen->e[i].tm && now - seen->e[i].tm <= 2 * HS_WINDOW &&
+            sodium_memcmp(seen->e[i].mac, mac, crypto_generichash_BYTES) == 0) {
+            return 1;
         }
-        break;
-    }
-    if (success == 0) {
-        print_p(fd, "ERR\n");
-        host = NULL;
     }
-    return host;
+    memcpy(seen->e[seen->next].mac, mac, crypto_generichash_BYTES);
+    seen->e[seen->next].tm = now;
+    seen->next = (seen->next + 1) % HS_SEEN;
+
+    return 0;
 }
 
-/* Authentication (Client side) */
-int auth_client(int fd, struct vtun_host *host)
+static unsigned char ticket_key[crypto_secretbox_KEYBYTES];
+static unsigned char cookie_key[crypto_generichash_KEYBYTES];
+static struct hs_seen udp_seen;
+static int ticket_ready;
+
+/* Called before the server forks, so all processes share the keys */
+void auth_ticket_init(void)
 {
-    char          buf[VTUN_MESG_SIZE], *str1, *str2, *str3;
-    unsigned char cack[crypto_generichash_BYTES];
-    char          cack_hex[2 * crypto_generichash_BYTES + 1];
-    unsigned char flhash[crypto_generichash_BYTES];
+    randombytes_buf(ticket_key, sizeof ticket_key);
+    randombytes_buf(cookie_key, sizeof cookie_key);
+    ticket_ready = 1;
+}
+
+/* Secret of the ticket issued with the session key */
+static void ticket_secret(unsigned char *secret, const unsigned char *key)
+{
+    crypto_generichash(secret, HOST_KEYBYTES, (const unsigned char *) "VTUN resume", 11,
+                       key, HOST_KEYBYTES);
+}
+
+/* Returns length of the ticket, 0 if there is none */
+static int ticket_seal(unsigned char *t, const char *name, const unsigned char *key)
+{
+    unsigned char plain[TICKET_PLAIN + 255];
+    uint32_t      expiry = time(NULL) + TICKET_LIFE;
+    int           len = strlen(name);
+
+    if (!ticket_ready || len > 255) {
+        return 0;
+    }
+    plain[0] = (unsigned char)(expiry >> 24);
+    plain[1] = (unsigned char)(expiry >> 16);
+    plain[2] = (unsigned char)(expiry >> 8);
+    plain[3] = (unsigned char)(expiry);
+    ticket_secret(plain + 4, key);
+    memcpy(plain + TICKET_PLAIN, name, len);
+    randombytes_buf(t, crypto_secretbox_NONCEBYTES);
+    crypto_secretbox_easy(t + crypto_secretbox_NONCEBYTES, plain, TICKET_PLAIN + len,
+                          t, ticket_key);
+    sodium_memzero(plain, sizeof plain);
+
+    return crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + TICKET_PLAIN + len;
+}
+
+/* Get host name and secret out of a valid ticket */
+static int ticket_open(const unsigned char *t, int tlen, char *name, unsigned char *secret)
+{
+    unsigned char plain[TICKET_PLAIN + 255];
+    uint32_t      expiry;
+    int           len = tlen - crypto_secretbox_NONCEBYTES - crypto_secretbox_MACBYTES;
+
+    if (!ticket_ready || len <= TICKET_PLAIN || len > (int) sizeof plain) {
+        return -1;
+    }
+    if (crypto_secretbox_open_easy(plain, t + crypto_secretbox_NONCEBYTES,
+                                   tlen - crypto_secretbox_NONCEBYTES, t, ticket_key) != 0) {
+        return -1;
+    }
+    expiry = (uint32_t) plain[0] << 24 | (uint32_t) plain[1] << 16 |
+        (uint32_t) plain[2] << 8 | (uint32_t) plain[3];
+    if ((int32_t) (expiry - (uint32_t) time(NULL)) < 0) {
+        sodium_memzero(plain, sizeof plain);
+        return -1;
+    }
+    memcpy(secret, plain + 4, HOST_KEYBYTES);
+    memcpy(name, plain + TICKET_PLAIN, len - TICKET_PLAIN);
+    name[len - TICKET_PLAIN] = '\0';
+    sodium_memzero(plain, sizeof plain);
+
+    return 0;
+}
+
+static void hs_reply(struct vtun_auth *a, int status, const unsigned char *server_pk,
+                     const char *flags, const unsigned char *mac,
+                     const unsigned char *ticket, int tlen)
+{
+    unsigned char *rep = a->rep;
+    unsigned char *ptr;
+    int           len = flags ? strlen(flags) : 0;
+
+    memset(rep, 0, sizeof a->rep);
+    memcpy(rep, HS_MAGIC, 4);
+    rep[4] = status;
+    if (server_pk) {
+        memcpy(rep + 5, server_pk, crypto_scalarmult_BYTES);
+    }
+    rep[HS_REPLY_LEN - 1] = len;
+    ptr = rep + HS_REPLY_LEN;
+    if (flags) {
+        memcpy(ptr, flags, len);
+        ptr += len;
+    }
+    if (mac) {
+        memcpy(ptr, mac, crypto_generichash_BYTES);
+    }
+    ptr += crypto_generichash_BYTES;
+    *(ptr++) = (unsigned char)(tlen >> 8);
+    *(ptr++) = (unsigned char)(tlen);
+    if (ticket) {
+        memcpy(ptr, ticket, tlen);
+        ptr += tlen;
+    }
+    a->rep_len = ptr - rep;
+    /* Listener sends it to the client's address itself */
+    if (a->fd >= 0) {
+        write_n(a->fd, (char *) rep, a->rep_len);
+    }
+}
+
+/* MAC of the complete binary hello, keyed with psk */
+static int hs_hello_mac(const unsigned char *msg, int len, const unsigned char *psk)
+{
+    unsigned char hash[crypto_generichash_BYTES];
+    crypto_generichash_state st;
+
+    crypto_generichash_init(&st, psk, crypto_generichash_KEYBYTES,
+                            crypto_generichash_BYTES);
+    crypto_generichash_update(&st, msg, 8 + crypto_scalarmult_BYTES);
+    crypto_generichash_update(&st, msg + HS_HELLO_LEN - 1, len - (HS_HELLO_LEN - 1));
+    crypto_generichash_final(&st, hash, sizeof hash);
+
+    return sodium_memcmp(hash, msg + 8 + crypto_scalarmult_BYTES, sizeof hash);
+}
+
+/* Difference between our clock and the client's */
+static int32_t hs_skew(const unsigned char *msg)
+{
+    uint32_t client_now = (uint32_t) msg[4] << 24 | (uint32_t) msg[5] << 16 |
+        (uint32_t) msg[6] << 8 | (uint32_t) msg[7];
+
+    return (int32_t) ((uint32_t) time(NULL) - client_now);
+}
+
+/* Binary hello is complete in a->msg */
+static int auth_server_hello(struct vtun_auth *a, struct vtun_host **hostp)
+{
+    unsigned char *msg = (unsigned char *) a->msg;
+    unsigned char *client_pk = msg + 8;
+    unsigned char *client_mac = client_pk + crypto_scalarmult_BYTES;
+    unsigned char server_pk[crypto_scalarmult_BYTES];
+    unsigned char dhkey[crypto_scalarmult_BYTES];
+    unsigned char hash[crypto_generichash_BYTES];
+    unsigned char secret[HOST_KEYBYTES];
+    unsigned char ticket[TICKET_MAX], tlen_be[2];
+    unsigned char status = HS_OK, flags_len;
+    const unsigned char *psk;
+    char          name[256];
+    struct        vtun_host *host;
+    crypto_generichash_state st;
+    int32_t       skew;
+    char         *flags;
+    int           resume = (a->stage == ST_RES_TICKET);
+    int           tlen;
+
+    if (resume) {
+        if (ticket_open(msg + HS_RESUME_LEN, a->have - HS_RESUME_LEN, name, secret) != 0) {
+            /* Expired or from another server */
+            status = HS_RETRY;
+            goto fail;
+        }
+    } else {
+        memcpy(name, a->msg + HS_HELLO_LEN, msg[HS_HELLO_LEN - 1]);
+        name[msg[HS_HELLO_LEN - 1]] = '\0';
+    }
+    if ((host = a->host = auth_find_host(name)) == NULL) {
+        goto fail;
+    }
+    psk = resume ? secret : host->akey;
+    if (hs_hello_mac(msg, a->have, psk) != 0) {
+        goto fail;
+    }
+    skew = hs_skew(msg);
+    if (skew > HS_WINDOW || skew < -HS_WINDOW) {
+        /* Clocks differ, the text handshake doesn't need them */
+        vtun_syslog(LOG_INFO, "Clock of %s is %d seconds off", host->host, skew);
+        status = HS_RETRY;
+        goto fail;
+    }
+    /* Listener has checked it already */
+    if (!hs_gated && hs_replayed(&hs_seen, client_mac, time(NULL))) {
+        vtun_syslog(LOG_ERR, "Replayed handshake for %s", host->host);
+        goto fail;
+    }
+    if ((flags = auth_accept(a, host)) == NULL) {
+        goto fail;
+    }
+    if ((host->key = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+        abort();
+    }
+    if (resume) {
+        randombytes_buf(server_pk, sizeof server_pk);
+        crypto_generichash_init(&st, secret, HOST_KEYBYTES, HOST_KEYBYTES);
+        crypto_generichash_update(&st, client_mac, crypto_generichash_BYTES);
+        crypto_generichash_update(&st, server_pk, sizeof server_pk);
+        crypto_generichash_final(&st, host->key, HOST_KEYBYTES);
+    } else {
+        randombytes_buf(a->server_sk, crypto_scalarmult_SCALARBYTES);
+        crypto_scalarmult_base(server_pk, a->server_sk);
+        if (crypto_scalarmult(dhkey, a->server_sk, client_pk) != 0) {
+            sodium_free(host->key);
+            host->key = NULL;
+            unlock_host(host);
+            goto fail;
+        }
+        sodium_memzero(a->server_sk, sizeof a->server_sk);
+        crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
+                                HOST_KEYBYTES);
+        crypto_generichash_update(&st, dhkey, sizeof dhkey);
+        crypto_generichash_update(&st, client_mac, crypto_generichash_BYTES);
+        crypto_generichash_update(&st, server_pk, sizeof server_pk);
+        crypto_generichash_final(&st, host->key, HOST_KEYBYTES);
+        sodium_memzero(dhkey, sizeof dhkey);
+    }
+
+    crypto_generichash_init(&st, psk, crypto_generichash_KEYBYTES,
+                            crypto_generichash_BYTES);
+    crypto_generichash_update(&st, (const unsigned char *) HS_MAGIC, 4);
+    crypto_generichash_update(&st, &status, 1);
+    crypto_generichash_update(&st, server_pk, sizeof server_pk);
+    flags_len = strlen(flags);
+    crypto_generichash_update(&st, &flags_len, 1);
+    crypto_generichash_update(&st, (const unsigned char *) flags, strlen(flags));
+    crypto_generichash_update(&st, client_mac, crypto_generichash_BYTES);
+    tlen = ticket_seal(ticket, host->host, host->key);
+    tlen_be[0] = (unsigned char)(tlen >> 8);
+    tlen_be[1] = (unsigned char)(tlen);
+    crypto_generichash_update(&st, tlen_be, 2);
+    crypto_generichash_update(&st, ticket, tlen);
+    crypto_generichash_final(&st, hash, sizeof hash);
+    sodium_memzero(secret, sizeof secret);
+
+    hs_reply(a, HS_OK, server_pk, flags, hash, ticket, tlen);
+    if (resume) {
+        vtun_syslog(LOG_INFO, "Session %s resumed", host->host);
+    }
+
+    a->host = NULL;
+    *hostp = host;
+    return 1;
+
+fail:
+    sodium_memzero(secret, sizeof secret);
+    hs_reply(a, status, NULL, NULL, NULL, NULL, 0);
+    return -1;
+}
+
+/* Greeting of the server */
+void auth_greet(int fd)
+{
+    print_p(fd, "VTUN server ver %s" HS_TOKEN "\n", VTUN_VER);
+}
+
+/* Start authentication, sends greeting to the client */
+struct vtun_auth *auth_server_start(int fd)
+{
+    struct vtun_auth *a;
+
+    if ((a = sodium_malloc(sizeof *a)) == NULL) {
+        return NULL;
+    }
+    memset(a, 0, sizeof *a);
+    a->fd = fd;
+    a->stage = ST_INIT;
+    a->want = 4;
+
+    /* Listener has greeted the client */
+    if (!hs_gated) {
+        auth_greet(fd);
+    }
+
+    return a;
+}
+
+/* Where the next bytes from the client go and how many are missing */
+char *auth_server_need(struct vtun_auth *a, int *len)
+{
+    *len = a->want - a->have;
+    return a->msg + a->have;
+}
+
+/* MAC of the client's key in the text handshake, it's left in hash */
+static int ckey_mac(const unsigned char *ckey, const unsigned char *akey, unsigned char *hash)
+{
+    crypto_generichash(hash, crypto_generichash_BYTES,
+                       ckey, 4 + crypto_scalarmult_BYTES,
+                       akey, crypto_generichash_KEYBYTES);
+
+    return sodium_memcmp(hash, ckey + 4 + crypto_scalarmult_BYTES, crypto_generichash_BYTES);
+}
+
+/* Process text message of the old handshake */
+static int auth_server_step(struct vtun_auth *a, char *buf, struct vtun_host **hostp)
+{
+    char          *str1, *str2, *str3;
+    unsigned char cack[crypto_generichash_BYTES];
+    unsigned char server_pk[crypto_scalarmult_BYTES];
+    unsigned char ckey[4 + crypto_scalarmult_BYTES + crypto_generichash_BYTES];
+    unsigned char dhkey[crypto_scalarmult_BYTES];
+    char          skey_hex[2 * (crypto_scalarmult_BYTES + crypto_generichash_BYTES) + 1];
+    unsigned char hash[crypto_generichash_BYTES];
+    unsigned char flhash[crypto_generichash_BYTES];
+    char          flhash_hex[2 * crypto_generichash_BYTES + 1];
+    struct        vtun_host *host = a->host;
+    char         *flags;
+    crypto_generichash_state st;
+    time_t        client_now;
+    size_t        bin_len;
+    int           fd = a->fd;
+
+    buf[VTUN_MESG_SIZE - 1] = '\0';
+    strtok(buf, "\r\n");
+    if (!(str1 = strtok(buf, " :"))) {
+        goto fail;
+    }
+    if (!(str2 = strtok(NULL, " :"))) {
+        goto fail;
+    }
+    switch (a->stage) {
+    case ST_STEP2:
+        if (strcmp(str1, "CKEY")) {
+            break;
+        }
+        if (!(str3 = strtok(NULL, " \t"))) {
+            break;
+        }
+        sodium_hex2bin(ckey, sizeof ckey, str3, strlen(str3), "", &bin_len, NULL);
+        if (bin_len != sizeof ckey) {
+            break;
+        }
+        client_now = ((time_t) ckey[0]) << 24 | ((time_t) ckey[1]) << 16 |
+            ((time_t) ckey[2]) << 9 | ((time_t) ckey[3]);
+        (void) client_now;
+        if ((host = a->host = auth_find_host(str2)) == NULL) {
+            break;
+        }
+        if (ckey_mac(ckey, host->akey, hash) != 0) {
+            break;
+        }
+        memcpy(a->client_pk, ckey + 4, sizeof a->client_pk);
+        randombytes_buf(a->server_sk, crypto_scalarmult_SCALARBYTES);
+        crypto_scalarmult_base(server_pk, a->server_sk);
+        memcpy(a->skey, server_pk, sizeof server_pk);
+        memcpy(a->skey + crypto_scalarmult_BYTES, hash, sizeof hash);
+        crypto_generichash(a->skey + crypto_scalarmult_BYTES, crypto_scalarmult_BYTES,
+                           a->skey, sizeof a->skey,
+                           host->akey, crypto_generichash_KEYBYTES);
+        sodium_bin2hex(skey_hex, sizeof skey_hex, a->skey, sizeof a->skey);
+        print_p(fd, "SKEY: %s\n", skey_hex);
+        a->stage = ST_STEP3;
+        return 0;
+
+    case ST_STEP3:
+        if (strcmp(str1, "CACK")) {
+            break;
+        }
+        sodium_hex2bin(cack, sizeof cack, str2, strlen(str2), "", &bin_len, NULL);
+        if (bin_len != sizeof cack) {
+            break;
+        }
+        crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
+                                crypto_generichash_BYTES);
+        crypto_generichash_update(&st, (const unsigned char *) "CACK", 4);
+        crypto_generichash_update(&st, a->skey, sizeof a->skey);
+        crypto_generichash_final(&st, hash, sizeof hash);
+        if (sodium_memcmp(hash, cack, sizeof hash) != 0) {
+            break;
+        }
+        if ((flags = auth_accept(a, host)) == NULL) {
+            break;
+        }
+        crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
+                                crypto_generichash_BYTES);
+        crypto_generichash_update(&st, (const unsigned char *) flags, strlen(flags));
+        crypto_generichash_update(&st, cack, sizeof cack);
+        crypto_generichash_final(&st, flhash, sizeof flhash);
+        sodium_bin2hex(flhash_hex, sizeof flhash_hex, flhash, sizeof flhash);
+        print_p(fd, "FLAGS: %s %s\n", flags, flhash_hex);
+
+        if (crypto_scalarmult(dhkey, a->server_sk, a->client_pk) != 0) {
+            unlock_host(host);
+            break;
+        }
+        sodium_memzero(a->server_sk, sizeof a->server_sk);
+        if ((host->key = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+            abort();
+        }
+        crypto_generichash(host->key, HOST_KEYBYTES, dhkey, sizeof dhkey,
+                           host->akey, crypto_generichash_KEYBYTES);
+        sodium_memzero(dhkey, sizeof dhkey);
+        a->host = NULL;
+        *hostp = host;
+        return 1;
+    }
+fail:
+    print_p(fd, "ERR\n");
+    return -1;
+}
+
+/* 
+ * Account len bytes stored where auth_server_need() pointed.
+ * Returns:
+ *    0 - more data needed
+ *    1 - client authenticated, *hostp is set
+ *   -1 - authentication failed, the client has been told so
+ */
+int auth_server_input(struct vtun_auth *a, int len, struct vtun_host **hostp)
+{
+    int ret;
+
+    if ((a->have += len) < a->want) {
+        return 0;
+    }
+    switch (a->stage) {
+    case ST_INIT:
+        if (memcmp(a->msg, HS_MAGIC, 4) == 0) {
+            a->stage = ST_BIN;
+            a->want = HS_HELLO_LEN;
+        } else if (memcmp(a->msg, HS_RESUME, 4) == 0) {
+            a->stage = ST_RES;
+            a->want = HS_RESUME_LEN;
+        } else {
+            /* Text handshake, CKEY message */
+            a->stage = ST_STEP2;
+            a->want = VTUN_MESG_SIZE;
+        }
+        return 0;
+
+    case ST_BIN:
+        if (a->msg[HS_HELLO_LEN - 1] == 0) {
+            hs_reply(a, HS_DENY, NULL, NULL, NULL, NULL, 0);
+            return -1;
+        }
+        a->stage = ST_BIN_HOST;
+        a->want += (unsigned char) a->msg[HS_HELLO_LEN - 1];
+        return 0;
+
+    case ST_RES:
+        len = (unsigned char) a->msg[HS_RESUME_LEN - 2] << 8 |
+            (unsigned char) a->msg[HS_RESUME_LEN - 1];
+        if (len == 0 || len > TICKET_MAX) {
+            hs_reply(a, HS_RETRY, NULL, NULL, NULL, NULL, 0);
+            return -1;
+        }
+        a->stage = ST_RES_TICKET;
+        a->want += len;
+        return 0;
+
+    case ST_BIN_HOST:
+    case ST_RES_TICKET:
+        return auth_server_hello(a, hostp);
+    }
+
+    a->have = 0;
+    if ((ret = auth_server_step(a, a->msg, hostp)) == 0) {
+        a->want = VTUN_MESG_SIZE;
+    }
+    return ret;
+}
+
+/* Release authentication state */
+void auth_server_free(struct vtun_auth *a)
+{
+    if (a == NULL) {
+        return;
+    }
+    /* Private copy of the host which didn't pass authentication */
+    if (a->host && vtun.svr_type == VTUN_EVENT) {
+        free_host(a->host, NULL);
+    }
+    sodium_free(a);
+}
+
+/* Authentication (Server side) */
+struct vtun_host *auth_server(int fd)
+{
+    struct        vtun_auth *a;
+    struct        vtun_host *host = NULL;
+    char         *buf;
+    int           len, ret = 0;
+
+    set_title("authentication");
+
+    if ((a = auth_server_start(fd)) == NULL) {
+        return NULL;
+    }
+    while (ret == 0) {
+        buf = auth_server_need(a, &len);
+        if (readn_t(fd, buf, len, vtun.timeout) <= 0) {
+            break;
+        }
+        ret = auth_server_input(a, len, &host);
+    }
+    if (ret == 0) {
+        print_p(fd, "ERR\n");
+    }
+    auth_server_free(a);
+
+    return host;
+}
+
+/* 
+ * Length of the binary hello which starts in msg,
+ * 0 if more bytes are needed to tell, -1 if it is malformed.
+ */
+static int hs_hello_len(const unsigned char *msg, int len)
+{
+    int tlen;
+
+    if (memcmp(msg, HS_MAGIC, 4) == 0) {
+        if (len < HS_HELLO_LEN) {
+            return 0;
+        }
+        return msg[HS_HELLO_LEN - 1] ? HS_HELLO_LEN + msg[HS_HELLO_LEN - 1] : -1;
+    }
+    if (len < HS_RESUME_LEN) {
+        return 0;
+    }
+    tlen = msg[HS_RESUME_LEN - 2] << 8 | msg[HS_RESUME_LEN - 1];
+
+    return (tlen == 0 || tlen > TICKET_MAX) ? -1 : HS_RESUME_LEN + tlen;
+}
+
+/* 
+ * Listener's check of a complete binary hello: the host is known,
+ * the MAC is right and the hello wasn't seen before. Only hashes
+ * are computed, the key exchange is left to the session process.
+ * Returns HS_OK or the status the client should get.
+ */
+static int hs_gate_hello(const unsigned char *msg, int len)
+{
+    unsigned char secret[HOST_KEYBYTES];
+    char          name[256];
+    struct        vtun_host *host;
+    int32_t       skew;
+    int           bad;
+
+    if (memcmp(msg, HS_RESUME, 4) == 0) {
+        if (ticket_open(msg + HS_RESUME_LEN, len - HS_RESUME_LEN, name, secret) != 0) {
+            return HS_RETRY;
+        }
+        bad = hs_hello_mac(msg, len, secret);
+        sodium_memzero(secret, sizeof secret);
+    } else {
+        memcpy(name, msg + HS_HELLO_LEN, msg[HS_HELLO_LEN - 1]);
+        name[msg[HS_HELLO_LEN - 1]] = '\0';
+        bad = (host = lookup_host(name)) == NULL || derive_key(host) != 0 ||
+            hs_hello_mac(msg, len, host->akey) != 0;
+    }
+    if (bad) {
+        return HS_DENY;
+    }
+    /* Session process tells the client its clock is off */
+    skew = hs_skew(msg);
+    if (skew > HS_WINDOW || skew < -HS_WINDOW) {
+        return HS_OK;
+    }
+    if (hs_replayed(&hs_seen, msg + 8 + crypto_scalarmult_BYTES, time(NULL))) {
+        vtun_syslog(LOG_ERR, "Replayed handshake for %s", name);
+        return HS_DENY;
+    }
+    return HS_OK;
+}
+
+/* 
+ * Pre-authentication gate of the forking server. The listener greets
+ * the client with auth_greet() and checks its first message here
+ * before a process is spent on it. Only the MAC is checked, the message
+ * stays in the socket for the session process to read again.
+ * Returns:
+ *    1 - the connection may be handed to a session process
+ *    0 - the message is not complete yet
+ *   -1 - the connection should be closed, the client has been told so
+ */
+int auth_gate(int fd)
+{
+    static struct vtun_auth gate;
+    unsigned char *msg = (unsigned char *) gate.msg;
+    unsigned char ckey[4 + crypto_scalarmult_BYTES + crypto_generichash_BYTES];
+    unsigned char hash[crypto_generichash_BYTES];
+    char         *str1, *str2, *str3;
+    struct        vtun_host *host;
+    size_t        bin_len;
+    int           len, status;
+
+    hs_gated = 1;
+    gate.fd = fd;
+    if ((len = recv(fd, gate.msg, sizeof gate.msg, MSG_PEEK | MSG_DONTWAIT)) <= 0) {
+        return (len < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+    }
+    if (len < 4) {
+        return 0;
+    }
+
+    if (memcmp(msg, HS_MAGIC, 4) == 0 || memcmp(msg, HS_RESUME, 4) == 0) {
+        if ((status = hs_hello_len(msg, len)) == 0 || status > len) {
+            return 0;
+        }
+        if (status < 0) {
+            status = memcmp(msg, HS_RESUME, 4) ? HS_DENY : HS_RETRY;
+        } else if ((status = hs_gate_hello(msg, status)) == HS_OK) {
+            return 1;
+        }
+        hs_reply(&gate, status, NULL, NULL, NULL, NULL, 0);
+        return -1;
+    }
+
+    /* Text handshake, messages are VTUN_MESG_SIZE long */
+    if (len < VTUN_MESG_SIZE) {
+        return 0;
+    }
+    gate.msg[VTUN_MESG_SIZE - 1] = '\0';
+    strtok(gate.msg, "\r\n");
+    if ((str1 = strtok(gate.msg, " :")) && !strcmp(str1, "CKEY") &&
+        (str2 = strtok(NULL, " :")) && (str3 = strtok(NULL, " \t")) &&
+        sodium_hex2bin(ckey, sizeof ckey, str3, strlen(str3), "", &bin_len, NULL) == 0 &&
+        bin_len == sizeof ckey && (host = lookup_host(str2)) != NULL &&
+        derive_key(host) == 0 && ckey_mac(ckey, host->akey, hash) == 0) {
+        return 1;
+    }
+    print_p(fd, "ERR\n");
+    return -1;
+}
+
+/* 
+ * Cookie proves the client receives at its address. It depends
+ * on the address and the time slot only, the server keeps no state
+ * for clients which haven't proved it.
+ */
+static void hs_cookie(unsigned char *cookie, struct sockaddr_in *from, time_t t)
+{
+    crypto_generichash_state st;
+    uint32_t      slot = t / HS_COOKIE_LIFE;
+
+    crypto_generichash_init(&st, cookie_key, sizeof cookie_key, HS_COOKIE_LEN);
+    crypto_generichash_update(&st, (unsigned char *) &from->sin_addr, sizeof from->sin_addr);
+    crypto_generichash_update(&st, (unsigned char *) &slot, sizeof slot);
+    crypto_generichash_final(&st, cookie, HS_COOKIE_LEN);
+}
+
+/* 
+ * Datagram on the server's UDP port. Clients without a valid cookie
+ * get one and send the hello again.
+ * Returns 1 if a session should be started for the hello,
+ * 0 if the datagram was answered or dropped.
+ */
+int auth_udp_accept(int fd, struct sockaddr_in *from, char *pkt, int len)
+{
+    static struct vtun_auth gate;
+    unsigned char cookie[4 + HS_COOKIE_LEN];
+    unsigned char *hello = (unsigned char *) pkt + 4 + HS_COOKIE_LEN;
+    time_t        now = time(NULL);
+    int           hlen = len - 4 - HS_COOKIE_LEN, status;
+
+    hs_gated = 1;
+    if (!ticket_ready || len < 4 + HS_COOKIE_LEN + HS_HELLO_LEN ||
+        len > 4 + HS_COOKIE_LEN + HS_RESUME_LEN + TICKET_MAX || memcmp(pkt, HS_UDP, 4)) {
+        return 0;
+    }
+    hs_cookie(cookie + 4, from, now - HS_COOKIE_LIFE);
+    if (sodium_memcmp(cookie + 4, pkt + 4, HS_COOKIE_LEN) != 0) {
+        hs_cookie(cookie + 4, from, now);
+        if (sodium_memcmp(cookie + 4, pkt + 4, HS_COOKIE_LEN) != 0) {
+            memcpy(cookie, HS_COOKIE, 4);
+            sendto(fd, cookie, sizeof cookie, 0, (struct sockaddr *) from, sizeof *from);
+            return 0;
+        }
+    }
+    if ((memcmp(hello, HS_MAGIC, 4) && memcmp(hello, HS_RESUME, 4)) ||
+        hs_hello_len(hello, hlen) != hlen) {
+        return 0;
+    }
+    /* Retransmitted hello, its session is being set up already */
+    if (hs_replayed(&udp_seen, hello + 8 + crypto_scalarmult_BYTES, now)) {
+        return 0;
+    }
+    if ((status = hs_gate_hello(hello, hlen)) != HS_OK) {
+        /* Cookie has proved the address, the reply goes there */
+        gate.fd = -1;
+        hs_reply(&gate, status, NULL, NULL, NULL, NULL, 0);
+        sendto(fd, gate.rep, gate.rep_len, 0, (struct sockaddr *) from, sizeof *from);
+        return 0;
+    }
+    return 1;
+}
+
+/* 
+ * Authentication over UDP (Server side). fd is connected to the
+ * client, pkt is the datagram accepted by auth_udp_accept().
+ */
+struct vtun_host *auth_server_udp(int fd, char *pkt, int len)
+{
+    struct        vtun_auth *a;
+    struct        vtun_host *host = NULL;
+    struct        timeval tv;
+    fd_set        fdset;
+    char         *buf;
+    int           need, ret = 0, i, answered = 0;
+
+    set_title("authentication");
+
+    if ((a = sodium_malloc(sizeof *a)) == NULL) {
+        return NULL;
+    }
+    memset(a, 0, sizeof *a);
+    a->fd = fd;
+    a->stage = ST_INIT;
+    a->want = 4;
+    a->udp = 1;
+
+    /* Whole hello is in the datagram */
+    pkt += 4 + HS_COOKIE_LEN;
+    len -= 4 + HS_COOKIE_LEN;
+    while (ret == 0 && len > 0) {
+        buf = auth_server_need(a, &need);
+        need = min(need, len);
+        memcpy(buf, pkt, need);
+        pkt += need;
+        len -= need;
+        ret = auth_server_input(a, need, &host);
+    }
+
+    /* Reply may get lost, repeat it until the client talks */
+    for (i = 0; ret == 1 && i < HS_UDP_TRIES; i++) {
+        tv.tv_sec = 1 << i;
+        tv.tv_usec = 0;
+        FD_ZERO(&fdset);
+        FD_SET(fd, &fdset);
+        if (select(fd + 1, &fdset, NULL, NULL, &tv) > 0) {
+            answered = 1;
+            break;
+        }
+        if (write(fd, a->rep, a->rep_len) != a->rep_len) {
+            vtun_syslog(LOG_ERR, "Can't send reply to %s over UDP", host->host);
+            break;
+        }
+    }
+    if (ret == 1 && !answered) {
+        if (i == HS_UDP_TRIES) {
+            vtun_syslog(LOG_INFO, "No answer from %s over UDP", host->host);
+        }
+        unlock_host(host);
+        host = NULL;
+    }
+    auth_server_free(a);
+
+    return host;
+}
+
+/* Text handshake (Client side) */
+static int auth_client_text(int fd, struct vtun_host *host)
+{
+    char          buf[VTUN_MESG_SIZE], *str1, *str2, *str3;
+    unsigned char cack[crypto_generichash_BYTES];
+    char          cack_hex[2 * crypto_generichash_BYTES + 1];
+    unsigned char flhash[crypto_generichash_BYTES];
     unsigned char hash[crypto_generichash_BYTES];
     unsigned char client_pk[crypto_scalarmult_BYTES];
     unsigned char client_sk[crypto_scalarmult_SCALARBYTES];
@@ -378,9 +1560,6 @@ int auth_client(int fd, struct vtun_host *host)
 
     stage = ST_INIT;
 
-    if (derive_key(host) != 0) {
-        return 0;
-    }
     while (readn_t(fd, buf, VTUN_MESG_SIZE, vtun.timeout) > 0) {
         buf[sizeof(buf) - 1] = '\0';
         strtok(buf, "\r\n");
@@ -478,3 +1657,317 @@ int auth_client(int fd, struct vtun_host *host)
 
     return success;
 }
+
+/* Drop the ticket, next connection does full handshake */
+static void ticket_forget(struct vtun_host *host)
+{
+    free(host->ticket);
+    host->ticket = NULL;
+    host->ticket_len = 0;
+    if (host->resume) {
+        sodium_free(host->resume);
+        host->resume = NULL;
+    }
+}
+
+/* Client side of the binary handshake */
+struct hs_client {
+    unsigned char msg[HS_RESUME_LEN + TICKET_MAX];
+    int           len;
+    int           resume;
+    unsigned char client_sk[crypto_scalarmult_SCALARBYTES];
+    unsigned char *psk;
+};
+#define HS_CLIENT_MAC(c) ((c)->msg + 8 + crypto_scalarmult_BYTES)
+
+/* Build the hello, full or with the ticket */
+static void hs_hello(struct hs_client *c, struct vtun_host *host)
+{
+    unsigned char *client_pk = c->msg + 8;
+    crypto_generichash_state st;
+    time_t        now = time(NULL);
+
+    c->resume = (host->ticket != NULL);
+    c->msg[4] = (unsigned char)(now >> 24);
+    c->msg[5] = (unsigned char)(now >> 16);
+    c->msg[6] = (unsigned char)(now >> 8);
+    c->msg[7] = (unsigned char)(now);
+    if (c->resume) {
+        memcpy(c->msg, HS_RESUME, 4);
+        randombytes_buf(client_pk, crypto_scalarmult_BYTES);
+        c->msg[HS_RESUME_LEN - 2] = (unsigned char)(host->ticket_len >> 8);
+        c->msg[HS_RESUME_LEN - 1] = (unsigned char)(host->ticket_len);
+        memcpy(c->msg + HS_RESUME_LEN, host->ticket, host->ticket_len);
+        c->len = HS_RESUME_LEN + host->ticket_len;
+        c->psk = host->resume;
+    } else {
+        memcpy(c->msg, HS_MAGIC, 4);
+        randombytes_buf(c->client_sk, sizeof c->client_sk);
+        crypto_scalarmult_base(client_pk, c->client_sk);
+        c->len = strlen(host->host);
+        c->msg[HS_HELLO_LEN - 1] = c->len;
+        memcpy(c->msg + HS_HELLO_LEN, host->host, c->len);
+        c->len += HS_HELLO_LEN;
+        c->psk = host->akey;
+    }
+    crypto_generichash_init(&st, c->psk, crypto_generichash_KEYBYTES,
+                            crypto_generichash_BYTES);
+    crypto_generichash_update(&st, c->msg, 8 + crypto_scalarmult_BYTES);
+    crypto_generichash_update(&st, c->msg + HS_HELLO_LEN - 1, c->len - (HS_HELLO_LEN - 1));
+    crypto_generichash_final(&st, HS_CLIENT_MAC(c), crypto_generichash_BYTES);
+}
+
+/* 
+ * Verify the reply of len bytes and set up the session key.
+ * Returns 1 on success, 0 if denied, -1 if the handshake
+ * has to be repeated. If more bytes are needed *need is set.
+ */
+static int hs_finish(struct hs_client *c, struct vtun_host *host,
+                     unsigned char *rep, int len, int *need)
+{
+    unsigned char *server_pk = rep + 5;
+    unsigned char dhkey[crypto_scalarmult_BYTES];
+    unsigned char hash[crypto_generichash_BYTES];
+    crypto_generichash_state st;
+    char         *flags = (char *) rep + HS_REPLY_LEN;
+    int           flen, tlen;
+
+    *need = HS_REPLY_LEN;
+    if (len < HS_REPLY_LEN || memcmp(rep, HS_MAGIC, 4)) {
+        return 0;
+    }
+    if (rep[4] != HS_OK) {
+        if (c->resume) {
+            /* Server forgot us, try again from scratch */
+            ticket_forget(host);
+            return -1;
+        }
+        if (rep[4] == HS_RETRY) {
+            /* Not authenticated, don't remember it */
+            host->hs_legacy = HS_LEGACY_ONCE;
+            return -1;
+        }
+        return 0;
+    }
+    flen = rep[HS_REPLY_LEN - 1];
+    if (flen > HS_MAX_FLAGS) {
+        return 0;
+    }
+    *need = HS_REPLY_LEN + flen + crypto_generichash_BYTES + 2;
+    if (len < *need) {
+        return 0;
+    }
+    tlen = rep[*need - 2] << 8 | rep[*need - 1];
+    if (tlen > TICKET_MAX) {
+        return 0;
+    }
+    *need += tlen;
+    if (len < *need) {
+        return 0;
+    }
+    *need = 0;
+
+    crypto_generichash_init(&st, c->psk, crypto_generichash_KEYBYTES,
+                            crypto_generichash_BYTES);
+    crypto_generichash_update(&st, rep, HS_REPLY_LEN + flen);
+    crypto_generichash_update(&st, HS_CLIENT_MAC(c), crypto_generichash_BYTES);
+    crypto_generichash_update(&st, rep + HS_REPLY_LEN + flen + crypto_generichash_BYTES, 2 + tlen);
+    crypto_generichash_final(&st, hash, sizeof hash);
+    if (sodium_memcmp(hash, rep + HS_REPLY_LEN + flen, sizeof hash) != 0) {
+        return 0;
+    }
+    memmove(flags + flen + 1, flags + flen, crypto_generichash_BYTES + 2 + tlen);
+    flags[flen] = '\0';
+    if (cf2bf(flags, host) != 0) {
+        return 0;
+    }
+    if ((host->key = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+        abort();
+    }
+    if (c->resume) {
+        crypto_generichash_init(&st, c->psk, HOST_KEYBYTES, HOST_KEYBYTES);
+        crypto_generichash_update(&st, HS_CLIENT_MAC(c), crypto_generichash_BYTES);
+        crypto_generichash_update(&st, server_pk, crypto_scalarmult_BYTES);
+        crypto_generichash_final(&st, host->key, HOST_KEYBYTES);
+    } else {
+        if (crypto_scalarmult(dhkey, c->client_sk, server_pk) != 0) {
+            sodium_free(host->key);
+            host->key = NULL;
+            return 0;
+        }
+        sodium_memzero(c->client_sk, sizeof c->client_sk);
+        crypto_generichash_init(&st, host->akey, crypto_generichash_KEYBYTES,
+                                HOST_KEYBYTES);
+        crypto_generichash_update(&st, dhkey, sizeof dhkey);
+        crypto_generichash_update(&st, HS_CLIENT_MAC(c), crypto_generichash_BYTES);
+        crypto_generichash_update(&st, server_pk, crypto_scalarmult_BYTES);
+        crypto_generichash_final(&st, host->key, HOST_KEYBYTES);
+        sodium_memzero(dhkey, sizeof dhkey);
+    }
+
+    /* Keep the new ticket for the next connection */
+    ticket_forget(host);
+    if (tlen) {
+        if ((host->ticket = malloc(tlen)) == NULL ||
+            (host->resume = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+            abort();
+        }
+        memcpy(host->ticket, flags + flen + 1 + crypto_generichash_BYTES + 2, tlen);
+        host->ticket_len = tlen;
+        ticket_secret(host->resume, host->key);
+    }
+    host->resumed = c->resume;
+
+    return 1;
+}
+
+/* One round trip handshake (Client side) */
+static int auth_client_hello(int fd, struct vtun_host *host)
+{
+    unsigned char rep[HS_REPLY_LEN + HS_MAX_FLAGS + 1 + crypto_generichash_BYTES + 2 + TICKET_MAX];
+    char          buf[VTUN_MESG_SIZE];
+    struct        hs_client c;
+    int           len = 0, need, ret;
+
+    hs_hello(&c, host);
+    if (write_n(fd, (char *) c.msg, c.len) < 0) {
+        return 0;
+    }
+
+    /* Greeting tells whether the server understood us */
+    if (readn_t(fd, buf, VTUN_MESG_SIZE, vtun.timeout) <= 0) {
+        return 0;
+    }
+    buf[sizeof(buf) - 1] = '\0';
+    strtok(buf, "\r\n");
+    if (strncmp(buf, "VTUN", 4)) {
+        return 0;
+    }
+    if (!strstr(buf, HS_TOKEN)) {
+        vtun_syslog(LOG_INFO, "Server doesn't know one round trip handshake");
+        ticket_forget(host);
+        host->hs_legacy = HS_LEGACY_ONCE;
+        return -1;
+    }
+
+    /* Reply comes in parts, each tells the length of the next */
+    need = HS_REPLY_LEN;
+    do {
+        if (readn_t(fd, rep + len, need - len, vtun.timeout) <= 0) {
+            ret = 0;
+            break;
+        }
+        len = need;
+        ret = hs_finish(&c, host, rep, len, &need);
+    } while (need > len);
+    sodium_memzero(&c, sizeof c);
+
+    return ret;
+}
+
+/* 
+ * Authentication (Client side)
+ * Returns 1 on success, 0 if denied, -1 if the handshake
+ * has to be repeated and the caller should connect again.
+ */
+int auth_client(int fd, struct vtun_host *host)
+{
+    int ret;
+
+    host->resumed = 0;
+    if (host->ticket) {
+        return auth_client_hello(fd, host);
+    }
+    if (derive_key(host) != 0) {
+        return 0;
+    }
+    if (!host->hs_legacy && strlen(host->host) <= 255) {
+        return auth_client_hello(fd, host);
+    }
+
+    /* 
+     * Anybody on the path can ask for the text handshake, the
+     * server is known to need it only once it authenticated
+     */
+    if (host->hs_legacy == HS_LEGACY_ONCE) {
+        host->hs_legacy = 0;
+    }
+    if ((ret = auth_client_text(fd, host)) == 1) {
+        host->hs_legacy = HS_LEGACY_SERVER;
+    }
+    return ret;
+}
+
+/* 
+ * Handshake over UDP (Client side). fd is an unconnected datagram
+ * socket, it gets connected to the server's socket of the session.
+ * Returns like auth_client().
+ */
+int auth_client_udp(int fd, struct sockaddr_in *svr, struct vtun_host *host)
+{
+    unsigned char pkt[4 + HS_COOKIE_LEN + HS_RESUME_LEN + TICKET_MAX];
+    unsigned char rep[HS_REPLY_LEN + HS_MAX_FLAGS + 1 + crypto_generichash_BYTES + 2 + TICKET_MAX];
+    unsigned short echo = htons(VTUN_ECHO_REQ);
+    struct        hs_client c;
+    struct        sockaddr_in from;
+    socklen_t     fromlen;
+    struct        timeval tv;
+    fd_set        fdset;
+    time_t        end = time(NULL) + host->timeout;
+    int           wait = 1, tries = 0, answered = 0, len, need, ret = 0;
+
+    host->resumed = 0;
+    if (!host->ticket && derive_key(host) != 0) {
+        return 0;
+    }
+    hs_hello(&c, host);
+    memcpy(pkt, HS_UDP, 4);
+    memcpy(pkt + 4 + HS_COOKIE_LEN, c.msg, c.len);
+
+    while (time(NULL) < end && (answered || tries++ < HS_UDP_TRIES)) {
+        /* Cookie of the last attempt, zeroes the first time */
+        memcpy(pkt + 4, host->cookie, HS_COOKIE_LEN);
+        sendto(fd, pkt, 4 + HS_COOKIE_LEN + c.len, 0, (struct sockaddr *) svr, sizeof *svr);
+
+        tv.tv_sec = wait;
+        tv.tv_usec = 0;
+        FD_ZERO(&fdset);
+        FD_SET(fd, &fdset);
+        if (select(fd + 1, &fdset, NULL, NULL, &tv) <= 0) {
+            wait *= 2;
+            continue;
+        }
+        fromlen = sizeof from;
+        if ((len = recvfrom(fd, rep, sizeof rep - 1, 0,
+                            (struct sockaddr *) &from, &fromlen)) < 4) {
+            continue;
+        }
+        answered = 1;
+        if (!memcmp(rep, HS_COOKIE, 4)) {
+            if (len == 4 + HS_COOKIE_LEN && from.sin_addr.s_addr == svr->sin_addr.s_addr) {
+                memcpy(host->cookie, rep + 4, HS_COOKIE_LEN);
+            }
+            continue;
+        }
+        /* Reply comes from the socket of the session */
+        if ((ret = hs_finish(&c, host, rep, len, &need)) == 1) {
+            if (connect(fd, (struct sockaddr *) &from, fromlen)) {
+                vtun_syslog(LOG_ERR, "Can't connect socket");
+                ret = 0;
+            } else {
+                /* Tell the server the reply made it */
+                send(fd, &echo, sizeof echo, 0);
+            }
+        }
+        break;
+    }
+    if (!answered) {
+        /* Server doesn't speak UDP handshake */
+        vtun_syslog(LOG_INFO, "No answer over UDP, using TCP");
+        host->hs_tcp = 1;
+        ret = -1;
+    }
+    sodium_memzero(&c, sizeof c);
+
+    return ret;
+}
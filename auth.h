@@ -23,6 +23,25 @@
 #define ST_INIT  0
 #define ST_STEP2 1
 #define ST_STEP3 2
+#define ST_BIN   3
+#define ST_BIN_HOST 4
+#define ST_RES   5
+#define ST_RES_TICKET 6
+
+struct vtun_auth;
+struct sockaddr_in;
 
 struct vtun_host * auth_server(int fd);
+struct vtun_auth * auth_server_start(int fd);
+char *auth_server_need(struct vtun_auth *a, int *len);
+int  auth_server_input(struct vtun_auth *a, int len, struct vtun_host **host);
+void auth_server_free(struct vtun_auth *a);
 int auth_client(int fd, struct vtun_host *host);
+void auth_greet(int fd);
+int  auth_gate(int fd);
+int  auth_udp_accept(int fd, struct sockaddr_in *from, char *pkt, int len);
+struct vtun_host * auth_server_udp(int fd, char *pkt, int len);
+int auth_client_udp(int fd, struct sockaddr_in *svr, struct vtun_host *host);
+void derive_host_keys(void);
+int  passwd_changed(struct vtun_host *host, struct vtun_host *h);
+void auth_ticket_init(void);
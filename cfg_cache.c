@@ -0,0 +1,682 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Compiled config cache.
+ *
+ * Hosts and options of the config file are kept in VTUN_CFG_CACHE
+ * together with the hash index of the hosts, so the file doesn't
+ * have to be parsed on every start. Cache is valid while the config
+ * file is the same (device, inode, size, mtime and ctime) and is
+ * written again after the file is parsed otherwise. It holds the
+ * passwords, it is created mode 600 and used only if it belongs
+ * to us and is not accessible by others.
+ *
+ * Servers decode all hosts. Inetd server and client keep the cache
+ * mapped and decode only the hosts they look up.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "vtun.h"
+#include "lib.h"
+#include "cfg_cache.h"
+
+#define CC_MAGIC	0x43435456	/* VTCC */
+#define CC_VERSION	3
+
+/* Offsets are from the start of the file, 0 is NULL */
+struct cc_opts {
+   int  port;
+   int  svr_type;
+   int  timeout;
+   int  persist;
+   int  workers;
+   int  backlog;
+   int  fastopen;
+   int  udpmux;
+   int  ratelimit;
+   int  syslog;
+   int  bind_type;
+   unsigned int bind_name;
+   unsigned int svr_addr;
+   unsigned int ppp;
+   unsigned int ifcfg;
+   unsigned int route;
+   unsigned int fwall;
+   unsigned int iproute;
+   unsigned int keycache;
+};
+
+struct cc_head {
+   unsigned int magic;
+   int  version;
+   int  host_size;	/* Layout of the structures it was written with */
+   int  opts_size;
+
+   /* Config file it was compiled from */
+   unsigned int path;
+   unsigned long long dev, ino, size;
+   long long mtime, mtime_ns, ctime, ctime_ns;
+
+   struct cc_opts opts;
+
+   unsigned int nhosts;
+   unsigned int hosts;	/* Host records in the order of the file */
+   unsigned int mask;	/* Index size - 1 */
+   unsigned int index;	/* Hash index of host records */
+};
+
+struct cc_cmd {
+   unsigned int prog;
+   unsigned int args;
+   int  flags;
+};
+
+struct cc_path {
+   unsigned int name;
+   int  type;
+};
+
+struct cc_host {
+   unsigned int host;
+   unsigned int passwd;
+   unsigned int dev;
+   int  flags;
+   int  timeout;
+   int  spd_in;
+   int  spd_out;
+   int  zlevel;
+   int  cipher;
+   int  dedup;
+   int  fec;
+   int  persist;
+   int  multi;
+   int  pool;
+   int  buffer;
+   int  ka_interval;
+   int  ka_maxfail;
+   unsigned int src_name;
+   int  src_port;
+   int  src_type;
+   unsigned int up, nup;
+   unsigned int down, ndown;
+   unsigned int paths, npaths;
+};
+
+/* Mapped cache of the inetd server and client */
+static char *cc_map;
+static size_t cc_len;
+
+/********** Loading *************/
+
+static char * cc_str(char *map, size_t len, unsigned int off)
+{
+     if( !off || off >= len || !memchr(map + off, '\0', len - off) )
+        return NULL;
+     return map + off;
+}
+
+static int cc_dup(char *map, size_t len, unsigned int off, char **str)
+{
+     char *s;
+
+     *str = NULL;
+     if( !off )
+        return 0;
+     if( !(s = cc_str(map, len, off)) || !(*str = strdup(s)) )
+        return -1;
+     return 0;
+}
+
+static void * cc_ptr(char *map, size_t len, unsigned int off, size_t n, size_t size)
+{
+     if( off % sizeof(int) || off > len || n > (len - off) / size )
+        return NULL;
+     return map + off;
+}
+
+static int cc_cmds(char *map, size_t len, unsigned int off, unsigned int n, llist *cmds)
+{
+     struct cc_cmd *c;
+     struct vtun_cmd *cmd;
+     unsigned int i;
+
+     llist_init(cmds);
+     if( n && !(c = cc_ptr(map, len, off, n, sizeof(*c))) )
+        return -1;
+     for(i = 0; i < n; i++){
+        if( !(cmd = calloc(1, sizeof(*cmd))) )
+	   return -1;
+	if( cc_dup(map, len, c[i].prog, &cmd->prog) ||
+	    cc_dup(map, len, c[i].args, &cmd->args) ){
+	   free(cmd->prog);
+	   free(cmd);
+	   return -1;
+	}
+	cmd->flags = c[i].flags;
+	llist_add(cmds, cmd);
+     }
+     return 0;
+}
+
+static int cc_paths(char *map, size_t len, unsigned int off, unsigned int n, llist *paths)
+{
+     struct cc_path *p;
+     struct vtun_addr *addr;
+     unsigned int i;
+
+     llist_init(paths);
+     if( n && !(p = cc_ptr(map, len, off, n, sizeof(*p))) )
+        return -1;
+     for(i = 0; i < n; i++){
+        if( !(addr = calloc(1, sizeof(*addr))) )
+	   return -1;
+	if( cc_dup(map, len, p[i].name, &addr->name) ){
+	   free(addr);
+	   return -1;
+	}
+	addr->type = p[i].type;
+	llist_add(paths, addr);
+     }
+     return 0;
+}
+
+/* Host from its record, released with free_host() */
+static struct vtun_host * cc_host(char *map, size_t len, unsigned int off)
+{
+     struct cc_host *r;
+     struct vtun_host *h;
+
+     if( !(r = cc_ptr(map, len, off, 1, sizeof(*r))) ||
+         !cc_str(map, len, r->host) || !(h = calloc(1, sizeof(*h))) )
+        return NULL;
+
+     h->loc_fd = h->rmt_fd = -1;
+     h->flags = r->flags;
+     h->timeout = r->timeout;
+     h->spd_in = r->spd_in;
+     h->spd_out = r->spd_out;
+     h->zlevel = r->zlevel;
+     h->cipher = r->cipher;
+     h->dedup = r->dedup;
+     h->fec = r->fec;
+     h->persist = r->persist;
+     h->multi = r->multi;
+     h->pool = r->pool;
+     h->buffer = r->buffer;
+     h->ka_interval = r->ka_interval;
+     h->ka_maxfail = r->ka_maxfail;
+     h->src_addr.port = r->src_port;
+     h->src_addr.type = r->src_type;
+
+     /* Empty lists are zeroed, free_host() releases what was decoded */
+     if( cc_dup(map, len, r->host, &h->host) ||
+         cc_dup(map, len, r->host, &h->sopt.host) ||
+         cc_dup(map, len, r->passwd, &h->passwd) ||
+         cc_dup(map, len, r->dev, &h->dev) ||
+	 (r->src_type && cc_dup(map, len, r->src_name, &h->src_addr.name)) ||
+         cc_cmds(map, len, r->up, r->nup, &h->up) ||
+         cc_cmds(map, len, r->down, r->ndown, &h->down) ||
+         cc_paths(map, len, r->paths, r->npaths, &h->paths) ){
+	free(h->sopt.host);
+        free(h->dev);
+        free_host(h, NULL);
+	return NULL;
+     }
+     return h;
+}
+
+static void cc_opt_str(char *map, size_t len, unsigned int off, char **opt)
+{
+     char *s;
+
+     if( (s = cc_str(map, len, off)) ){
+        free(*opt);
+	*opt = strdup(s);
+     }
+}
+
+/* Options are set the way the parser does, command line wins */
+static void cc_opts(char *map, size_t len, struct cc_opts *o)
+{
+     char *s;
+
+     if( vtun.bind_addr.port == -1 )
+        vtun.bind_addr.port = o->port;
+     if( vtun.svr_type == -1 )
+        vtun.svr_type = o->svr_type;
+     if( vtun.timeout == -1 )
+        vtun.timeout = o->timeout;
+     if( vtun.persist == -1 )
+        vtun.persist = o->persist;
+     if( vtun.workers == -1 )
+        vtun.workers = o->workers;
+     if( vtun.backlog == -1 )
+        vtun.backlog = o->backlog;
+     if( vtun.fastopen == -1 )
+        vtun.fastopen = o->fastopen;
+     if( vtun.udpmux == -1 )
+        vtun.udpmux = o->udpmux;
+     if( vtun.ratelimit == -1 )
+        vtun.ratelimit = o->ratelimit;
+     if( !vtun.svr_addr && (s = cc_str(map, len, o->svr_addr)) )
+        vtun.svr_addr = strdup(s);
+     if( (s = cc_str(map, len, o->bind_name)) ){
+        vtun.bind_addr.name = strdup(s);
+        vtun.bind_addr.type = o->bind_type;
+     }
+     cc_opt_str(map, len, o->ppp, &vtun.ppp);
+     cc_opt_str(map, len, o->ifcfg, &vtun.ifcfg);
+     cc_opt_str(map, len, o->route, &vtun.route);
+     cc_opt_str(map, len, o->fwall, &vtun.fwall);
+     cc_opt_str(map, len, o->iproute, &vtun.iproute);
+     cc_opt_str(map, len, o->keycache, &vtun.keycache);
+     vtun.syslog = o->syslog;
+}
+
+/* Config file as it was before it was parsed, cfg_cache_save() records it */
+static struct stat cc_st;
+static int cc_st_ok;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+#define CC_MTIME_NS(st)	((st)->st_mtim.tv_nsec)
+#define CC_CTIME_NS(st)	((st)->st_ctim.tv_nsec)
+#else
+#define CC_MTIME_NS(st)	0
+#define CC_CTIME_NS(st)	0
+#endif
+
+static int cc_fresh(struct cc_head *hd, char *map, size_t len, char *file)
+{
+     char *path;
+
+     return (path = cc_str(map, len, hd->path)) && !strcmp(path, file) &&
+	    hd->dev == (unsigned long long) cc_st.st_dev &&
+	    hd->ino == (unsigned long long) cc_st.st_ino &&
+	    hd->size == (unsigned long long) cc_st.st_size &&
+	    hd->mtime == (long long) cc_st.st_mtime &&
+	    hd->mtime_ns == (long long) CC_MTIME_NS(&cc_st) &&
+	    hd->ctime == (long long) cc_st.st_ctime &&
+	    hd->ctime_ns == (long long) CC_CTIME_NS(&cc_st);
+}
+
+static void cc_unmap(void)
+{
+#ifdef HAVE_SYS_MMAN_H
+     if( cc_map )
+        munmap(cc_map, cc_len);
+#endif
+     cc_map = NULL;
+     cc_len = 0;
+}
+
+/*
+ * Load options and hosts from the cache if it is up to date.
+ * In lazy mode hosts are decoded by cfg_cache_host() instead.
+ * Returns -1 if the config file has to be parsed.
+ */
+int cfg_cache_load(char *file, llist *hosts, int lazy)
+{
+#ifdef HAVE_SYS_MMAN_H
+     struct cc_head *hd;
+     struct vtun_host *h;
+     struct stat st;
+     unsigned int *recs, i;
+     char *map;
+     size_t len;
+     int fd;
+
+     cc_unmap();
+     if( !(cc_st_ok = !stat(file, &cc_st)) )
+        return -1;
+
+     if( (fd = open(VTUN_CFG_CACHE, O_RDONLY)) < 0 )
+        return -1;
+     if( fstat(fd, &st) || st.st_uid != geteuid() || (st.st_mode & 077) ||
+	 st.st_size < (off_t) sizeof(struct cc_head) ||
+	 (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ){
+        close(fd);
+	return -1;
+     }
+     close(fd);
+     len = st.st_size;
+     hd = (struct cc_head *) map;
+
+     if( hd->magic != CC_MAGIC || hd->version != CC_VERSION ||
+	 hd->host_size != sizeof(struct cc_host) ||
+	 hd->opts_size != sizeof(struct cc_opts) ||
+	 !cc_fresh(hd, map, len, file) ||
+	 !hd->nhosts || (hd->mask & (hd->mask + 1)) || hd->mask < 2 * hd->nhosts - 1 ||
+	 !cc_ptr(map, len, hd->index, (size_t) hd->mask + 1, sizeof(unsigned int)) ||
+	 !(recs = cc_ptr(map, len, hd->hosts, hd->nhosts, sizeof(unsigned int))) ){
+        munmap(map, len);
+	return -1;
+     }
+
+     cc_opts(map, len, &hd->opts);
+
+     if( lazy ){
+        cc_map = map;
+	cc_len = len;
+	return 0;
+     }
+
+     for(i = 0; i < hd->nhosts; i++){
+        if( !(h = cc_host(map, len, recs[i])) ){
+	   vtun_syslog(LOG_ERR,"Config cache %s is damaged", VTUN_CFG_CACHE);
+	   llist_free(hosts, free_host, NULL);
+	   munmap(map, len);
+	   return -1;
+	}
+	llist_add(hosts, h);
+     }
+     munmap(map, len);
+     return 0;
+#else
+     return -1;
+#endif
+}
+
+/* Number of hosts in the mapped cache */
+int cfg_cache_hosts(void)
+{
+     return cc_map ? ((struct cc_head *) cc_map)->nhosts : 0;
+}
+
+/* Find host, hosts decoded from the mapped cache are kept in the list */
+struct vtun_host * cfg_cache_host(char *name, llist *hosts)
+{
+     struct cc_head *hd = (struct cc_head *) cc_map;
+     struct cc_host *r;
+     struct vtun_host *h;
+     unsigned int *idx, i, n;
+     llist_elm *e;
+     char *s;
+
+     for(e = hosts->head; e; e = e->next){
+        h = e->data;
+	if( !strcmp(h->host, name) )
+	   return h;
+     }
+     if( !cc_map )
+        return NULL;
+
+     idx = (unsigned int *) (cc_map + hd->index);
+     for(i = host_hash(name) & hd->mask, n = 0; idx[i] && n <= hd->mask;
+	 i = (i + 1) & hd->mask, n++){
+        if( !(r = cc_ptr(cc_map, cc_len, idx[i], 1, sizeof(*r))) )
+	   return NULL;
+	if( !(s = cc_str(cc_map, cc_len, r->host)) || strcmp(s, name) )
+	   continue;
+	if( !(h = cc_host(cc_map, cc_len, idx[i])) )
+	   return NULL;
+
+	/* clear_nat_hack_flags() has run over the hosts already */
+	h->flags &= vtun.svr ? ~VTUN_NAT_HACK_CLIENT : ~VTUN_NAT_HACK_SERVER;
+	llist_add(hosts, h);
+	return h;
+     }
+     return NULL;
+}
+
+/********** Saving *************/
+
+struct cc_buf {
+   char *buf;
+   size_t len;
+   size_t size;
+   int  err;
+};
+
+/* Append data aligned to int, returns its offset or 0 */
+static unsigned int cc_put(struct cc_buf *b, const void *data, size_t len)
+{
+     size_t off = b->len, need = off + ((len + sizeof(int) - 1) & ~(sizeof(int) - 1));
+     char *buf;
+
+     if( b->err || need > 0x7fffffff ){
+        b->err = 1;
+	return 0;
+     }
+     if( need > b->size ){
+        b->size = need > 2 * b->size ? need : 2 * b->size;
+	if( !(buf = realloc(b->buf, b->size)) ){
+	   b->err = 1;
+	   return 0;
+	}
+	b->buf = buf;
+     }
+     memset(b->buf + off, 0, need - off);
+     memcpy(b->buf + off, data, len);
+     b->len = need;
+     return off;
+}
+
+static unsigned int cc_put_str(struct cc_buf *b, char *str)
+{
+     return str ? cc_put(b, str, strlen(str) + 1) : 0;
+}
+
+static unsigned int cc_put_cmds(struct cc_buf *b, llist *cmds, unsigned int *n)
+{
+     struct cc_cmd *c;
+     struct vtun_cmd *cmd;
+     llist_elm *e;
+     unsigned int i = 0, off;
+
+     for(*n = 0, e = cmds->head; e; e = e->next)
+        (*n)++;
+     if( !*n )
+        return 0;
+     if( !(c = calloc(*n, sizeof(*c))) ){
+        b->err = 1;
+	return 0;
+     }
+     for(e = cmds->head; e; e = e->next, i++){
+        cmd = e->data;
+	c[i].prog = cc_put_str(b, cmd->prog);
+	c[i].args = cc_put_str(b, cmd->args);
+	c[i].flags = cmd->flags;
+     }
+     off = cc_put(b, c, *n * sizeof(*c));
+     free(c);
+     return off;
+}
+
+static unsigned int cc_put_paths(struct cc_buf *b, llist *paths, unsigned int *n)
+{
+     struct cc_path *p;
+     struct vtun_addr *addr;
+     llist_elm *e;
+     unsigned int i = 0, off;
+
+     for(*n = 0, e = paths->head; e; e = e->next)
+        (*n)++;
+     if( !*n )
+        return 0;
+     if( !(p = calloc(*n, sizeof(*p))) ){
+        b->err = 1;
+	return 0;
+     }
+     for(e = paths->head; e; e = e->next, i++){
+        addr = e->data;
+	p[i].name = cc_put_str(b, addr->name);
+	p[i].type = addr->type;
+     }
+     off = cc_put(b, p, *n * sizeof(*p));
+     free(p);
+     return off;
+}
+
+static unsigned int cc_put_host(struct cc_buf *b, struct vtun_host *h)
+{
+     struct cc_host r;
+
+     memset(&r, 0, sizeof(r));
+     r.host = cc_put_str(b, h->host);
+     r.passwd = cc_put_str(b, h->passwd);
+     r.dev = cc_put_str(b, h->dev);
+     r.flags = h->flags;
+     r.timeout = h->timeout;
+     r.spd_in = h->spd_in;
+     r.spd_out = h->spd_out;
+     r.zlevel = h->zlevel;
+     r.cipher = h->cipher;
+     r.dedup = h->dedup;
+     r.fec = h->fec;
+     r.persist = h->persist;
+     r.multi = h->multi;
+     r.pool = h->pool;
+     r.buffer = h->buffer;
+     r.ka_interval = h->ka_interval;
+     r.ka_maxfail = h->ka_maxfail;
+     r.src_type = h->src_addr.type;
+     r.src_port = h->src_addr.port;
+     if( h->src_addr.type )
+        r.src_name = cc_put_str(b, h->src_addr.name);
+     r.up = cc_put_cmds(b, &h->up, &r.nup);
+     r.down = cc_put_cmds(b, &h->down, &r.ndown);
+     r.paths = cc_put_paths(b, &h->paths, &r.npaths);
+     return cc_put(b, &r, sizeof(r));
+}
+
+/*
+ * Write the cache of the config file just parsed.
+ * Options are the values set by the file, before the command line
+ * ones are put back.
+ */
+void cfg_cache_save(char *file, llist *hosts)
+{
+     struct cc_buf b;
+     struct cc_head hd;
+     struct vtun_host **slot = NULL, *h;
+     unsigned int *index = NULL, *recs = NULL, n = 0, size = 16, i, off;
+     char tmp_file[255];
+     llist_elm *e;
+     int fd;
+
+     if( !cc_st_ok )
+        return;
+     for(e = hosts->head; e; e = e->next)
+        n++;
+     if( !n )
+        return;
+     while( size < 2 * n )
+        size <<= 1;
+
+     memset(&b, 0, sizeof(b));
+     memset(&hd, 0, sizeof(hd));
+     if( !(slot = calloc(size, sizeof(*slot))) || !(index = calloc(size, sizeof(*index))) ||
+	 !(recs = calloc(n, sizeof(*recs))) )
+        goto done;
+
+     /* Header is filled in last */
+     cc_put(&b, &hd, sizeof(hd));
+     hd.path = cc_put_str(&b, file);
+
+     /* First definition of the host wins, like in the hosts index */
+     hd.nhosts = 0;
+     for(e = hosts->head; e; e = e->next){
+        h = e->data;
+	for(i = host_hash(h->host) & (size - 1); slot[i] && strcmp(slot[i]->host, h->host);
+	    i = (i + 1) & (size - 1))
+	   ;
+	if( slot[i] )
+	   continue;
+	slot[i] = h;
+	index[i] = recs[hd.nhosts++] = cc_put_host(&b, h);
+     }
+     hd.hosts = cc_put(&b, recs, hd.nhosts * sizeof(*recs));
+     hd.index = cc_put(&b, index, size * sizeof(*index));
+     hd.mask = size - 1;
+
+     hd.opts.port = vtun.bind_addr.port;
+     hd.opts.svr_type = vtun.svr_type;
+     hd.opts.timeout = vtun.timeout;
+     hd.opts.persist = vtun.persist;
+     hd.opts.workers = vtun.workers;
+     hd.opts.backlog = vtun.backlog;
+     hd.opts.fastopen = vtun.fastopen;
+     hd.opts.udpmux = vtun.udpmux;
+     hd.opts.ratelimit = vtun.ratelimit;
+     hd.opts.syslog = vtun.syslog;
+     hd.opts.bind_type = vtun.bind_addr.type;
+     hd.opts.bind_name = cc_put_str(&b, vtun.bind_addr.name);
+     hd.opts.svr_addr = cc_put_str(&b, vtun.svr_addr);
+     hd.opts.ppp = cc_put_str(&b, vtun.ppp);
+     hd.opts.ifcfg = cc_put_str(&b, vtun.ifcfg);
+     hd.opts.route = cc_put_str(&b, vtun.route);
+     hd.opts.fwall = cc_put_str(&b, vtun.fwall);
+     hd.opts.iproute = cc_put_str(&b, vtun.iproute);
+     hd.opts.keycache = cc_put_str(&b, vtun.keycache);
+
+     hd.magic = CC_MAGIC;
+     hd.version = CC_VERSION;
+     hd.host_size = sizeof(struct cc_host);
+     hd.opts_size = sizeof(struct cc_opts);
+     hd.dev = cc_st.st_dev;
+     hd.ino = cc_st.st_ino;
+     hd.size = cc_st.st_size;
+     hd.mtime = cc_st.st_mtime;
+     hd.mtime_ns = CC_MTIME_NS(&cc_st);
+     hd.ctime = cc_st.st_ctime;
+     hd.ctime_ns = CC_CTIME_NS(&cc_st);
+     if( b.err )
+        goto done;
+     memcpy(b.buf, &hd, sizeof(hd));
+
+     /* Other processes may read the old one meanwhile */
+     snprintf(tmp_file, sizeof(tmp_file), "%s.%d", VTUN_CFG_CACHE, (int) getpid());
+     unlink(tmp_file);
+     if( (fd = open(tmp_file, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 ){
+        vtun_syslog(LOG_DEBUG,"Can't write config cache %s. %s(%d)", tmp_file,
+		    strerror(errno), errno);
+	goto done;
+     }
+     for(off = 0; off < b.len; off += i)
+        if( (int) (i = write(fd, b.buf + off, b.len - off)) <= 0 )
+	   break;
+     if( close(fd) || off < b.len || rename(tmp_file, VTUN_CFG_CACHE) ){
+        vtun_syslog(LOG_DEBUG,"Can't write config cache %s", VTUN_CFG_CACHE);
+	unlink(tmp_file);
+     }
+
+done:
+     if( b.buf )
+        sodium_memzero(b.buf, b.len);
+     free(b.buf);
+     free(slot);
+     free(index);
+     free(recs);
+}
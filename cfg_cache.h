@@ -0,0 +1,29 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+#ifndef _VTUN_CFG_CACHE_H
+#define _VTUN_CFG_CACHE_H
+
+unsigned int host_hash(const char *name);
+
+int  cfg_cache_load(char *file, llist *hosts, int lazy);
+void cfg_cache_save(char *file, llist *hosts);
+struct vtun_host * cfg_cache_host(char *name, llist *hosts);
+int  cfg_cache_hosts(void);
+
+#endif /* _VTUN_CFG_CACHE_H */
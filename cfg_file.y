@@ -34,6 +34,8 @@
 #include "compat.h"
 #include "vtun.h"
 #include "lib.h"
+#include "auth.h"
+#include "cfg_cache.h"
 
 int lineno = 1;
 
@@ -42,6 +44,7 @@ extern struct vtun_host default_host;
 
 llist  *parse_cmds;
 struct vtun_cmd parse_cmd;
+int parse_parallel;
 
 llist host_list;
 
@@ -49,6 +52,9 @@ int  cfg_error(const char *fmt, ...);
 int  add_cmd(llist *cmds, char *prog, char *args, int flags);
 void *cp_cmd(void *d, void *u);
 int  free_cmd(void *d, void *u);
+int  add_path(llist *paths, char *name, int type);
+void *cp_path(void *d, void *u);
+int  free_path(void *d, void *u);
 
 void copy_addr(struct vtun_host *to, struct vtun_host *from);
 int  free_host(void *d, void *u);
@@ -70,13 +76,14 @@ int yyerror(char *s);
    int  num;
    struct { int num1; int num2; } dnum;
 }
-%expect 20
+%expect 24
 
 %token K_OPTIONS K_DEFAULT K_PORT K_BINDADDR K_PERSIST K_TIMEOUT
 %token K_PASSWD K_PROG K_PPP K_SPEED K_IFCFG K_FWALL K_ROUTE K_DEVICE 
-%token K_MULTI K_SRCADDR K_IFACE K_ADDR
+%token K_MULTI K_SRCADDR K_IFACE K_ADDR K_POOL K_BUFFER
 %token K_TYPE K_PROT K_NAT_HACK K_COMPRESS K_ENCRYPT K_KALIVE K_STAT
-%token K_UP K_DOWN K_SYSLOG K_IPROUTE
+%token K_UP K_DOWN K_SYSLOG K_IPROUTE K_NETLINK K_PARALLEL K_HCOMP K_DEDUP K_FEC
+%token K_MPATH K_WORKERS K_BACKLOG K_KEYCACHE K_FASTOPEN K_UDPMUX K_RATELIMIT
 
 %token <str> K_HOST K_ERROR
 %token <str> WORD PATH STRING
@@ -117,6 +124,7 @@ statement: '\n'
 
 		  llist_copy(&default_host.up,&parse_host->up,cp_cmd,NULL);
 		  llist_copy(&default_host.down,&parse_host->down,cp_cmd,NULL);
+		  llist_copy(&default_host.paths,&parse_host->paths,cp_path,NULL);
 
 		}    
     '{' host_options '}'
@@ -124,8 +132,7 @@ statement: '\n'
 		  /* Check if session definition is complete */ 
 		  if (!parse_host->passwd) {
 		  	cfg_error("Ignored incomplete session definition '%s'", parse_host->host);
-			free_host(parse_host, NULL);			
-			free(parse_host);
+			free_host(parse_host, NULL);
 		  } else {
 		  	/* Add host to the list */
 		  	llist_add(&host_list, (void *)parse_host);
@@ -167,6 +174,31 @@ option:  '\n'
 			     vtun.timeout = $2; 	
 			}
 
+  | K_WORKERS NUM 	{  
+			  if(vtun.workers == -1)
+			     vtun.workers = $2; 	
+			}
+
+  | K_BACKLOG NUM 	{  
+			  if(vtun.backlog == -1)
+			     vtun.backlog = $2; 	
+			}
+
+  | K_FASTOPEN NUM 	{  
+			  if(vtun.fastopen == -1)
+			     vtun.fastopen = $2; 	
+			}
+
+  | K_UDPMUX NUM 	{  
+			  if(vtun.udpmux == -1)
+			     vtun.udpmux = $2; 	
+			}
+
+  | K_RATELIMIT NUM 	{  
+			  if(vtun.ratelimit == -1)
+			     vtun.ratelimit = $2; 	
+			}
+
   | K_PPP   PATH	{
 			  free(vtun.ppp);
 			  vtun.ppp = strdup($2);
@@ -192,6 +224,11 @@ option:  '\n'
 			  vtun.iproute = strdup($2); 	
 			}
 
+  | K_KEYCACHE PATH 	{   
+			  free(vtun.keycache);  
+			  vtun.keycache = strdup($2); 	
+			}
+
   | K_SYSLOG  syslog_opt
 
   | K_ERROR		{
@@ -262,6 +299,14 @@ host_option: '\n'
 			  parse_host->multi = $2;
 			}
 
+  | K_POOL NUM		{ 
+			  parse_host->pool = $2;
+			}
+
+  | K_BUFFER NUM	{ 
+			  parse_host->buffer = $2;
+			}
+
   | K_TIMEOUT NUM	{ 
 			  parse_host->timeout = $2;
 			}
@@ -296,6 +341,48 @@ host_option: '\n'
 			     parse_host->flags &= ~VTUN_ENCRYPT;
 			}
 
+  | K_HCOMP NUM 	{
+			  if( $2 )
+			     parse_host->flags |= VTUN_HCOMP;
+			  else
+			     parse_host->flags &= ~VTUN_HCOMP;
+			}
+
+  | K_DEDUP NUM 	{
+			  /* 'yes' selects the default cache size */
+			  if( $2 > VTUN_DEDUP_MAX ){
+			     cfg_error("Byte cache size %d is too big, max %d",
+				       $2, VTUN_DEDUP_MAX);
+			     YYABORT;
+			  }
+			  if( $2 ){
+			     parse_host->flags |= VTUN_DEDUP;
+			     parse_host->dedup = $2 == 1 ? VTUN_DEDUP_CACHE : $2;
+			  } else
+			     parse_host->flags &= ~VTUN_DEDUP;
+			}
+
+  | K_FEC NUM 		{
+			  /* 'yes' adapts the group size to the loss */
+			  if( $2 ){
+			     parse_host->flags |= VTUN_FEC;
+			     parse_host->fec = $2 == 1 ? 0 : $2;
+			  } else
+			     parse_host->flags &= ~VTUN_FEC;
+			}
+
+  | K_MPATH NUM 	{
+			  if( $2 )
+			     parse_host->flags |= VTUN_MPATH;
+			  else
+			     parse_host->flags &= ~VTUN_MPATH;
+			}
+
+  | K_MPATH 		{
+			  parse_host->flags |= VTUN_MPATH;
+			  llist_free(&parse_host->paths, free_path, NULL);
+			} '{' mpath_options '}'
+
   | K_KALIVE 		{
 			  parse_host->flags &= ~VTUN_KEEP_ALIVE; 
 			}
@@ -339,11 +426,13 @@ host_option: '\n'
   | K_UP 	        { 
 			  parse_cmds = &parse_host->up; 
    			  llist_free(parse_cmds, free_cmd, NULL);   
+			  parse_parallel = 0;
 			} '{' command_options '}' 
 
   | K_DOWN 	        { 
 			  parse_cmds = &parse_host->down; 
    			  llist_free(parse_cmds, free_cmd, NULL);   
+			  parse_parallel = 0;
 			} '{' command_options '}' 
 
   | K_ERROR		{
@@ -425,6 +514,29 @@ srcaddr_option:
 			} 
   ;
 
+mpath_options: /* empty */
+  | mpath_options mpath_option
+  ;
+
+mpath_option:
+  K_ADDR WORD		{
+			  add_path(&parse_host->paths, $2, VTUN_ADDR_NAME);
+			}
+
+  | K_IFACE WORD	{
+			  add_path(&parse_host->paths, $2, VTUN_ADDR_IFACE);
+			}
+
+  | K_IFACE STRING	{
+			  add_path(&parse_host->paths, $2, VTUN_ADDR_IFACE);
+			}
+
+  | K_ERROR		{
+			  cfg_error("Unknown option '%s'",$1);
+			  YYABORT;
+			} 
+  ;
+
 command_options: /* empty */
   | command_option
   | command_options command_option
@@ -464,12 +576,39 @@ command_option: '\n'
 					VTUN_CMD_WAIT);
 			}
 
+  | K_NETLINK STRING 	{   
+			  add_cmd(parse_cmds, strdup("netlink"), strdup($2),
+					VTUN_CMD_NETLINK);
+			}
+
+  | K_PARALLEL		{
+			  if( parse_parallel ){
+			     cfg_error("Nested 'parallel' block");
+			     YYABORT;
+			  }
+			  parse_parallel = 1;
+			} '{' parallel_options '}' {
+			  struct vtun_cmd *cmd;
+
+			  parse_parallel = 0;
+			  /* Last command of the block waits for the others */
+			  if( parse_cmds->tail ){
+			     cmd = parse_cmds->tail->data;
+			     if( cmd->flags & VTUN_CMD_PARALLEL )
+				cmd->flags |= VTUN_CMD_SYNC;
+			  }
+			}
+
   | K_ERROR		{
 			  cfg_error("Unknown cmd '%s'",$1);
 			  YYABORT;
 			} 
   ;
 
+parallel_options: /* empty */
+  | parallel_options command_option
+  ;
+
 prog_options:
     prog_option
   | prog_options prog_option
@@ -522,6 +661,8 @@ int add_cmd(llist *cmds, char *prog, char *args, int flags)
    cmd->prog = prog;
    cmd->args = args;
    cmd->flags = flags;
+   if( parse_parallel )
+      cmd->flags |= VTUN_CMD_PARALLEL;
    llist_add(cmds, cmd);
 
    return 0;
@@ -551,6 +692,46 @@ int free_cmd(void *d, void *u)
    return 0;
 }
 
+int add_path(llist *paths, char *name, int type)
+{
+   struct vtun_addr *addr;
+
+   if( !(addr = malloc(sizeof(struct vtun_addr))) ){
+      yyerror("No memory for the path");
+      return -1;
+   }
+   memset(addr, 0, sizeof(struct vtun_addr));
+
+   addr->name = strdup(name);
+   addr->type = type;
+   llist_add(paths, addr);
+
+   return 0;
+}
+
+void *cp_path(void *d, void *u)
+{
+   struct vtun_addr *addr = d, *addr_copy;
+
+   if( !(addr_copy = malloc(sizeof(struct vtun_addr))) ){
+      yyerror("No memory to copy the path");
+      return NULL;
+   }
+
+   memset(addr_copy, 0, sizeof(struct vtun_addr));
+   addr_copy->name = strdup(addr->name);
+   addr_copy->type = addr->type;
+   return addr_copy;
+}
+
+int free_path(void *d, void *u)
+{
+   struct vtun_addr *addr = d;
+   free(addr->name);
+   free(addr);
+   return 0;
+}
+
 void copy_addr(struct vtun_host *to, struct vtun_host *from)
 {  
    if( from->src_addr.type ){
@@ -582,24 +763,124 @@ int free_host(void *d, void *u)
    
    llist_free(&h->up, free_cmd, NULL);   
    llist_free(&h->down, free_cmd, NULL);
+   llist_free(&h->paths, free_path, NULL);
 
    free_addr(h);
 
    /* releases only host struct instances which were
     * allocated in the case of K_HOST except default_host */
-   if( h->passwd )
+   if( h != &default_host )
       free(h);
 
  
    return 0;   
 }
 
-/* Find host in the hosts list.
- * NOTE: This function can be called only once since it deallocates hosts list.
- */ 
+/* Hash index over the hosts list, rebuilt on every config load */
+static struct vtun_host **host_index;
+static unsigned int host_index_mask;
+
+unsigned int host_hash(const char *name)
+{
+   unsigned int h = 2166136261U;
+
+   while( *name ){
+      h ^= (unsigned char) *name++;
+      h *= 16777619U;
+   }
+   return h;
+}
+
+static void free_host_index(void)
+{
+   free(host_index);
+   host_index = NULL;
+   host_index_mask = 0;
+}
+
+/* Build the index, table is kept at most half full */
+static int build_host_index(void)
+{
+   llist_elm *e;
+   struct vtun_host *h;
+   unsigned int n = 0, size = 16, i;
+
+   free_host_index();
+
+   for(e = host_list.head; e; e = e->next)
+      n++;
+   while( size < 2 * n )
+      size <<= 1;
+
+   if( !(host_index = calloc(size, sizeof(struct vtun_host *))) ){
+      vtun_syslog(LOG_ERR,"No memory for the hosts index");
+      return -1;
+   }
+   host_index_mask = size - 1;
+
+   for(e = host_list.head; e; e = e->next){
+      h = e->data;
+      for(i = host_hash(h->host) & host_index_mask; host_index[i];
+          i = (i + 1) & host_index_mask){
+         /* First definition of the host wins */
+         if( !strcmp(host_index[i]->host, h->host) )
+            break;
+      }
+      if( !host_index[i] )
+         host_index[i] = h;
+   }
+   return 0;
+}
+
+/* Find host in the hosts list */
+struct vtun_host* lookup_host(char *host)
+{
+   unsigned int i;
+
+   /* Hosts of the mapped cache are decoded as they are looked up */
+   if( !host_index )
+      return cfg_cache_host(host, &host_list);
+
+   for(i = host_hash(host) & host_index_mask; host_index[i];
+       i = (i + 1) & host_index_mask)
+      if( !strcmp(host_index[i]->host, host) )
+         return host_index[i];
+
+   return NULL;
+}
+
 inline struct vtun_host* find_host(char *host)
 {
-   return (struct vtun_host *)llist_free(&host_list, free_host, host);
+   return lookup_host(host);
+}
+
+/* Make private copy of the host for one session.
+ * Release it with free_host(). 
+ */
+struct vtun_host* dup_host(struct vtun_host *h)
+{
+   struct vtun_host *d;
+
+   if( !(d = malloc(sizeof(struct vtun_host))) )
+      return NULL;
+
+   memcpy(d, h, sizeof(struct vtun_host));
+   d->host = strdup(h->host);
+   d->passwd = NULL;
+   d->akey = NULL;
+   d->key = NULL;
+   d->sopt.host = d->host;
+   if( h->akey && (d->akey = sodium_malloc(HOST_KEYBYTES)) )
+      memcpy(d->akey, h->akey, HOST_KEYBYTES);
+
+   memset(&d->src_addr, 0, sizeof(d->src_addr));
+   copy_addr(d, h);
+
+   llist_copy(&h->up,&d->up,cp_cmd,NULL);
+   llist_copy(&h->down,&d->down,cp_cmd,NULL);
+   llist_copy(&h->paths,&d->paths,cp_path,NULL);
+
+   return d;
 }
 
 int clear_nat_hack_server(void *d, void *u)
@@ -625,6 +906,7 @@ void clear_nat_hack_flags(int svr)
 
 inline void free_host_list(void)
 {
+   free_host_index();
    llist_free(&host_list, free_host, NULL);
 }
 
@@ -666,32 +948,209 @@ int parse_syslog(char *facility)
    return -1;
 }
 
+static int str_diff(char *a, char *b)
+{
+   if( !a || !b )
+      return a != b;
+   return strcmp(a, b);
+}
+
+static int cmds_diff(llist *a, llist *b)
+{
+   llist_elm *x, *y;
+   struct vtun_cmd *c, *d;
+
+   for(x = a->head, y = b->head; x && y; x = x->next, y = y->next){
+      c = x->data; d = y->data;
+      if( c->flags != d->flags || str_diff(c->prog, d->prog) ||
+          str_diff(c->args, d->args) )
+         return 1;
+   }
+   return x != y;
+}
+
+static int paths_diff(llist *a, llist *b)
+{
+   llist_elm *x, *y;
+   struct vtun_addr *c, *d;
+
+   for(x = a->head, y = b->head; x && y; x = x->next, y = y->next){
+      c = x->data; d = y->data;
+      if( c->type != d->type || str_diff(c->name, d->name) )
+         return 1;
+   }
+   return x != y;
+}
+
+/* Definitions differ in anything a session is set up with */
+static int host_diff(struct vtun_host *a, struct vtun_host *b)
+{
+   return passwd_changed(a, b) || str_diff(a->dev, b->dev) ||
+	  a->flags != b->flags || a->timeout != b->timeout ||
+	  a->spd_in != b->spd_in || a->spd_out != b->spd_out ||
+	  a->zlevel != b->zlevel || a->cipher != b->cipher ||
+	  a->dedup != b->dedup || a->fec != b->fec ||
+	  a->persist != b->persist || a->multi != b->multi ||
+	  a->pool != b->pool || a->buffer != b->buffer ||
+	  a->ka_interval != b->ka_interval ||
+	  a->ka_maxfail != b->ka_maxfail ||
+	  a->src_addr.type != b->src_addr.type ||
+	  a->src_addr.port != b->src_addr.port ||
+	  (a->src_addr.type && str_diff(a->src_addr.name, b->src_addr.name)) ||
+	  cmds_diff(&a->up, &b->up) || cmds_diff(&a->down, &b->down) ||
+	  paths_diff(&a->paths, &b->paths);
+}
+
+/* 
+ * Hosts of the new generation which are defined as before take
+ * the place of the old ones, so their keys are not derived again.
+ * Index still points to the old generation.
+ */
+static void merge_hosts(llist *old)
+{
+   struct vtun_host *h, *o, tmp;
+   int added = 0, changed = 0, kept = 0, n = 0;
+   llist_elm *e;
+
+   for(e = old->head; e; e = e->next)
+      n++;
+
+   for(e = host_list.head; e; e = e->next){
+      h = e->data;
+      if( !(o = lookup_host(h->host)) ){
+         added++;
+         continue;
+      }
+      if( host_diff(o, h) ){
+         changed++;
+         continue;
+      }
+      /* Old copy goes away with the old generation */
+      tmp = *o; *o = *h; *h = tmp;
+      kept++;
+   }
+   llist_free(old, free_host, NULL);
+
+   vtun_syslog(LOG_INFO,"Hosts: %d unchanged, %d changed, %d added, %d removed",
+	       kept, changed, added, n - kept - changed);
+}
+
+/* Options the command line can set, parser doesn't override them */
+static void reset_cmdline_opts(void)
+{
+   vtun.bind_addr.port = -1;
+   vtun.svr_addr = NULL;
+   vtun.svr_type = -1;
+   vtun.timeout = -1;
+   vtun.workers = -1;
+   vtun.backlog = -1;
+   vtun.fastopen = -1;
+   vtun.udpmux = -1;
+   vtun.ratelimit = -1;
+}
+
+static void restore_cmdline_opts(struct vtun_opts *o)
+{
+   if( o->bind_addr.port != -1 )
+      vtun.bind_addr.port = o->bind_addr.port;
+   if( o->svr_addr ){
+      free(vtun.svr_addr);
+      vtun.svr_addr = o->svr_addr;
+   }
+   if( o->svr_type != -1 )
+      vtun.svr_type = o->svr_type;
+   if( o->timeout != -1 )
+      vtun.timeout = o->timeout;
+   if( o->workers != -1 )
+      vtun.workers = o->workers;
+   if( o->backlog != -1 )
+      vtun.backlog = o->backlog;
+   if( o->fastopen != -1 )
+      vtun.fastopen = o->fastopen;
+   if( o->udpmux != -1 )
+      vtun.udpmux = o->udpmux;
+   if( o->ratelimit != -1 )
+      vtun.ratelimit = o->ratelimit;
+}
+
+/* Parse the config file, the cache is written from what it sets */
+static int parse_config(char *file)
+{
+   extern FILE *yyin;
+   struct vtun_opts opts;
+   int err;
+
+   if( !(yyin = fopen(file,"r")) ){
+      vtun_syslog(LOG_ERR,"Can not open %s", file);
+      return -1;
+   }
+
+   opts = vtun;
+   reset_cmdline_opts();
+
+   err = yyparse();
+
+   free_host(&default_host, NULL);
+
+   fclose(yyin);
+
+   if( !err )
+      cfg_cache_save(file, &host_list);
+   restore_cmdline_opts(&opts);
+
+   return err ? 1 : 0;
+}
+
 /* 
  * Read config file. 
- */ 
+ * On reload the file is parsed into a new generation of hosts,
+ * the old one stays if the file can't be read or parsed.
+ * Compiled cache of the file is used instead while it is up to date.
+ */
 int read_config(char *file) 
 {
    static int cfg_loaded = 0;
-   extern FILE *yyin;
+   llist old;
+   int err, lazy;
 
-   if( cfg_loaded ){
-      free_host_list();
+   if( cfg_loaded )
       vtun_syslog(LOG_INFO,"Reloading configuration file");
-   }	 
-   cfg_loaded = 1;
 
+   old = host_list;
    llist_init(&host_list);
 
-   if( !(yyin = fopen(file,"r")) ){
-      vtun_syslog(LOG_ERR,"Can not open %s", file);
-      return -1;      
+   /* Inetd server and client need only the hosts they look up */
+   lazy = !vtun.svr || vtun.svr_type == VTUN_INETD;
+
+   if( !cfg_cache_load(file, &host_list, lazy) )
+      err = 0;
+   else if( (err = parse_config(file)) < 0 ){
+      host_list = old;
+      return cfg_loaded ? !llist_empty(&host_list) : -1;
    }
 
-   yyparse();
+   if( cfg_loaded ){
+      if( err ){
+         vtun_syslog(LOG_ERR,"Errors in %s, configuration is not reloaded", file);
+         llist_free(&host_list, free_host, NULL);
+         host_list = old;
+         return !llist_empty(&host_list);
+      }
+      merge_hosts(&old);
+   }
+   cfg_loaded = 1;
 
-   free_host(&default_host, NULL);
+   if( llist_empty(&host_list) && cfg_cache_hosts() ){
+      free_host_index();
+      return 1;
+   }
 
-   fclose(yyin);
+   if( build_host_index() < 0 )
+      return 0;
+
+   /* Handshakes use keys derived in advance */
+   if( vtun.svr )
+      derive_host_keys();
   
    return !llist_empty(&host_list);     
 }
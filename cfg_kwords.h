@@ -39,8 +39,16 @@ struct kword cfg_keyword[] = {
    { "bindaddr", K_BINDADDR },
    { "persist",	 K_PERSIST }, 
    { "multi",	 K_MULTI }, 
+   { "pool",	 K_POOL }, 
+   { "buffer",	 K_BUFFER }, 
    { "iface",    K_IFACE }, 
    { "timeout",	 K_TIMEOUT }, 
+   { "workers",	 K_WORKERS }, 
+   { "backlog",	 K_BACKLOG }, 
+   { "fastopen", K_FASTOPEN }, 
+   { "udpmux",   K_UDPMUX }, 
+   { "ratelimit", K_RATELIMIT }, 
+   { "keycache", K_KEYCACHE }, 
    { "passwd",   K_PASSWD }, 
    { "password", K_PASSWD }, 
    { "program",  K_PROG }, 
@@ -58,7 +66,13 @@ struct kword cfg_keyword[] = {
    { "firewall", K_FWALL }, 
    { "route", 	 K_ROUTE }, 
    { "ip", 	 K_IPROUTE }, 
+   { "netlink",  K_NETLINK }, 
+   { "parallel", K_PARALLEL }, 
    { "keepalive",K_KALIVE }, 
+   { "hdrcomp",  K_HCOMP }, 
+   { "dedup",    K_DEDUP }, 
+   { "fec",      K_FEC }, 
+   { "multipath",K_MPATH }, 
    { "stat",	 K_STAT }, 
    { "syslog",   K_SYSLOG },
    { NULL , 0 }
@@ -84,6 +98,7 @@ struct kword cfg_param[] = {
    { "wait",	 1 },
    { "killold",	 VTUN_MULTI_KILL },
    { "inetd",	 VTUN_INETD },
+   { "event",	 VTUN_EVENT },
    { "stand",	 VTUN_STAND_ALONE },
    { "keep",     VTUN_PERSIST_KEEPIF },
    { "aes256gcm",VTUN_ENC_AES256GCM },
@@ -35,10 +35,16 @@
 #include <netinet/in.h>
 #endif
 
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
 
+#include <sodium.h>
+
 #include "vtun.h"
 #include "lib.h"
 #include "llist.h"
@@ -46,6 +52,10 @@
 #include "compat.h"
 #include "netlib.h"
 
+/* Reconnect backoff with 'buffer', in milliseconds */
+#define CLNT_BACKOFF_MIN	1000
+#define CLNT_BACKOFF_MAX	60000
+
 static volatile sig_atomic_t client_term;
 static void sig_term(int sig)
 {
@@ -57,7 +67,9 @@ void client(struct vtun_host *host)
 {
      struct sockaddr_in my_addr,svr_addr;
      struct sigaction sa;
-     int s, opt, reconnect;	
+     int s, opt, reconnect, backoff = 0;	
+     /* Session set up over UDP, without TCP connection */
+     int proto_udp = (host->flags & VTUN_PROT_MASK) == VTUN_UDP, udp;
 
      vtun_syslog(LOG_INFO,"VTun client ver %s started",VTUN_VER);
 
@@ -76,7 +88,15 @@ void client(struct vtun_host *host)
      client_term = 0; reconnect = 0;
      while( (!client_term) || (client_term == VTUN_SIG_HUP) ){
 	if( reconnect && (client_term != VTUN_SIG_HUP) ){
-	   if( vtun.persist || host->persist ){
+	   if( (vtun.persist || host->persist) && host->buffer ){
+	      /* Jittered exponential backoff, the kept device
+	       * is buffered meanwhile */
+	      backoff = backoff ? backoff * 2 : CLNT_BACKOFF_MIN;
+	      if( backoff > CLNT_BACKOFF_MAX )
+	         backoff = CLNT_BACKOFF_MAX;
+	      if( tunnel_buffer(host, backoff/2 + randombytes_uniform(backoff/2 + 1)) < 0 )
+	         continue;
+	   } else if( vtun.persist || host->persist ){
 	      /* Persist mode. Sleep and reconnect. */
 	      sleep(5);
            } else {
@@ -89,6 +109,9 @@ void client(struct vtun_host *host)
 
 	set_title("%s init initializing", host->host);
 
+	/* Server can't do the handshake over UDP */
+	udp = proto_udp && !host->hs_legacy && !host->hs_tcp;
+
 	/* Set server address */
         if( server_addr(&svr_addr, host) < 0 )
 	   continue;
@@ -101,7 +124,7 @@ void client(struct vtun_host *host)
 	 * we want to connect, since STREAM sockets 
 	 * can be successfully connected only once.
 	 */
-        if( (s = socket(AF_INET,SOCK_STREAM,0))==-1 ){
+        if( (s = socket(AF_INET,udp ? SOCK_DGRAM : SOCK_STREAM,0))==-1 ){
 	   vtun_syslog(LOG_ERR,"Can't create socket. %s(%d)", 
 		strerror(errno), errno);
 	   continue;
@@ -117,11 +140,24 @@ void client(struct vtun_host *host)
 	   continue;
         }
 
+#ifdef TCP_FASTOPEN_CONNECT
+	/* Connect returns at once, the hello goes out with the SYN.
+	 * Not for the text handshake, the SYN would wait for our first
+	 * write while we wait for the server's greeting. */
+	opt=1;
+	if( vtun.fastopen > 0 && !udp &&
+	    (host->ticket || (!host->hs_legacy && strlen(host->host) <= 255)) &&
+	    setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) )
+	   vtun_syslog(LOG_ERR,"Can't enable TCP Fast Open. %s(%d)",
+		strerror(errno), errno);
+#endif
+
         /* 
          * Clear speed and flags which will be supplied by server. 
          */
         host->spd_in = host->spd_out = 0;
         host->flags &= VTUN_CLNT_MASK;
+        host->sid = 0;
 
 	io_init();
 
@@ -129,12 +165,13 @@ void client(struct vtun_host *host)
 	if (!vtun.quiet)
 	   vtun_syslog(LOG_INFO,"Connecting to %s", vtun.svr_name);
 
-        if( connect_t(s,(struct sockaddr *) &svr_addr, host->timeout) ){
+        if( !udp && connect_t(s,(struct sockaddr *) &svr_addr, host->timeout) ){
 	   if (!vtun.quiet || errno != ETIMEDOUT)
 	      vtun_syslog(LOG_INFO,"Connect to %s failed. %s(%d)", vtun.svr_name,
 					strerror(errno), errno);
         } else {
-	   if( auth_client(s, host) ){   
+	   switch( udp ? auth_client_udp(s, &svr_addr, host) : auth_client(s, host) ){
+	   case 1:
 	      vtun_syslog(LOG_INFO,"Session %s[%s] opened",host->host,vtun.svr_name);
 
  	      host->rmt_fd = s;
@@ -143,14 +180,28 @@ void client(struct vtun_host *host)
 	      client_term = tunnel(host);
 
 	      vtun_syslog(LOG_INFO,"Session %s[%s] closed",host->host,vtun.svr_name);
-	   } else {
+
+	      /* Try to resume or redial right away */
+	      backoff = 0;
+	      if( (host->ticket || host->buffer) && (vtun.persist || host->persist) )
+		 reconnect = 0;
+	      break;
+	   case -1:
+	      /* Repeat the handshake right away */
+	      reconnect = 0;
+	      break;
+	   default:
 	      vtun_syslog(LOG_INFO,"Connection denied by %s",vtun.svr_name);
+	      break;
 	   }
 	}
 	close(s);
 	free_sopt(&host->sopt);
      }
 
+     tunnel_release(host);
+     free(host->rbuf);
+
      vtun_syslog(LOG_INFO, "Exit");
      return;
 }
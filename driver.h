@@ -33,6 +33,14 @@ extern int (*dev_read)(int fd, char *buf, int len);
 extern int (*proto_write)(int fd, char *buf, int len);
 extern int (*proto_read)(int fd, char *buf);
 
+/* Optional, for transports with their own sockets and timers */
+extern void (*proto_fdset)(fd_set *fds, int *maxfd, struct timeval *tv);
+extern int (*proto_ready)(fd_set *fds);
+/* Frame just read came from an address the peer wasn't seen at,
+ * proto_proven() is called if it decrypts, see lfd_net_probe() */
+extern int (*proto_unproven)(void);
+extern void (*proto_proven)(void);
+
 int tun_open(char *dev);
 int tun_close(int fd, char *dev);
 int tun_write(int fd, char *buf, int len);
@@ -43,6 +51,15 @@ int tap_close(int fd, char *dev);
 int tap_write(int fd, char *buf, int len);
 int tap_read(int fd, char *buf, int len);
 
+/* Pool of persistent devices */
+#ifdef HAVE_LINUX_IF_TUN_H
+int tun_pool_open(char *dev, int size);
+int tap_pool_open(char *dev, int size);
+#else
+#define tun_pool_open(dev, size) tun_open(dev)
+#define tap_pool_open(dev, size) tap_open(dev)
+#endif
+
 int pty_open(char *dev);
 int pty_write(int fd, char *buf, int len);
 int pty_read(int fd, char *buf, int len);
@@ -57,4 +74,10 @@ int tcp_read(int fd, char *buf);
 int udp_write(int fd, char *buf, int len);
 int udp_read(int fd, char *buf);
 
+int mpath_write(int fd, char *buf, int len);
+int mpath_read(int fd, char *buf);
+
+int  arq_init(struct vtun_host *host);
+void arq_close(void);
+
 #endif
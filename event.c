@@ -0,0 +1,1543 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Event driven server.
+ *
+ * One process authenticates clients and runs the linker of all
+ * sessions from a single epoll loop. Sessions never block on the
+ * network: TCP frames are reassembled from partial reads and output
+ * which doesn't fit into the socket is kept until it is writable.
+ * Device is not read while such output is pending.
+ *
+ * With 'udpmux' the UDP sessions of binary handshake clients share
+ * one socket. Clients put the session ID in front of every frame,
+ * so datagrams of many sessions are fetched with one call.
+ *
+ * Server started with -H takes the running sessions over from the
+ * previous one, see ev_handoff().
+ */
+
+/* recvmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include <sodium.h>
+
+#include "vtun.h"
+#include "linkfd.h"
+#include "lib.h"
+#include "lock.h"
+#include "auth.h"
+#include "driver.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Events fetched by one epoll_wait() */
+#define EV_MAX_EVENTS	256
+
+/* Connections accepted at once, keeps sessions served during connect storms */
+#define EV_ACCEPT_BATCH	64
+
+/* Max size of pending TCP output of the session */
+#define EV_TX_MAX	65536
+
+/* TCP input buffer, holds at least one complete frame */
+#define EV_RX_SIZE	(4 * (VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD))
+
+/* Datagrams fetched from the shared UDP socket at once */
+#define EV_UDP_BATCH	32
+
+/* Datagram on the shared socket: sid[4] len[2] frame */
+#define EV_UDP_SIZE	(4 + 2 + VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD)
+
+/* Buckets of the session ID hash */
+#define EV_SID_HASH	4096
+#define EV_SID_SLOT(sid) ((unsigned int)((sid) * 2654435761U) % EV_SID_HASH)
+
+/* Session states */
+#define EV_AUTH		0
+#define EV_LINK		1
+#define EV_PORT		2	/* Waiting for the client's UDP port */
+
+struct ev_sess {
+   int  state;
+   int  fd;		/* Connection to the client */
+   char *ip;
+   int  port;
+
+   /* Authentication */
+   struct vtun_auth *auth;
+   time_t deadline;
+
+   /* Linker */
+   struct vtun_host *host;
+   struct lfd_link *lnk;
+   time_t ka_timer;
+   time_t stat_timer;
+   int  throttled;	/* Shaper holds the data */
+
+   /* Shared UDP socket */
+   unsigned int sid;
+   struct sockaddr_in peer;
+   int  peer_ok;	/* Address is learned from the client's datagram */
+   struct ev_sess *sid_next;
+
+   /* TCP framing */
+   char rx[EV_RX_SIZE];
+   int  rx_len;
+   int  rx_skip;	/* Rest of oversized frame */
+   char *tx;
+   int  tx_len;
+
+   /* Events we are waiting for */
+   unsigned int net_ev;
+   unsigned int dev_ev;
+
+   int  handed;		/* Runs in the new server now */
+
+   struct ev_sess *next;
+   struct ev_sess *prev;
+};
+
+static int ev_poll = -1;
+
+/* Sessions indexed by file descriptor */
+static struct ev_sess **ev_tab;
+static int ev_tab_size;
+
+static struct ev_sess *ev_list;
+static int ev_nthrottled;
+
+/* Shared UDP socket, its port and sessions on it */
+static int ev_usock = -1;
+static unsigned short ev_uport;
+static int ev_worker;
+static struct ev_sess *ev_sid_tab[EV_SID_HASH];
+
+static volatile sig_atomic_t ev_term, ev_reload;
+
+/* Socket the next server connects to for the handoff */
+static int ev_hsock = -1;
+
+static void sig_term(int sig)
+{
+     vtun_syslog(LOG_INFO,"Terminated");
+     ev_term = VTUN_SIG_TERM;
+}
+
+static void sig_hup(int sig)
+{
+     ev_reload = 1;
+}
+
+static int ev_tab_set(int fd, struct ev_sess *s)
+{
+     struct ev_sess **tab;
+     int size;
+
+     if( fd >= ev_tab_size ){
+        size = ev_tab_size ? ev_tab_size : 1024;
+        while( size <= fd )
+           size *= 2;
+        if( !(tab = realloc(ev_tab, size * sizeof(*tab))) )
+	   return -1;
+	memset(tab + ev_tab_size, 0, (size - ev_tab_size) * sizeof(*tab));
+	ev_tab = tab;
+	ev_tab_size = size;
+     }
+     ev_tab[fd] = s;
+     return 0;
+}
+
+static void ev_tab_clear(int fd)
+{
+     if( fd >= 0 && fd < ev_tab_size )
+        ev_tab[fd] = NULL;
+}
+
+static struct ev_sess *ev_sid_find(unsigned int sid)
+{
+     struct ev_sess *s;
+
+     for(s = ev_sid_tab[EV_SID_SLOT(sid)]; s; s = s->sid_next)
+        if( s->sid == sid )
+	   return s;
+     return NULL;
+}
+
+static void ev_sid_add(struct ev_sess *s)
+{
+     unsigned int slot = EV_SID_SLOT(s->sid);
+
+     s->sid_next = ev_sid_tab[slot];
+     ev_sid_tab[slot] = s;
+}
+
+static void ev_sid_del(struct ev_sess *s)
+{
+     struct ev_sess **p;
+
+     for(p = &ev_sid_tab[EV_SID_SLOT(s->sid)]; *p; p = &(*p)->sid_next)
+        if( *p == s ){
+	   *p = s->sid_next;
+	   break;
+	}
+}
+
+static int ev_ctl(int op, int fd, unsigned int events)
+{
+     struct epoll_event ev;
+
+     memset(&ev, 0, sizeof(ev));
+     ev.events = events;
+     ev.data.fd = fd;
+     return epoll_ctl(ev_poll, op, fd, &ev);
+}
+
+static void ev_nonblock(int fd)
+{
+     fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Bring epoll interest of the session in line with its state */
+static void ev_update(struct ev_sess *s)
+{
+     unsigned int net_ev, dev_ev;
+
+     if( s->state != EV_LINK )
+        return;
+
+     net_ev = s->throttled ? 0 : EPOLLIN;
+     dev_ev = 0;
+     if( s->tx_len )
+        net_ev |= EPOLLOUT;
+     else if( !s->throttled )
+        dev_ev = EPOLLIN;
+
+     if( net_ev != s->net_ev ){
+        /* Shared socket is always read, the session drops its input */
+        if( !s->sid )
+	   ev_ctl(EPOLL_CTL_MOD, s->fd, net_ev);
+	s->net_ev = net_ev;
+     }
+     if( dev_ev != s->dev_ev ){
+        ev_ctl(EPOLL_CTL_MOD, s->host->loc_fd, dev_ev);
+	s->dev_ev = dev_ev;
+     }
+}
+
+static void ev_throttle(struct ev_sess *s)
+{
+     if( !s->throttled ){
+        s->throttled = 1;
+	ev_nthrottled++;
+	ev_update(s);
+     }
+}
+
+/* Queue data which didn't fit into the socket */
+static int ev_tx_queue(struct ev_sess *s, char *buf, int len)
+{
+     char *tx;
+
+     if( s->tx_len + len > EV_TX_MAX ){
+        vtun_syslog(LOG_ERR,"Session %s output queue overflow", s->host->host);
+	return -1;
+     }
+     if( !s->tx && !(s->tx = malloc(EV_TX_MAX)) )
+        return -1;
+     tx = s->tx + s->tx_len;
+     memcpy(tx, buf, len);
+     s->tx_len += len;
+     return 0;
+}
+
+/* Write pending output, called when socket is writable */
+static int ev_tx_flush(struct ev_sess *s)
+{
+     int w;
+
+     while( s->tx_len ){
+        if( (w = write(s->fd, s->tx, s->tx_len)) < 0 ){
+	   if( errno == EAGAIN || errno == EINTR )
+	      break;
+	   return -1;
+	}
+	s->tx_len -= w;
+	memmove(s->tx, s->tx + w, s->tx_len);
+     }
+     ev_update(s);
+     return 0;
+}
+
+/* TCP proto_write of the event server, never blocks */
+static int ev_tcp_write(int fd, char *buf, int len)
+{
+     struct ev_sess *s = ev_tab[fd];
+     struct iovec iov[2];
+     uint16_t header;
+     int w, t;
+
+     header = htons((uint16_t) len);
+     len  = len & VTUN_FSIZE_MASK;
+
+     iov[0].iov_base = &header; iov[0].iov_len = 2;
+     iov[1].iov_base = buf;     iov[1].iov_len = len;
+     t = len + 2;
+
+     if( s->tx_len ){
+        /* Keep the order of frames */
+        w = 0;
+     } else if( (w = writev(fd, iov, 2)) < 0 ){
+        if( errno != EAGAIN && errno != EINTR )
+	   return -1;
+	w = 0;
+     }
+     if( w < t ){
+        if( w < 2 ){
+	   if( ev_tx_queue(s, (char *)&header + w, 2 - w) < 0 )
+	      return -1;
+	   w = 2;
+	}
+	if( ev_tx_queue(s, buf + (w - 2), t - w) < 0 )
+	   return -1;
+	ev_update(s);
+     }
+     return len;
+}
+
+static int ev_udp_send(int fd, struct sockaddr_in *to, char *buf, int len)
+{
+     char *ptr = buf - sizeof(short);
+     int w;
+
+     *((unsigned short *)ptr) = htons(len);
+     len = (len & VTUN_FSIZE_MASK) + sizeof(short);
+
+     if( (w = sendto(fd, ptr, len, MSG_DONTWAIT, (struct sockaddr *) to,
+		     sizeof(*to))) < 0 ){
+        /* Socket is shared, drop the frame rather than wait */
+        if( errno == EAGAIN || errno == EINTR || errno == ENOBUFS )
+	   return 0;
+     }
+     return w;
+}
+
+/* UDP proto_write of the sessions on the shared socket */
+static int ev_udp_write(int fd, char *buf, int len)
+{
+     return ev_udp_send(fd, &ev_tab[fd]->peer, buf, len);
+}
+
+static void ev_free_host(struct vtun_host *host)
+{
+     free(host->sopt.dev);
+     free(host->sopt.laddr);
+     free(host->sopt.raddr);
+     free_host(host, NULL);
+}
+
+static void ev_close(struct ev_sess *s)
+{
+     struct vtun_host *host = s->host;
+
+     if( s->state == EV_LINK ){
+	if( s->handed )
+	   lfd_release(s->lnk);
+	else
+	   lfd_close(s->lnk);
+	if( s->sid )
+	   ev_sid_del(s);
+
+	ev_tab_clear(s->fd);
+	ev_tab_clear(host->loc_fd);
+	epoll_ctl(ev_poll, EPOLL_CTL_DEL, s->fd, NULL);
+	epoll_ctl(ev_poll, EPOLL_CTL_DEL, host->loc_fd, NULL);
+
+	if( host->stat.file )
+	   fclose(host->stat.file);
+
+	if( s->handed ){
+	   /* New server has the device and the connection */
+	   close(host->rmt_fd);
+	   close(host->loc_fd);
+	} else {
+	   /* Closes the connection too */
+	   tunnel_close(host);
+	   vtun_syslog(LOG_INFO,"Session %s closed", host->host);
+	}
+	unlock_host(host);
+	ev_free_host(host);
+     } else {
+	if( s->fd >= 0 ){
+	   ev_tab_clear(s->fd);
+	   close(s->fd);
+	}
+	auth_server_free(s->auth);
+	if( s->state == EV_PORT ){
+	   /* Authenticated, but the session didn't start */
+	   unlock_host(host);
+	   ev_free_host(host);
+	}
+     }
+
+     if( s->throttled )
+        ev_nthrottled--;
+
+     if( s->prev )
+        s->prev->next = s->next;
+     else
+        ev_list = s->next;
+     if( s->next )
+        s->next->prev = s->prev;
+
+     free(s->tx);
+     free(s->ip);
+     free(s);
+}
+
+/* Lock host in memory, all sessions belong to this process */
+int ev_lock_host(struct vtun_host *host)
+{
+     struct ev_sess *s;
+
+     for(s = ev_list; s; s = s->next){
+        if( s->state == EV_AUTH || strcmp(s->host->host, host->host) )
+	   continue;
+        if( host->multi != VTUN_MULTI_KILL )
+	   return -1;
+	vtun_syslog(LOG_INFO, "Closing old connection of %s", host->host);
+	ev_close(s);
+	break;
+     }
+     return 0;
+}
+
+/* ID of the UDP session on the shared socket, 0 if it gets a socket of its own */
+unsigned int ev_session_id(struct vtun_host *host)
+{
+     unsigned int sid;
+
+     if( ev_usock < 0 || (host->flags & VTUN_PROT_MASK) != VTUN_UDP )
+        return 0;
+
+     /* Kernel steers datagrams to the worker number sid % workers */
+     do {
+        sid = randombytes_uniform(0xffffffff / vtun.workers) * vtun.workers + ev_worker;
+     } while( !sid || ev_sid_find(sid) );
+     return sid;
+}
+
+/* Linker of the session is ready, start serving it */
+static void ev_link(struct ev_sess *s)
+{
+     struct vtun_host *host = s->host;
+
+     if( host->flags & VTUN_TCP ){
+        s->lnk->proto_write = ev_tcp_write;
+	ev_nonblock(s->fd);
+     }
+     if( s->sid ){
+        s->lnk->proto_write = ev_udp_write;
+	ev_sid_add(s);
+     }
+     ev_nonblock(host->loc_fd);
+
+     if( ev_tab_set(s->fd, s) || ev_tab_set(host->loc_fd, s) ){
+        ev_close(s);
+	return;
+     }
+     s->net_ev = EPOLLIN;
+     s->dev_ev = EPOLLIN;
+     if( !s->sid )
+        ev_ctl(EPOLL_CTL_ADD, s->fd, s->net_ev);
+     ev_ctl(EPOLL_CTL_ADD, host->loc_fd, s->dev_ev);
+     /* Output left by the previous server */
+     ev_update(s);
+
+     s->ka_timer = time(NULL) + host->ka_interval;
+     if( host->flags & VTUN_STAT ){
+        lfd_stat_open(host);
+	s->stat_timer = time(NULL) + VTUN_STAT_IVAL;
+     }
+
+     s->lnk->proto_write(s->fd, s->lnk->buf, VTUN_ECHO_REQ);
+}
+
+/* Client is authenticated, bring up the tunnel */
+static void ev_start(struct ev_sess *s, struct vtun_host *host)
+{
+     struct sockaddr_in my_addr;
+     socklen_t opt;
+
+     auth_server_free(s->auth);
+     s->auth = NULL;
+
+     vtun_syslog(LOG_INFO,"Session %s[%s:%d] opened", host->host, s->ip, s->port);
+
+     opt = sizeof(my_addr);
+     getsockname(s->fd, (struct sockaddr *) &my_addr, &opt);
+
+     host->rmt_fd = s->fd;
+     host->loc_fd = -1;
+     host->persist = 0;
+     host->sopt.dev = NULL;
+     host->sopt.laddr = strdup(inet_ntoa(my_addr.sin_addr));
+     host->sopt.lport = vtun.bind_addr.port;
+     host->sopt.raddr = strdup(s->ip);
+     host->sopt.rport = s->port;
+     memset(&host->stat, 0, sizeof(host->stat));
+
+     /* UDP session replaces the connection */
+     ev_tab_clear(s->fd);
+     epoll_ctl(ev_poll, EPOLL_CTL_DEL, s->fd, NULL);
+
+     if( host->sid ){
+        /* Port exchange is done, frames come to the shared socket */
+        close(s->fd);
+	host->rmt_fd = dup(ev_usock);
+	fcntl(host->rmt_fd, F_SETFD, FD_CLOEXEC);
+	host->sopt.lport = ntohs(ev_uport);
+	host->sopt.rport = ntohs(s->peer.sin_port);
+	s->rx_len = 0;
+     }
+
+     s->host = host;
+     if( tunnel_open(host) ){
+        vtun_syslog(LOG_ERR,"Session %s failed to start", host->host);
+	close(host->rmt_fd);
+	s->fd = -1;
+	ev_free_host(host);
+	s->host = NULL;
+	s->state = EV_AUTH;
+	ev_close(s);
+	return;
+     }
+
+     s->fd = host->rmt_fd;
+     s->state = EV_LINK;
+     s->sid = host->sid;
+     if( !(s->lnk = lfd_open(host)) ){
+	/* Tunnel is up, unwind it like a normal close */
+	tunnel_close(host);
+	ev_free_host(host);
+	s->state = EV_AUTH;
+	s->fd = -1;
+	ev_close(s);
+	return;
+     }
+     ev_link(s);
+}
+
+static void ev_auth_input(struct ev_sess *s)
+{
+     struct vtun_host *host = NULL;
+     char *buf;
+     int len, ret = 0;
+
+     /* Messages come in pieces, auth layer tells how much it needs */
+     while( !ret ){
+        buf = auth_server_need(s->auth, &len);
+        len = recv(s->fd, buf, len, MSG_DONTWAIT);
+	if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+	   return;
+	if( len <= 0 ){
+	   ev_close(s);
+	   return;
+	}
+	ret = auth_server_input(s->auth, len, &host);
+     }
+     if( ret < 0 ){
+        vtun_syslog(LOG_INFO,"Denied connection from %s:%d", s->ip, s->port);
+	ev_close(s);
+	return;
+     }
+     if( host->sid ){
+        /* Client connects its UDP socket to the shared one */
+        s->host = host;
+	s->state = EV_PORT;
+	if( write_n(s->fd, (char *) &ev_uport, sizeof(short)) < 0 ){
+	   ev_close(s);
+	   return;
+	}
+	s->rx_len = 0;
+	return;
+     }
+     ev_start(s, host);
+}
+
+/* Port of the client's UDP socket, the last message on the connection */
+static void ev_port_input(struct ev_sess *s)
+{
+     int len;
+
+     len = recv(s->fd, s->rx + s->rx_len, sizeof(short) - s->rx_len, MSG_DONTWAIT);
+     if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+        return;
+     if( len <= 0 ){
+        ev_close(s);
+	return;
+     }
+     if( (s->rx_len += len) < sizeof(short) )
+        return;
+     memcpy(&s->peer.sin_port, s->rx, sizeof(short));
+     ev_start(s, s->host);
+}
+
+/* Pass complete TCP frames to the linker */
+static int ev_tcp_frames(struct ev_sess *s)
+{
+     struct lfd_link *lnk = s->lnk;
+     unsigned short hdr, flen;
+     int off = 0, skip;
+
+     while( s->rx_len - off > 0 ){
+        if( s->rx_skip ){
+	   skip = min(s->rx_skip, s->rx_len - off);
+	   s->rx_skip -= skip;
+	   off += skip;
+	   continue;
+	}
+        if( s->rx_len - off < 2 )
+	   break;
+	if( lfd_check_up(lnk) <= 0 ){
+	   ev_throttle(s);
+	   break;
+	}
+
+	memcpy(&hdr, s->rx + off, 2);
+	hdr = ntohs(hdr);
+	flen = hdr & VTUN_FSIZE_MASK;
+
+	if( hdr & ~VTUN_FSIZE_MASK ){
+	   /* Frame flags */
+	   off += 2;
+	   if( lfd_net_input(lnk, hdr) < 0 )
+	      return -1;
+	   continue;
+	}
+	if( flen > VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD ){
+	   /* Oversized frame, drop it. */
+	   off += 2;
+	   s->rx_skip = flen;
+	   if( lfd_net_input(lnk, VTUN_BAD_FRAME) < 0 )
+	      return -1;
+	   continue;
+	}
+	if( s->rx_len - off < 2 + flen )
+	   break;
+
+	memcpy(lnk->buf, s->rx + off + 2, flen);
+	off += 2 + flen;
+	if( lfd_net_input(lnk, flen) < 0 )
+	   return -1;
+     }
+
+     s->rx_len -= off;
+     memmove(s->rx, s->rx + off, s->rx_len);
+     return 0;
+}
+
+static int ev_net_input(struct ev_sess *s)
+{
+     int len;
+
+     if( lfd_check_up(s->lnk) <= 0 ){
+        ev_throttle(s);
+	return 0;
+     }
+     s->lnk->idle = 0;
+
+     if( !(s->host->flags & VTUN_TCP) ){
+        if( (len = s->lnk->proto_read(s->fd, s->lnk->buf)) <= 0 )
+	   return -1;
+	return lfd_net_input(s->lnk, len);
+     }
+
+     if( (len = read(s->fd, s->rx + s->rx_len, EV_RX_SIZE - s->rx_len)) < 0 ){
+        if( errno == EAGAIN || errno == EINTR )
+	   return 0;
+	return -1;
+     }
+     if( !len )
+        return -1;
+     s->rx_len += len;
+
+     return ev_tcp_frames(s);
+}
+
+/* Datagram from the shared socket, pass it to the session it names */
+static void ev_udp_frame(struct sockaddr_in *from, char *pkt, int len)
+{
+     struct ev_sess *s;
+     unsigned short hdr, flen;
+     uint32_t sid;
+
+     if( len < 4 + 2 )
+        return;
+     memcpy(&sid, pkt, 4);
+     if( !(s = ev_sid_find(ntohl(sid))) )
+        return;
+
+     /* Port of the first frame from the client's address may be
+      * changed by NAT */
+     if( !s->peer_ok && from->sin_addr.s_addr == s->peer.sin_addr.s_addr ){
+        s->peer.sin_port = from->sin_port;
+	s->peer_ok = 1;
+     }
+
+     if( lfd_check_up(s->lnk) <= 0 ){
+        ev_throttle(s);
+	return;
+     }
+
+     memcpy(&hdr, pkt + 4, 2);
+     hdr = ntohs(hdr);
+     flen = hdr & VTUN_FSIZE_MASK;
+     if( len - (4 + 2) != flen )
+        hdr = VTUN_BAD_FRAME;
+     else
+        memcpy(s->lnk->buf, pkt + 4 + 2, flen);
+
+     if( from->sin_addr.s_addr == s->peer.sin_addr.s_addr &&
+	 from->sin_port == s->peer.sin_port ){
+        if( lfd_net_input(s->lnk, hdr) < 0 )
+	   ev_close(s);
+	return;
+     }
+
+     /* 
+      * Client roamed or its NAT mapping changed. Keep-alive is
+      * answered where it came from, the session moves with the
+      * first frame which proves to be from the client.
+      */
+     if( hdr == VTUN_ECHO_REQ ){
+        s->lnk->idle = 0;
+	ev_udp_send(s->fd, from, s->lnk->buf, VTUN_ECHO_REP);
+	return;
+     }
+     switch( lfd_net_probe(s->lnk, hdr) ){
+     case 1:
+        s->peer = *from;
+	s->peer_ok = 1;
+	vtun_syslog(LOG_INFO,"Session %s moved to %s:%d", s->host->host,
+		    inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+	break;
+     case -1:
+        ev_close(s);
+	break;
+     }
+}
+
+/* Fetch a batch of datagrams from the shared socket */
+static void ev_udp_input(void)
+{
+     static char pkt[EV_UDP_BATCH][EV_UDP_SIZE];
+     struct sockaddr_in from[EV_UDP_BATCH];
+     int len[EV_UDP_BATCH];
+     int i, n;
+#ifdef HAVE_RECVMMSG
+     struct mmsghdr msg[EV_UDP_BATCH];
+     struct iovec iov[EV_UDP_BATCH];
+
+     memset(msg, 0, sizeof(msg));
+     for(i = 0; i < EV_UDP_BATCH; i++){
+        iov[i].iov_base = pkt[i];
+	iov[i].iov_len  = EV_UDP_SIZE;
+	msg[i].msg_hdr.msg_iov = &iov[i];
+	msg[i].msg_hdr.msg_iovlen = 1;
+	msg[i].msg_hdr.msg_name = &from[i];
+	msg[i].msg_hdr.msg_namelen = sizeof(from[i]);
+     }
+     if( (n = recvmmsg(ev_usock, msg, EV_UDP_BATCH, MSG_DONTWAIT, NULL)) <= 0 )
+        return;
+     for(i = 0; i < n; i++)
+        len[i] = msg[i].msg_len;
+#else
+     socklen_t opt;
+
+     for(n = 0; n < EV_UDP_BATCH; n++){
+        opt = sizeof(from[n]);
+	if( (len[n] = recvfrom(ev_usock, pkt[n], EV_UDP_SIZE, MSG_DONTWAIT,
+			       (struct sockaddr *) &from[n], &opt)) < 0 )
+	   break;
+     }
+#endif
+
+     for(i = 0; i < n; i++)
+        ev_udp_frame(&from[i], pkt[i], len[i]);
+}
+
+static int ev_dev_input(struct ev_sess *s)
+{
+     if( lfd_check_down(s->lnk) <= 0 ){
+        ev_throttle(s);
+	return 0;
+     }
+     return lfd_dev_input(s->lnk);
+}
+
+/* Give throttled sessions another chance */
+static void ev_unthrottle(void)
+{
+     struct ev_sess *s, *next;
+
+     for(s = ev_list; s && ev_nthrottled; s = next){
+        next = s->next;
+	if( !s->throttled )
+	   continue;
+	s->throttled = 0;
+	ev_nthrottled--;
+	if( s->rx_len && ev_tcp_frames(s) < 0 ){
+	   ev_close(s);
+	   continue;
+	}
+	ev_update(s);
+     }
+}
+
+/* Keep-alive, statistic and authentication timeouts */
+static void ev_timers(time_t now)
+{
+     struct ev_sess *s, *next;
+
+     for(s = ev_list; s; s = next){
+        next = s->next;
+
+	if( s->state != EV_LINK ){
+	   if( now >= s->deadline ){
+	      vtun_syslog(LOG_INFO,"Denied connection from %s:%d", s->ip, s->port);
+	      ev_close(s);
+	   }
+	   continue;
+	}
+
+	if( (s->host->flags & VTUN_KEEP_ALIVE) && now >= s->ka_timer ){
+	   s->ka_timer = now + s->host->ka_interval;
+	   if( lfd_keepalive(s->lnk) < 0 ){
+	      ev_close(s);
+	      continue;
+	   }
+	}
+	if( (s->host->flags & VTUN_STAT) && now >= s->stat_timer ){
+	   lfd_stat_write(s->host, now);
+	   s->stat_timer = now + VTUN_STAT_IVAL;
+	}
+     }
+}
+
+/* 
+ * Running sessions use their own copies of the hosts, they take
+ * over speed and keep-alive from the reloaded config.
+ */
+static void ev_reconfig(void)
+{
+     struct ev_sess *s;
+     struct vtun_host *h;
+
+     for(s = ev_list; s; s = s->next){
+        if( s->state != EV_LINK || !(h = find_host(s->host->host)) )
+	   continue;
+	if( lfd_update(s->lnk, h) ){
+	   s->ka_timer = time(NULL) + s->host->ka_interval;
+	   vtun_syslog(LOG_INFO,"Session %s updated", s->host->host);
+	}
+     }
+}
+
+static void ev_accept(int sock)
+{
+     struct sockaddr_in cl_addr;
+     struct ev_sess *s;
+     socklen_t opt;
+     int fd, i;
+
+     for(i = 0; i < EV_ACCEPT_BATCH; i++){
+        opt = sizeof(cl_addr);
+	if( (fd = accept(sock, (struct sockaddr *)&cl_addr, &opt)) < 0 )
+	   return;
+
+	if( !(s = calloc(1, sizeof(struct ev_sess))) || ev_tab_set(fd, s) ){
+	   vtun_syslog(LOG_ERR,"Can't allocate session");
+	   free(s);
+	   close(fd);
+	   continue;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	s->fd = fd;
+	s->state = EV_AUTH;
+	s->ip = strdup(inet_ntoa(cl_addr.sin_addr));
+	s->port = ntohs(cl_addr.sin_port);
+	s->peer = cl_addr;
+	s->deadline = time(NULL) + vtun.timeout;
+
+	s->next = ev_list;
+	if( ev_list )
+	   ev_list->prev = s;
+	ev_list = s;
+
+	if( !(s->auth = auth_server_start(fd)) ||
+	    ev_ctl(EPOLL_CTL_ADD, fd, EPOLLIN) < 0 ){
+	   ev_close(s);
+	   continue;
+	}
+     }
+}
+
+/* 
+ * Handoff of the sessions to a new server.
+ * Old server passes its listening sockets and, for every session,
+ * the connection, the device and the state of the linker over a 
+ * unix socket. Frames are not processed meanwhile. Once the new 
+ * server confirms, the old one exits without closing the sessions.
+ * Sessions whose modules can't be saved are closed as usual.
+ */
+#define EV_HO_MAGIC	0x5654484f	/* VTHO */
+#define EV_HO_VERSION	1
+
+/* Max size of the saved linker state */
+#define EV_HO_STATE	1024
+
+struct ev_ho_hello {
+   unsigned int magic;
+   int  version;
+   int  size;		/* Record size, number of sockets in the reply */
+};
+
+/* Session record, the connection and the device go along */
+struct ev_ho_rec {
+   int  name_len;	/* 0 ends the list */
+   int  flags;
+   int  spd_in;
+   int  spd_out;
+   int  ka_interval;
+   int  ka_maxfail;
+   unsigned int sid;
+   struct sockaddr_in peer;
+   int  peer_ok;
+   int  port;
+   int  lport;
+   int  rport;
+   int  rx_len;
+   int  rx_skip;
+   int  tx_len;
+   int  ip_len;
+   int  dev_len;
+   int  laddr_len;
+   int  state_len;
+   /* Followed by name, ip, dev, laddr, rx, tx and state */
+};
+
+/* Read or write exactly len bytes, fails on timeout */
+static int ev_ho_io(int fd, char *buf, int len, int wr)
+{
+     int n;
+
+     while( len > 0 ){
+        n = wr ? write(fd, buf, len) : read(fd, buf, len);
+	if( n < 0 && errno == EINTR )
+	   continue;
+	if( n <= 0 )
+	   return -1;
+	buf += n;
+	len -= n;
+     }
+     return 0;
+}
+
+/* Send message with up to two file descriptors */
+static int ev_ho_send(int fd, void *buf, int len, int *fds, int nfds)
+{
+     char cbuf[CMSG_SPACE(2 * sizeof(int))];
+     struct cmsghdr *cmsg;
+     struct msghdr msg;
+     struct iovec iov;
+
+     memset(&msg, 0, sizeof(msg));
+     iov.iov_base = buf;
+     iov.iov_len = len;
+     msg.msg_iov = &iov;
+     msg.msg_iovlen = 1;
+
+     if( nfds ){
+        memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+     }
+     return sendmsg(fd, &msg, 0) == len ? 0 : -1;
+}
+
+/* Receive message and the descriptors which came with it */
+static int ev_ho_recv(int fd, void *buf, int len, int *fds)
+{
+     char cbuf[CMSG_SPACE(2 * sizeof(int))];
+     struct cmsghdr *cmsg;
+     struct msghdr msg;
+     struct iovec iov;
+     int i, n;
+
+     fds[0] = fds[1] = -1;
+     memset(&msg, 0, sizeof(msg));
+     iov.iov_base = buf;
+     iov.iov_len = len;
+     msg.msg_iov = &iov;
+     msg.msg_iovlen = 1;
+     msg.msg_control = cbuf;
+     msg.msg_controllen = sizeof(cbuf);
+
+     if( recvmsg(fd, &msg, MSG_WAITALL) != len || (msg.msg_flags & MSG_CTRUNC) )
+        return -1;
+     for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+	   continue;
+	n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for(i = 0; i < n && i < 2; i++){
+	   memcpy(&fds[i], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	   fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+     }
+     return 0;
+}
+
+static char * ev_ho_str(int fd, int len)
+{
+     char *str;
+
+     if( len < 0 || len > VTUN_MESG_SIZE || !(str = malloc(len + 1)) )
+        return NULL;
+     if( ev_ho_io(fd, str, len, 0) ){
+        free(str);
+	return NULL;
+     }
+     str[len] = '\0';
+     return str;
+}
+
+static void ev_ho_timeout(int fd)
+{
+     struct timeval tv;
+
+     tv.tv_sec = vtun.timeout;
+     tv.tv_usec = 0;
+     setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int ev_ho_listen(void)
+{
+     struct sockaddr_un sa;
+     mode_t mask;
+     int fd;
+
+     if( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+        return -1;
+     fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+     memset(&sa, 0, sizeof(sa));
+     sa.sun_family = AF_UNIX;
+     strncpy(sa.sun_path, VTUN_HANDOFF_SOCK, sizeof(sa.sun_path) - 1);
+     unlink(sa.sun_path);
+
+     /* Sessions' keys go through it */
+     mask = umask(077);
+     if( bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(fd, 1) ){
+        vtun_syslog(LOG_ERR,"Can't listen on %s. %s(%d)", VTUN_HANDOFF_SOCK,
+		    strerror(errno), errno);
+	close(fd);
+	fd = -1;
+     }
+     umask(mask);
+     return fd;
+}
+
+/* Send the session, returns 1 if it can't be handed off */
+static int ev_ho_session(int fd, struct ev_sess *s, char *state)
+{
+     struct vtun_host *host = s->host;
+     struct ev_ho_rec rec;
+     int fds[2];
+
+     if( s->state != EV_LINK || (host->flags & (VTUN_ARQ | VTUN_MPATH)) )
+        return 1;
+     memset(&rec, 0, sizeof(rec));
+     if( (rec.state_len = lfd_save(s->lnk, state, EV_HO_STATE)) < 0 )
+        return 1;
+
+     rec.name_len = strlen(host->host);
+     rec.flags = host->flags;
+     rec.spd_in = host->spd_in;
+     rec.spd_out = host->spd_out;
+     rec.ka_interval = host->ka_interval;
+     rec.ka_maxfail = host->ka_maxfail;
+     rec.sid = s->sid;
+     rec.peer = s->peer;
+     rec.peer_ok = s->peer_ok;
+     rec.port = s->port;
+     rec.lport = host->sopt.lport;
+     rec.rport = host->sopt.rport;
+     rec.rx_len = s->rx_len;
+     rec.rx_skip = s->rx_skip;
+     rec.tx_len = s->tx_len;
+     rec.ip_len = strlen(s->ip);
+     rec.dev_len = host->sopt.dev ? strlen(host->sopt.dev) : 0;
+     rec.laddr_len = host->sopt.laddr ? strlen(host->sopt.laddr) : 0;
+
+     fds[0] = s->fd;
+     fds[1] = host->loc_fd;
+     if( ev_ho_send(fd, &rec, sizeof(rec), fds, 2) ||
+	 ev_ho_io(fd, host->host, rec.name_len, 1) ||
+	 ev_ho_io(fd, s->ip, rec.ip_len, 1) ||
+	 ev_ho_io(fd, host->sopt.dev, rec.dev_len, 1) ||
+	 ev_ho_io(fd, host->sopt.laddr, rec.laddr_len, 1) ||
+	 ev_ho_io(fd, s->rx, rec.rx_len, 1) ||
+	 ev_ho_io(fd, s->tx, rec.tx_len, 1) ||
+	 ev_ho_io(fd, state, rec.state_len, 1) )
+        return -1;
+
+     s->handed = 1;
+     return 0;
+}
+
+/* Pass the sessions to the new server, returns 0 if it took them */
+static int ev_handoff(int sock)
+{
+     struct ev_ho_hello hello;
+     struct ev_ho_rec rec;
+     struct ev_sess *s;
+     int fd, fds[2], n = 0, err = -1;
+     char *state = NULL, ack;
+
+     if( (fd = accept(ev_hsock, NULL, NULL)) < 0 )
+        return -1;
+     ev_ho_timeout(fd);
+
+     if( ev_ho_io(fd, (char *) &hello, sizeof(hello), 0) ||
+	 hello.magic != EV_HO_MAGIC || hello.version != EV_HO_VERSION ||
+	 hello.size != sizeof(rec) ){
+        vtun_syslog(LOG_ERR,"Handoff refused, the new server is not compatible");
+	goto done;
+     }
+     if( !(state = malloc(EV_HO_STATE)) )
+        goto done;
+
+     /* Listening sockets first, then the sessions */
+     fds[0] = sock;
+     fds[1] = ev_usock;
+     hello.size = ev_usock >= 0 ? 2 : 1;
+     if( ev_ho_send(fd, &hello, sizeof(hello), fds, hello.size) )
+        goto done;
+
+     for(s = ev_list; s; s = s->next){
+        switch( ev_ho_session(fd, s, state) ){
+	   case -1:
+	      goto done;
+	   case 0:
+	      n++;
+	}
+     }
+     memset(&rec, 0, sizeof(rec));
+     if( ev_ho_io(fd, (char *) &rec, sizeof(rec), 1) )
+        goto done;
+
+     /* Sessions are the new server's once it confirms */
+     if( !ev_ho_io(fd, &ack, 1, 0) && ack == 'A' )
+        err = 0;
+
+done:
+     if( err ){
+        vtun_syslog(LOG_ERR,"Handoff failed, sessions stay with this server");
+	for(s = ev_list; s; s = s->next)
+	   s->handed = 0;
+     } else
+        vtun_syslog(LOG_INFO,"Handed %d sessions off to the new server", n);
+     free(state);
+     close(fd);
+     return err;
+}
+
+/* Drivers of the session taken over, tunnel_open() sets them otherwise */
+static void ev_drivers(struct vtun_host *host)
+{
+     switch( host->flags & VTUN_TYPE_MASK ){
+        case VTUN_TTY:
+	   dev_read  = pty_read;
+	   dev_write = pty_write;
+	   break;
+        case VTUN_PIPE:
+	   dev_read  = pipe_read;
+	   dev_write = pipe_write;
+	   break;
+        case VTUN_ETHER:
+	   dev_read  = tap_read;
+	   dev_write = tap_write;
+	   break;
+        case VTUN_TUN:
+	   dev_read  = tun_read;
+	   dev_write = tun_write;
+	   break;
+     }
+     if( host->flags & VTUN_TCP ){
+        proto_write = tcp_write;
+	proto_read  = tcp_read;
+     } else {
+        proto_write = udp_write;
+	proto_read  = udp_read;
+     }
+}
+
+/* Receive the session, returns -1 if the handoff has to be abandoned */
+static int ev_ho_adopt(int fd, struct ev_ho_rec *rec, int *fds)
+{
+     struct vtun_host *h, *host;
+     struct ev_sess *s;
+     char *name, *dev = NULL, *laddr = NULL, *state = NULL;
+
+     if( rec->rx_len < 0 || rec->rx_len > EV_RX_SIZE ||
+	 rec->tx_len < 0 || rec->tx_len > EV_TX_MAX ||
+	 rec->state_len < 0 || rec->state_len > EV_HO_STATE ||
+	 !(s = calloc(1, sizeof(struct ev_sess))) )
+        return -1;
+
+     if( !(name = ev_ho_str(fd, rec->name_len)) ||
+	 !(s->ip = ev_ho_str(fd, rec->ip_len)) ||
+	 !(dev = ev_ho_str(fd, rec->dev_len)) ||
+	 !(laddr = ev_ho_str(fd, rec->laddr_len)) ||
+	 ev_ho_io(fd, s->rx, rec->rx_len, 0) ||
+	 (rec->tx_len && (!(s->tx = malloc(EV_TX_MAX)) ||
+			  ev_ho_io(fd, s->tx, rec->tx_len, 0))) ||
+	 !(state = malloc(EV_HO_STATE)) ||
+	 ev_ho_io(fd, state, rec->state_len, 0) ){
+        free(name); free(dev); free(laddr); free(state);
+	free(s->ip); free(s->tx); free(s);
+	return -1;
+     }
+
+     host = NULL;
+     if( fds[0] < 0 || fds[1] < 0 )
+        vtun_syslog(LOG_ERR,"Session %s came without its sockets", name);
+     else if( !(h = find_host(name)) )
+        vtun_syslog(LOG_ERR,"Session %s dropped, host is not configured", name);
+     else if( (host = dup_host(h)) ){
+	host->flags = rec->flags;
+	host->spd_in = rec->spd_in;
+	host->spd_out = rec->spd_out;
+	host->ka_interval = rec->ka_interval;
+	host->ka_maxfail = rec->ka_maxfail;
+	host->sid = rec->sid;
+	host->rmt_fd = fds[0];
+	host->loc_fd = fds[1];
+	host->persist = 0;
+	host->sopt.dev = dev;
+	host->sopt.laddr = laddr;
+	host->sopt.raddr = strdup(s->ip);
+	host->sopt.lport = rec->lport;
+	host->sopt.rport = rec->rport;
+	memset(&host->stat, 0, sizeof(host->stat));
+	dev = laddr = NULL;
+
+	ev_drivers(host);
+	if( !(s->lnk = lfd_restore(host, state, rec->state_len)) ){
+	   vtun_syslog(LOG_ERR,"Session %s dropped, linker can't be restored", name);
+	   ev_free_host(host);
+	   host = NULL;
+	}
+     }
+     free(name); free(dev); free(laddr); free(state);
+
+     if( !host ){
+        if( fds[0] >= 0 )
+	   close(fds[0]);
+        if( fds[1] >= 0 )
+	   close(fds[1]);
+	free(s->ip); free(s->tx); free(s);
+	return 0;
+     }
+
+     s->state = EV_LINK;
+     s->host = host;
+     s->fd = host->rmt_fd;
+     s->sid = rec->sid;
+     s->peer = rec->peer;
+     s->peer_ok = rec->peer_ok;
+     s->port = rec->port;
+     s->rx_len = rec->rx_len;
+     s->rx_skip = rec->rx_skip;
+     s->tx_len = rec->tx_len;
+
+     s->next = ev_list;
+     if( ev_list )
+        ev_list->prev = s;
+     ev_list = s;
+
+     vtun_syslog(LOG_INFO,"Session %s[%s:%d] taken over", host->host, s->ip, s->port);
+     return 0;
+}
+
+/* 
+ * Take the sessions over from the running server. 
+ * They are started by event_server() on sock and usock.
+ */
+int ev_takeover(int *sock, int *usock)
+{
+     struct ev_ho_hello hello;
+     struct ev_ho_rec rec;
+     struct sockaddr_un sa;
+     int fd, fds[2], lfds[2];
+     char ack = 'A';
+
+     if( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+        return -1;
+     memset(&sa, 0, sizeof(sa));
+     sa.sun_family = AF_UNIX;
+     strncpy(sa.sun_path, VTUN_HANDOFF_SOCK, sizeof(sa.sun_path) - 1);
+     if( connect(fd, (struct sockaddr *) &sa, sizeof(sa)) ){
+        vtun_syslog(LOG_ERR,"Can't connect to the running server %s. %s(%d)", 
+		    VTUN_HANDOFF_SOCK, strerror(errno), errno);
+	close(fd);
+	return -1;
+     }
+     ev_ho_timeout(fd);
+
+     hello.magic = EV_HO_MAGIC;
+     hello.version = EV_HO_VERSION;
+     hello.size = sizeof(rec);
+     if( ev_ho_io(fd, (char *) &hello, sizeof(hello), 1) ||
+	 ev_ho_recv(fd, &hello, sizeof(hello), lfds) || lfds[0] < 0 )
+        goto failed;
+
+     for(;;){
+        if( ev_ho_recv(fd, &rec, sizeof(rec), fds) )
+	   goto failed;
+	if( !rec.name_len )
+	   break;
+	if( ev_ho_adopt(fd, &rec, fds) )
+	   goto failed;
+     }
+
+     /* Old server lets the sessions go once it closes the connection */
+     if( ev_ho_io(fd, &ack, 1, 1) || read(fd, &ack, 1) != 0 )
+        goto failed;
+     close(fd);
+
+     *sock = lfds[0];
+     *usock = lfds[1];
+     return 0;
+
+failed:
+     vtun_syslog(LOG_ERR,"Handoff from the running server failed");
+     close(fd);
+     return -1;
+}
+
+void event_server(int sock, int usock, int worker)
+{
+     struct epoll_event events[EV_MAX_EVENTS];
+     struct sockaddr_in my_addr;
+     struct sigaction sa;
+     struct ev_sess *s, *next;
+     time_t now, tick = 0;
+     socklen_t opt;
+     int i, n, fd, handed = 0;
+
+     if( (ev_poll = epoll_create(EV_MAX_EVENTS)) < 0 ){
+	vtun_syslog(LOG_ERR,"Can't create epoll instance");
+	exit(1);
+     }
+     ev_nonblock(sock);
+     ev_ctl(EPOLL_CTL_ADD, sock, EPOLLIN);
+
+     ev_worker = worker;
+     opt = sizeof(my_addr);
+     if( usock >= 0 && !getsockname(usock, (struct sockaddr *) &my_addr, &opt) ){
+        ev_usock = usock;
+	ev_uport = my_addr.sin_port;
+	ev_nonblock(usock);
+	ev_ctl(EPOLL_CTL_ADD, usock, EPOLLIN);
+     }
+
+     /* Sessions are handed off by a single process only */
+     if( vtun.workers <= 1 && (ev_hsock = ev_ho_listen()) >= 0 )
+        ev_ctl(EPOLL_CTL_ADD, ev_hsock, EPOLLIN);
+
+     /* Sessions taken over from the previous server */
+     for(s = ev_list; s; s = next){
+        next = s->next;
+	ev_link(s);
+     }
+
+     memset(&sa,0,sizeof(sa));
+     sa.sa_flags = SA_NOCLDWAIT;
+     sa.sa_handler=sig_term;
+     sigaction(SIGTERM,&sa,NULL);
+     sigaction(SIGINT,&sa,NULL);
+     sa.sa_handler=sig_hup;
+     sigaction(SIGHUP,&sa,NULL);
+     ev_term = ev_reload = 0;
+
+     io_init();
+
+     set_title("waiting for connections on port %d", vtun.bind_addr.port);
+
+     while( !ev_term ){
+        n = epoll_wait(ev_poll, events, EV_MAX_EVENTS, ev_nthrottled ? 10 : 1000);
+	if( n < 0 && errno != EINTR ){
+	   vtun_syslog(LOG_ERR,"epoll_wait failed. %s(%d)", strerror(errno), errno);
+	   break;
+	}
+
+	for(i = 0; i < n; i++){
+	   fd = events[i].data.fd;
+	   if( fd == sock ){
+	      ev_accept(sock);
+	      continue;
+	   }
+	   if( fd == ev_usock ){
+	      ev_udp_input();
+	      continue;
+	   }
+	   if( fd == ev_hsock ){
+	      if( !ev_handoff(sock) ){
+		 handed = 1;
+		 break;
+	      }
+	      continue;
+	   }
+	   /* Session may be closed by the previous event */
+	   if( fd >= ev_tab_size || !(s = ev_tab[fd]) )
+	      continue;
+
+	   if( s->state == EV_AUTH ){
+	      ev_auth_input(s);
+	      continue;
+	   }
+	   if( s->state == EV_PORT ){
+	      ev_port_input(s);
+	      continue;
+	   }
+
+	   if( fd == s->fd ){
+	      if( (events[i].events & EPOLLOUT) && ev_tx_flush(s) < 0 ){
+		 ev_close(s);
+		 continue;
+	      }
+	      if( (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+		  ev_net_input(s) < 0 ){
+		 ev_close(s);
+		 continue;
+	      }
+	   } else if( s->tx_len == 0 && ev_dev_input(s) < 0 ){
+	      ev_close(s);
+	      continue;
+	   }
+	}
+	/* Sessions belong to the new server, leave them alone */
+	if( handed )
+	   break;
+
+	if( ev_nthrottled )
+	   ev_unthrottle();
+
+	if( ev_reload ){
+	   ev_reload = 0;
+	   if( !read_config(vtun.cfg_file) )
+	      vtun_syslog(LOG_ERR,"No hosts defined");
+	   else
+	      ev_reconfig();
+	}
+
+	if( (now = time(NULL)) != tick ){
+	   tick = now;
+	   ev_timers(now);
+	}
+     }
+
+     while( ev_list )
+        ev_close(ev_list);
+     if( ev_hsock >= 0 ){
+        close(ev_hsock);
+	/* New server listens on it already */
+	if( !handed )
+	   unlink(VTUN_HANDOFF_SOCK);
+     }
+     close(ev_poll);
+     close(sock);
+     if( ev_usock >= 0 )
+        close(ev_usock);
+}
+
+#else
+
+int ev_lock_host(struct vtun_host *host)
+{
+     return 0;
+}
+
+unsigned int ev_session_id(struct vtun_host *host)
+{
+     return 0;
+}
+
+void event_server(int sock, int usock, int worker)
+{
+     vtun_syslog(LOG_ERR,"Event server is not supported: epoll not available");
+}
+
+int ev_takeover(int *sock, int *usock)
+{
+     vtun_syslog(LOG_ERR,"Handoff is not supported: epoll not available");
+     return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -57,6 +57,26 @@
 #include "lib.h"
 
 extern int is_rmt_fd_connected; 
+extern unsigned int udp_session_id;
+
+/* 
+ * Local address of the socket is gone. Put a socket the kernel picks
+ * the address for in its place, the server moves the session to it
+ * once our frames arrive from there.
+ */
+static void udp_rebind(int fd)
+{
+     struct sockaddr_in addr;
+     socklen_t opt = sizeof(addr);
+     int s;
+
+     if( getpeername(fd, (struct sockaddr *)&addr, &opt) ||
+	 (s = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+	return;
+     if( !connect(s, (struct sockaddr *)&addr, opt) && dup2(s, fd) >= 0 )
+	vtun_syslog(LOG_INFO,"Local address changed, UDP socket rebound");
+     close(s);
+}
 
 /* Functions to read/write UDP frames. */
 int udp_write(int fd, char *buf, int len)
@@ -71,12 +91,28 @@ int udp_write(int fd, char *buf, int len)
      *((unsigned short *)ptr) = htons(len); 
      len  = (len & VTUN_FSIZE_MASK) + sizeof(short);
 
+     /* Shared socket of the server finds the session by its ID */
+     if( udp_session_id ){
+        uint32_t sid = htonl(udp_session_id);
+
+        ptr -= sizeof(sid);
+        memcpy(ptr, &sid, sizeof(sid));
+        len += sizeof(sid);
+     }
+
      while( 1 ){
 	if( (wlen = write(fd, ptr, len)) < 0 ){ 
 	   if( errno == EAGAIN || errno == EINTR )
 	      continue;
 	   if( errno == ENOBUFS )
 	      return 0;
+	   /* Server on the shared socket follows us to a new address,
+	    * the frame is lost while there is no route */
+	   if( udp_session_id && (errno == ENETUNREACH ||
+	       errno == EADDRNOTAVAIL || errno == EINVAL) ){
+	      udp_rebind(fd);
+	      return 0;
+	   }
 	}
 	/* Even if we wrote only part of the frame
          * we can't use second write since it will produce 
@@ -0,0 +1,342 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Redundancy elimination (byte cache) module.
+ *
+ * Both ends keep a mirrored ring buffer with the last bytes sent in
+ * each direction. The encoder splits every frame into content defined
+ * chunks (gear rolling hash), looks the chunks up in an index of the
+ * cache and replaces the ones it has already sent with short references.
+ * The decoder copies referenced bytes out of its own copy of the cache.
+ *
+ * Caches stay in sync only if every frame is delivered exactly once
+ * and in order, so the module is used with TCP sessions only.
+ *
+ * Frame format is a sequence of tokens:
+ *   DD_LIT: type | len(2) | bytes
+ *   DD_REF: type | distance(4) | len(2)
+ * where distance is counted back from the current end of the cache.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "vtun.h"
+#include "linkfd.h"
+#include "lib.h"
+
+#define DD_MIN_CHUNK	32
+#define DD_CHUNK_MASK	0xfe00000000000000ULL	/* ~128 bytes average chunk */
+#define DD_MIN_CACHE	64	/* KB */
+
+/* Token types */
+#define DD_LIT		0
+#define DD_REF		1
+
+typedef unsigned long long dd_pos;
+
+struct dd_cache {
+     unsigned char *buf;
+     unsigned long size;
+     dd_pos end;		/* Stream position of the end of the cache */
+};
+
+struct dd_slot {
+     unsigned long long fp;
+     dd_pos pos;
+     unsigned int len;
+};
+
+struct dd_state {
+     struct dd_cache enc_cache, dec_cache;
+     struct dd_slot *dd_index;
+     unsigned long dd_index_mask;
+     char *enc_buf, *dec_buf;
+     unsigned long long dd_bytes_in, dd_bytes_saved;
+};
+
+/* Chunker table, the same for all sessions */
+static unsigned long long gear[256];
+static int dd_buf_size = VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD;
+
+static unsigned long long dd_fingerprint(const unsigned char *p, int len)
+{
+     unsigned long long h = 0xcbf29ce484222325ULL;
+
+     while( len-- ){
+	h ^= *p++;
+	h *= 0x100000001b3ULL;
+     }
+     return h;
+}
+
+/* Append bytes to the end of the cache */
+static void dd_cache_add(struct dd_cache *c, const unsigned char *p, int len)
+{
+     unsigned long off = c->end % c->size, n;
+
+     c->end += len;
+     while( len > 0 ){
+	n = min(c->size - off, (unsigned long)len);
+	memcpy(c->buf + off, p, n);
+	p += n; len -= n; off = 0;
+     }
+}
+
+/* Referenced bytes must still be in the cache */
+static inline int dd_cache_valid(struct dd_cache *c, dd_pos pos, int len)
+{
+     return pos + len <= c->end && pos + c->size >= c->end;
+}
+
+static void dd_cache_copy(struct dd_cache *c, unsigned char *to, dd_pos pos, int len)
+{
+     unsigned long off = pos % c->size, n;
+
+     while( len > 0 ){
+	n = min(c->size - off, (unsigned long)len);
+	memcpy(to, c->buf + off, n);
+	to += n; len -= n; off = 0;
+     }
+}
+
+static int dd_cache_cmp(struct dd_cache *c, const unsigned char *p, dd_pos pos, int len)
+{
+     unsigned long off = pos % c->size, n;
+
+     while( len > 0 ){
+	n = min(c->size - off, (unsigned long)len);
+	if( memcmp(p, c->buf + off, n) )
+	   return 1;
+	p += n; len -= n; off = 0;
+     }
+     return 0;
+}
+
+static int alloc_dedup(struct lfd_mod *mod, struct vtun_host *host)
+{
+     unsigned long size = (host->dedup > DD_MIN_CACHE ? host->dedup : DD_MIN_CACHE) * 1024UL;
+     unsigned long long x = 0x9e3779b97f4a7c15ULL;
+     unsigned long slots;
+     struct dd_state *dd;
+     int i;
+
+     if( host->dedup > VTUN_DEDUP_MAX ){
+	vtun_syslog(LOG_ERR,"Byte cache size %dK is too big, max %dK",
+		    host->dedup, VTUN_DEDUP_MAX);
+	return 1;
+     }
+
+     /* Chunker table, only has to be consistent within the encoder */
+     for(i = 0; i < 256; i++){
+	x += 0x9e3779b97f4a7c15ULL;
+	gear[i] = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ULL;
+     }
+
+     if( !(dd = mod->priv = calloc(1, sizeof(struct dd_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate byte cache");
+	return 1;
+     }
+
+     for(slots = 1; slots < size / 64; slots <<= 1);
+     dd->dd_index_mask = slots - 1;
+
+     dd->enc_cache.size = dd->dec_cache.size = size;
+
+     if( !(dd->enc_cache.buf = malloc(size)) || !(dd->dec_cache.buf = malloc(size)) ||
+	 !(dd->dd_index = calloc(slots, sizeof(struct dd_slot))) ||
+	 !(dd->enc_buf = lfd_alloc(dd_buf_size)) || !(dd->dec_buf = lfd_alloc(dd_buf_size)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate byte cache");
+	return 1;
+     }
+
+     vtun_syslog(LOG_INFO, "Redundancy elimination[cache %luK] initialized", size / 1024);
+     return 0;
+}
+
+static int free_dedup(struct lfd_mod *mod)
+{
+     struct dd_state *dd = mod->priv;
+
+     if( !dd )
+	return 0;
+
+     if( dd->dd_bytes_in )
+	vtun_syslog(LOG_INFO, "Redundancy elimination saved %llu of %llu bytes",
+		    dd->dd_bytes_saved, dd->dd_bytes_in);
+
+     free(dd->enc_cache.buf);
+     free(dd->dec_cache.buf);
+     free(dd->dd_index);
+     if( dd->enc_buf )
+	lfd_free(dd->enc_buf);
+     if( dd->dec_buf )
+	lfd_free(dd->dec_buf);
+     free(dd); mod->priv = NULL;
+     return 0;
+}
+
+static unsigned char * dd_put_lit(unsigned char *p, const unsigned char *lit, int len)
+{
+     *p++ = DD_LIT;
+     *p++ = len >> 8; *p++ = len;
+     memcpy(p, lit, len);
+     return p + len;
+}
+
+static int comp_dedup(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct dd_state *dd = mod->priv;
+     struct dd_cache *enc_cache = &dd->enc_cache;
+     const unsigned char *data = (unsigned char *) in, *lit = data;
+     unsigned char *p = (unsigned char *) dd->enc_buf, *ref = NULL;
+     dd_pos start = enc_cache->end, dist, ref_end = 0;
+     unsigned long long h, fp;
+     struct dd_slot *s;
+     int i, cs, clen, ref_len = 0;
+
+     if( len + 3 > dd_buf_size )
+	return -1;
+
+     dd->dd_bytes_in += len;
+
+     for(cs = 0, h = 0, i = 0; i < len; i++){
+	h = (h << 1) + gear[data[i]];
+	clen = i + 1 - cs;
+	if( i != len - 1 && (clen < DD_MIN_CHUNK || (h & DD_CHUNK_MASK)) )
+	   continue;
+
+	/* Chunk [cs, i] */
+	if( clen >= DD_MIN_CHUNK ){
+	   fp = dd_fingerprint(data + cs, clen);
+	   s = &dd->dd_index[fp & dd->dd_index_mask];
+
+	   if( s->fp == fp && s->len == clen &&
+	       dd_cache_valid(enc_cache, s->pos, clen) &&
+	       !dd_cache_cmp(enc_cache, data + cs, s->pos, clen) ){
+	      if( lit < data + cs ){
+		 p = dd_put_lit(p, lit, data + cs - lit);
+		 ref = NULL;
+	      }
+	      if( ref && ref_end == s->pos && ref_len + clen <= 0xffff ){
+		 /* Extend previous reference */
+		 ref_len += clen;
+		 ref[5] = ref_len >> 8; ref[6] = ref_len;
+		 dd->dd_bytes_saved += clen;
+	      } else {
+		 dist = start - s->pos;
+		 ref = p;
+		 ref_len = clen;
+		 *p++ = DD_REF;
+		 *p++ = dist >> 24; *p++ = dist >> 16;
+		 *p++ = dist >> 8;  *p++ = dist;
+		 *p++ = clen >> 8;  *p++ = clen;
+		 dd->dd_bytes_saved += clen - 7;
+	      }
+	      ref_end = s->pos + clen;
+	      lit = data + i + 1;
+	   }
+	   /* Remember where the chunk will be in the cache */
+	   s->fp  = fp;
+	   s->pos = start + cs;
+	   s->len = clen;
+	}
+	cs = i + 1;
+	h = 0;
+     }
+     if( lit < data + len )
+	p = dd_put_lit(p, lit, data + len - lit);
+
+     dd_cache_add(enc_cache, data, len);
+
+     *out = dd->enc_buf;
+     return p - (unsigned char *) dd->enc_buf;
+}
+
+static int decomp_dedup(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct dd_state *dd = mod->priv;
+     struct dd_cache *dec_cache = &dd->dec_cache;
+     unsigned char *p = (unsigned char *) in, *end = p + len;
+     unsigned char *o = (unsigned char *) dd->dec_buf;
+     dd_pos dist;
+     int n, olen = 0;
+
+     while( p < end ){
+	switch( *p++ ){
+	   case DD_LIT:
+	      if( end - p < 2 )
+		 return -1;
+	      n = (p[0] << 8) | p[1];
+	      p += 2;
+	      if( end - p < n || olen + n > dd_buf_size )
+		 return -1;
+	      memcpy(o + olen, p, n);
+	      p += n;
+	      break;
+
+	   case DD_REF:
+	      if( end - p < 6 )
+		 return -1;
+	      dist = ((dd_pos)p[0] << 24) | ((dd_pos)p[1] << 16) |
+		     ((dd_pos)p[2] << 8) | p[3];
+	      n = (p[4] << 8) | p[5];
+	      p += 6;
+	      if( dist > dec_cache->end || olen + n > dd_buf_size ||
+		  !dd_cache_valid(dec_cache, dec_cache->end - dist, n) ){
+		 vtun_syslog(LOG_ERR,"Byte cache is out of sync");
+		 return -1;
+	      }
+	      dd_cache_copy(dec_cache, o + olen, dec_cache->end - dist, n);
+	      break;
+
+	   default:
+	      return -1;
+	}
+	olen += n;
+     }
+
+     dd_cache_add(dec_cache, o, olen);
+
+     *out = dd->dec_buf;
+     return olen;
+}
+
+struct lfd_mod lfd_dedup = {
+     "DEDUP",
+     alloc_dedup,
+     comp_dedup,
+     NULL,
+     decomp_dedup,
+     NULL,
+     free_dedup,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL
+};
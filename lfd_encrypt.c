@@ -31,10 +31,9 @@ typedef struct CryptoCtx {
     unsigned char *message;
     unsigned char *nonce;
     unsigned char *previous_decrypted_nonce;
+    unsigned char *key; /* Kept for the handoff, no access otherwise */
 } CryptoCtx;
 
-static CryptoCtx ctx;
-
 static int
 init_nonce(unsigned char *nonce, size_t nonce_size)
 {
@@ -64,43 +63,112 @@ init_nonce(unsigned char *nonce, size_t nonce_size)
 }
 
 static int
-alloc_encrypt(struct vtun_host *host)
+init_encrypt(struct lfd_mod *mod, unsigned char *key)
 {
-    ctx.state = sodium_malloc(sizeof *ctx.state);
-    ctx.message = sodium_malloc(MESSAGE_MAX_SIZE);
-    ctx.ciphertext = sodium_malloc(CIPHERTEXT_MAX_TOTAL_SIZE);
-    ctx.nonce = sodium_malloc(crypto_aead_NPUBBYTES);
-    ctx.previous_decrypted_nonce = sodium_malloc(crypto_aead_NPUBBYTES);
-    if (host->key == NULL || ctx.state == NULL || ctx.message == NULL ||
-        ctx.ciphertext == NULL || ctx.ciphertext == NULL || ctx.nonce == NULL ||
-        ctx.previous_decrypted_nonce == NULL) {
+    CryptoCtx *ctx;
+
+    if ((ctx = mod->priv = calloc(1, sizeof *ctx)) == NULL) {
         abort();
     }
-    if (init_nonce(ctx.nonce, crypto_aead_NPUBBYTES) != 0) {
-        return -1;
+    ctx->state = sodium_malloc(sizeof *ctx->state);
+    ctx->message = sodium_malloc(MESSAGE_MAX_SIZE);
+    ctx->ciphertext = sodium_malloc(CIPHERTEXT_MAX_TOTAL_SIZE);
+    ctx->nonce = sodium_malloc(crypto_aead_NPUBBYTES);
+    ctx->previous_decrypted_nonce = sodium_malloc(crypto_aead_NPUBBYTES);
+    if (key == NULL || ctx->state == NULL || ctx->message == NULL ||
+        ctx->ciphertext == NULL || ctx->ciphertext == NULL || ctx->nonce == NULL ||
+        ctx->previous_decrypted_nonce == NULL) {
+        abort();
     }
-    memset(ctx.previous_decrypted_nonce, 0, crypto_aead_NPUBBYTES);
-    crypto_aead_aes256gcm_beforenm(ctx.state, host->key);
-    sodium_free(host->key);
+    crypto_aead_aes256gcm_beforenm(ctx->state, key);
+    ctx->key = key;
+    sodium_mprotect_noaccess(ctx->key);
+
+    return 0;
+}
+
+static int
+alloc_encrypt(struct lfd_mod *mod, struct vtun_host *host)
+{
+    CryptoCtx *ctx;
+
+    init_encrypt(mod, host->key);
     host->key = NULL;
+    ctx = mod->priv;
+    if (init_nonce(ctx->nonce, crypto_aead_NPUBBYTES) != 0) {
+        return -1;
+    }
+    memset(ctx->previous_decrypted_nonce, 0, crypto_aead_NPUBBYTES);
+
+    return 0;
+}
+
+/* State for the handoff: key, next nonce and the last one decrypted */
+#define STATE_SIZE (HOST_KEYBYTES + 2 * crypto_aead_NPUBBYTES)
+
+static int
+save_encrypt(struct lfd_mod *mod, char *buf_, int size)
+{
+    CryptoCtx     *ctx = mod->priv;
+    unsigned char *buf = (unsigned char *) buf_;
+
+    if (size < STATE_SIZE) {
+        return -1;
+    }
+    sodium_mprotect_readonly(ctx->key);
+    memcpy(buf, ctx->key, HOST_KEYBYTES);
+    sodium_mprotect_noaccess(ctx->key);
+    memcpy(buf + HOST_KEYBYTES, ctx->nonce, crypto_aead_NPUBBYTES);
+    memcpy(buf + HOST_KEYBYTES + crypto_aead_NPUBBYTES,
+           ctx->previous_decrypted_nonce, crypto_aead_NPUBBYTES);
+
+    return STATE_SIZE;
+}
+
+static int
+restore_encrypt(struct lfd_mod *mod, struct vtun_host *host, char *buf_, int len)
+{
+    CryptoCtx     *ctx;
+    unsigned char *buf = (unsigned char *) buf_;
+    unsigned char *key;
+
+    if (len != STATE_SIZE || (key = sodium_malloc(HOST_KEYBYTES)) == NULL) {
+        return -1;
+    }
+    memcpy(key, buf, HOST_KEYBYTES);
+    init_encrypt(mod, key);
+    ctx = mod->priv;
+    memcpy(ctx->nonce, buf + HOST_KEYBYTES, crypto_aead_NPUBBYTES);
+    memcpy(ctx->previous_decrypted_nonce,
+           buf + HOST_KEYBYTES + crypto_aead_NPUBBYTES, crypto_aead_NPUBBYTES);
 
     return 0;
 }
 
 static int
-free_encrypt(void)
+free_encrypt(struct lfd_mod *mod)
 {
-    sodium_free(ctx.message);
-    sodium_free(ctx.ciphertext);
-    sodium_free(ctx.nonce);
-    sodium_free(ctx.previous_decrypted_nonce);
+    CryptoCtx *ctx = mod->priv;
+
+    if (ctx == NULL) {
+        return 0;
+    }
+    sodium_free(ctx->state);
+    sodium_free(ctx->message);
+    sodium_free(ctx->ciphertext);
+    sodium_free(ctx->nonce);
+    sodium_free(ctx->previous_decrypted_nonce);
+    sodium_free(ctx->key);
+    free(ctx);
+    mod->priv = NULL;
 
     return 0;
 }
 
 static int
-encrypt_buf(int message_len_, char *message_, char ** const ciphertext_p)
+encrypt_buf(struct lfd_mod *mod, int message_len_, char *message_, char ** const ciphertext_p)
 {
+    CryptoCtx           *ctx = mod->priv;
     const unsigned char *message = (const unsigned char *) message_;
     const size_t         message_len = (size_t) message_len_;
     unsigned long long   ciphertext_len;
@@ -108,22 +176,23 @@ encrypt_buf(int message_len_, char *message_, char ** const ciphertext_p)
     if (message_len_ < 0 || message_len > MESSAGE_MAX_SIZE) {
         return -1;
     }
-    crypto_aead_aes256gcm_encrypt_afternm(ctx.ciphertext, &ciphertext_len,
+    crypto_aead_aes256gcm_encrypt_afternm(ctx->ciphertext, &ciphertext_len,
                                           message, message_len,
                                           NULL, 0ULL,
-                                          NULL, ctx.nonce,
-                                          (const crypto_aead_aes256gcm_state *) ctx.state);
-    memcpy(ctx.ciphertext + message_len + crypto_aead_ABYTES,
-           ctx.nonce, crypto_aead_NPUBBYTES);
-    sodium_increment(ctx.nonce, crypto_aead_NPUBBYTES);
-    *ciphertext_p = (char *) ctx.ciphertext;
+                                          NULL, ctx->nonce,
+                                          (const crypto_aead_aes256gcm_state *) ctx->state);
+    memcpy(ctx->ciphertext + message_len + crypto_aead_ABYTES,
+           ctx->nonce, crypto_aead_NPUBBYTES);
+    sodium_increment(ctx->nonce, crypto_aead_NPUBBYTES);
+    *ciphertext_p = (char *) ctx->ciphertext;
 
     return (int) ciphertext_len + crypto_aead_NPUBBYTES;
 }
 
 static int
-decrypt_buf(int ciphertext_len_, char *ciphertext_, char ** const message_p)
+decrypt_buf(struct lfd_mod *mod, int ciphertext_len_, char *ciphertext_, char ** const message_p)
 {
+    CryptoCtx           *ctx = mod->priv;
     const unsigned char *ciphertext = (const unsigned char *) ciphertext_;
     const unsigned char *nonce;
     size_t               ciphertext_len = (size_t) ciphertext_len_;
@@ -135,15 +204,15 @@ decrypt_buf(int ciphertext_len_, char *ciphertext_, char ** const message_p)
     }
     ciphertext_len -= crypto_aead_NPUBBYTES;
     nonce = ciphertext + ciphertext_len;
-    if (sodium_compare(nonce, ctx.previous_decrypted_nonce, crypto_aead_NPUBBYTES) <= 0 ||
-        crypto_aead_aes256gcm_decrypt_afternm(ctx.message, &message_len, NULL,
+    if (sodium_compare(nonce, ctx->previous_decrypted_nonce, crypto_aead_NPUBBYTES) <= 0 ||
+        crypto_aead_aes256gcm_decrypt_afternm(ctx->message, &message_len, NULL,
                                               ciphertext, ciphertext_len,
                                               NULL, 0ULL, nonce,
-                                              (const crypto_aead_aes256gcm_state *) ctx.state) != 0) {
+                                              (const crypto_aead_aes256gcm_state *) ctx->state) != 0) {
         return -1;
     }
-    memcpy(ctx.previous_decrypted_nonce, nonce, crypto_aead_NPUBBYTES);
-    *message_p = (char *) ctx.message;
+    memcpy(ctx->previous_decrypted_nonce, nonce, crypto_aead_NPUBBYTES);
+    *message_p = (char *) ctx->message;
 
     return (int) message_len;
 }
@@ -157,13 +226,19 @@ struct lfd_mod lfd_encrypt = {
      NULL,
      free_encrypt,
      NULL,
+     NULL,
+     save_encrypt,
+     restore_encrypt,
+     NULL,
+     NULL,
+     NULL,
      NULL
 };
 
 #else  /* HAVE_SODIUM */
 
 static int
-no_encrypt(struct vtun_host *host)
+no_encrypt(struct lfd_mod *mod, struct vtun_host *host)
 {
      vtun_syslog(LOG_INFO, "Encryption is not supported");
      return -1;
@@ -171,7 +246,8 @@ no_encrypt(struct vtun_host *host)
 
 struct lfd_mod lfd_encrypt = {
      "Encryptor",
-     no_encrypt, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+     no_encrypt, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+     NULL, NULL, NULL
 };
 
 #endif
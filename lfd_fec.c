@@ -0,0 +1,381 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Forward error correction module.
+ *
+ * Frames are sent in groups of K. After the last frame of a group
+ * the encoder emits a parity frame, the XOR of all (length | payload)
+ * records of the group padded to the longest one. The decoder rebuilds
+ * a single lost frame of a group as soon as it has the parity and the
+ * K-1 other frames, in whatever order they arrive.
+ *
+ * Every frame carries the loss rate the sender measures on its receive
+ * side, so each end adapts K of its outgoing groups to the loss seen by
+ * the other end (unless a fixed group size is configured).
+ *
+ * Frame format:
+ *   type | group(2) | index | K | loss | payload
+ * where the parity frame has index K. Frames too long to be covered
+ * by a parity which fits VTUN_FRAME_SIZE go out unprotected:
+ *   FEC_PLAIN | payload
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "vtun.h"
+#include "linkfd.h"
+#include "lib.h"
+
+#define FEC_HDR		6
+#define FEC_MAX_K	32
+#define FEC_GROUPS	8	/* Groups the decoder is working on */
+
+/* Longest protected frame, the parity adds its length to it */
+#define FEC_MAX_LEN	(VTUN_FRAME_SIZE - FEC_HDR - 2)
+
+/* Frame types */
+#define FEC_DATA	0
+#define FEC_PARITY	1
+#define FEC_PLAIN	2
+
+struct fec_group {
+     int  valid;
+     unsigned short id;
+     int  k;
+     unsigned int have;		/* Bitmap of received frames */
+     int  count;
+     int  parity;		/* Parity frame received */
+     int  done;			/* Nothing left to recover */
+     int  par_len;
+     unsigned char *acc;	/* XOR of received records */
+     unsigned char *par;
+};
+
+static int fec_buf_size = VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD;
+
+struct fec_state {
+     int  fixed_k;
+
+     /* Encoder */
+     unsigned short enc_group;
+     int  enc_idx, enc_k, par_len, par_ready;
+     char *par_buf;
+
+     /* Decoder */
+     struct fec_group groups[FEC_GROUPS];
+     unsigned char *grp_buf;
+     unsigned char *rec_ptr;
+     int  rec_len;
+
+     /* Loss rates in 1/256 units */
+     int  loss, peer_loss;
+     unsigned long lost, recovered;
+};
+
+/* Word at a time, simple enough for the compiler to vectorize */
+static void fec_xor(unsigned char *dst, const unsigned char *src, int len)
+{
+     unsigned long a, b;
+
+     for(; len >= (int)sizeof(a); len -= sizeof(a)){
+	memcpy(&a, dst, sizeof(a));
+	memcpy(&b, src, sizeof(b));
+	a ^= b;
+	memcpy(dst, &a, sizeof(a));
+	dst += sizeof(a); src += sizeof(b);
+     }
+     while( len-- )
+	*dst++ ^= *src++;
+}
+
+/* Group size for the loss seen by the other end */
+static int fec_group_size(struct fec_state *f)
+{
+     if( f->fixed_k )
+	return f->fixed_k;
+
+     if( f->peer_loss < 2 )	/* < 1% */
+	return 32;
+     if( f->peer_loss < 6 )	/* < 2.5% */
+	return 16;
+     if( f->peer_loss < 13 )	/* < 5% */
+	return 8;
+     if( f->peer_loss < 26 )	/* < 10% */
+	return 4;
+     return 2;
+}
+
+static int alloc_fec(struct lfd_mod *mod, struct vtun_host *host)
+{
+     struct fec_state *f;
+     int i;
+
+     if( !(f = mod->priv = calloc(1, sizeof(struct fec_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate FEC buffers");
+	return 1;
+     }
+
+     f->fixed_k = host->fec;
+     if( f->fixed_k ){
+	if( f->fixed_k < 2 )
+	   f->fixed_k = 2;
+	if( f->fixed_k > FEC_MAX_K )
+	   f->fixed_k = FEC_MAX_K;
+     }
+
+     if( !(f->par_buf = lfd_alloc(fec_buf_size + FEC_HDR)) ||
+	 !(f->grp_buf = lfd_alloc(FEC_GROUPS * 2 * fec_buf_size)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate FEC buffers");
+	return 1;
+     }
+     for(i = 0; i < FEC_GROUPS; i++){
+	f->groups[i].acc = f->grp_buf + 2 * i * fec_buf_size;
+	f->groups[i].par = f->groups[i].acc + fec_buf_size;
+     }
+
+     if( f->fixed_k )
+	vtun_syslog(LOG_INFO, "FEC[group %d] initialized", f->fixed_k);
+     else
+	vtun_syslog(LOG_INFO, "FEC[adaptive] initialized");
+     return 0;
+}
+
+static int free_fec(struct lfd_mod *mod)
+{
+     struct fec_state *f = mod->priv;
+
+     if( !f )
+	return 0;
+
+     if( f->lost )
+	vtun_syslog(LOG_INFO, "FEC recovered %lu of %lu lost frames",
+		    f->recovered, f->lost);
+
+     if( f->par_buf )
+	lfd_free(f->par_buf);
+     if( f->grp_buf )
+	lfd_free(f->grp_buf);
+     free(f); mod->priv = NULL;
+     return 0;
+}
+
+static void fec_put_hdr(struct fec_state *f, unsigned char *p, int type, int idx, int k)
+{
+     p[0] = type;
+     p[1] = f->enc_group >> 8; p[2] = f->enc_group;
+     p[3] = idx;
+     p[4] = k;
+     p[5] = f->loss;
+}
+
+static int encode_fec(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct fec_state *f = mod->priv;
+     unsigned char *par = (unsigned char *) f->par_buf + FEC_HDR;
+     unsigned char *hdr = (unsigned char *) in - FEC_HDR;
+     unsigned char l[2];
+
+     if( len > FEC_MAX_LEN ){
+	/* Encryption takes up to VTUN_FRAME_SIZE, drop what doesn't fit */
+	if( len + 1 > VTUN_FRAME_SIZE )
+	   return 0;
+	hdr = (unsigned char *) in - 1;
+	hdr[0] = FEC_PLAIN;
+	*out = (char *) hdr;
+	return len + 1;
+     }
+
+     if( !f->enc_idx ){
+	f->enc_k = fec_group_size(f);
+	memset(par, 0, fec_buf_size);
+	f->par_len = 0;
+     }
+
+     /* Header goes into the reserved space in front of the frame */
+     fec_put_hdr(f, hdr, FEC_DATA, f->enc_idx, f->enc_k);
+
+     l[0] = len >> 8; l[1] = len;
+     fec_xor(par, l, 2);
+     fec_xor(par + 2, (unsigned char *) in, len);
+     if( len + 2 > f->par_len )
+	f->par_len = len + 2;
+
+     if( ++f->enc_idx == f->enc_k ){
+	fec_put_hdr(f, (unsigned char *) f->par_buf, FEC_PARITY, f->enc_k, f->enc_k);
+	f->par_ready = 1;
+	f->enc_group++;
+	f->enc_idx = 0;
+     }
+
+     *out = (char *) hdr;
+     return len + FEC_HDR;
+}
+
+static int pending_encode_fec(struct lfd_mod *mod, char **out)
+{
+     struct fec_state *f = mod->priv;
+
+     if( !f->par_ready )
+	return 0;
+     f->par_ready = 0;
+
+     *out = f->par_buf;
+     return f->par_len + FEC_HDR;
+}
+
+/* Group is going away, account its losses */
+static void fec_close_group(struct fec_state *f, struct fec_group *g)
+{
+     int lost;
+
+     if( !g->valid )
+	return;
+
+     lost = g->k - g->count;
+     f->lost += lost;
+     f->loss = (f->loss * 7 + lost * 255 / g->k) / 8;
+}
+
+static void fec_recover(struct fec_state *f, struct fec_group *g)
+{
+     int n;
+
+     g->done = 1;
+     /* Late copy of the rebuilt frame must be dropped */
+     g->have = (g->k < 32 ? (1U << g->k) : 0U) - 1;
+     fec_xor(g->par, g->acc, g->par_len);
+
+     n = (g->par[0] << 8) | g->par[1];
+     if( !n || n + 2 > g->par_len )
+	return;
+
+     f->rec_ptr = g->par + 2;
+     f->rec_len = n;
+     f->recovered++;
+}
+
+static int decode_fec(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct fec_state *f = mod->priv;
+     unsigned char *p = (unsigned char *) in, l[2];
+     struct fec_group *g;
+     unsigned short id;
+     int idx, k;
+
+     if( len >= 1 && p[0] == FEC_PLAIN ){
+	*out = in + 1;
+	return len - 1;
+     }
+     if( len < FEC_HDR )
+	return -1;
+
+     id  = (p[1] << 8) | p[2];
+     idx = p[3];
+     k   = p[4];
+     f->peer_loss = p[5];
+     len -= FEC_HDR;
+
+     if( k < 1 || k > FEC_MAX_K || idx > k || len + 2 > fec_buf_size )
+	return -1;
+
+     g = &f->groups[id % FEC_GROUPS];
+     if( g->valid && (short)(id - g->id) < 0 ){
+	/* Late frame of a group gone already, the slot is taken by a
+	 * newer one. It may have been rebuilt, so it is dropped. */
+	return 0;
+     }
+     if( !g->valid || g->id != id ){
+	fec_close_group(f, g);
+	g->valid = 1;
+	g->id = id;
+	g->k = k;
+	g->have = 0;
+	g->count = g->parity = g->done = 0;
+	g->par_len = 0;
+	memset(g->acc, 0, fec_buf_size);
+     }
+     if( g->k != k )
+	return 0;
+
+     switch( p[0] ){
+	case FEC_DATA:
+	   if( idx == k || (g->have & (1U << idx)) )
+	      return 0;
+	   g->have |= 1U << idx;
+	   g->count++;
+
+	   l[0] = len >> 8; l[1] = len;
+	   fec_xor(g->acc, l, 2);
+	   fec_xor(g->acc + 2, p + FEC_HDR, len);
+
+	   if( g->parity && !g->done && g->count == k - 1 )
+	      fec_recover(f, g);
+
+	   *out = in + FEC_HDR;
+	   return len;
+
+	case FEC_PARITY:
+	   if( g->parity )
+	      return 0;
+	   g->parity = 1;
+	   g->par_len = len;
+	   memcpy(g->par, p + FEC_HDR, len);
+
+	   if( g->count == k )
+	      g->done = 1;
+	   else if( g->count == k - 1 )
+	      fec_recover(f, g);
+	   return 0;
+     }
+     return -1;
+}
+
+static int pending_decode_fec(struct lfd_mod *mod, char **out)
+{
+     struct fec_state *f = mod->priv;
+     int n = f->rec_len;
+
+     f->rec_len = 0;
+     *out = (char *) f->rec_ptr;
+     return n;
+}
+
+struct lfd_mod lfd_fec = {
+     "FEC",
+     alloc_fec,
+     encode_fec,
+     NULL,
+     decode_fec,
+     NULL,
+     free_fec,
+     pending_encode_fec,
+     pending_decode_fec,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL
+};
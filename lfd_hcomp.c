@@ -0,0 +1,487 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * IP/TCP/UDP header compression module.
+ *
+ * Works on raw IPv4 packets (tun tunnels only). Every flow
+ * (addresses, protocol and ports) gets a context on both ends.
+ * The first packet of a flow is sent in full and becomes the
+ * reference header of the context. Following packets only carry
+ * the fields which differ from the reference, numeric fields are
+ * sent as deltas from the reference (not from the previous packet),
+ * so losing a compressed packet never desynchronizes the decoder.
+ *
+ * Every full header bumps the context generation. Compressed packets
+ * carry the generation they were built against and are dropped if the
+ * decoder does not have it (the full header was lost). The encoder
+ * refreshes the reference periodically, which bounds the damage.
+ *
+ * Frame formats (first byte is the frame type):
+ *   HC_RAW:  type | packet
+ *   HC_FULL: type | cid | gen | packet
+ *   HC_COMP: type | cid | gen | mask | fields... | payload
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#include "vtun.h"
+#include "linkfd.h"
+#include "lib.h"
+
+#define HC_MAX_CTX	16	/* Contexts per direction */
+#define HC_MAX_HDR	80	/* IP(20) + TCP with options(60) */
+#define HC_REFRESH_TCP	256	/* Packets between full headers, reliable link */
+#define HC_REFRESH_UDP	16	/* Packets between full headers, lossy link */
+#define HC_MAX_DELTA	0x1fffff /* Larger deltas force a full header */
+
+/* Frame types */
+#define HC_RAW		0
+#define HC_FULL		1
+#define HC_COMP		2
+
+/* Mask bits of the compressed header */
+#define HC_M_TOS	0x01
+#define HC_M_TTL	0x02
+#define HC_M_ID		0x04
+#define HC_M_SEQ	0x08
+#define HC_M_ACK	0x10
+#define HC_M_WIN	0x20
+#define HC_M_URG	0x40
+#define HC_M_OPT	0x80
+
+struct hc_ctx {
+     int  valid;
+     unsigned char gen;
+     unsigned int  count;	/* Packets since the last full header */
+     unsigned long used;	/* LRU stamp (encoder only) */
+     int  hlen;			/* IP + L4 header length */
+     unsigned char hdr[HC_MAX_HDR];
+};
+
+struct hc_state {
+     struct hc_ctx enc_ctx[HC_MAX_CTX], dec_ctx[HC_MAX_CTX];
+     unsigned long hc_clock;
+     unsigned int hc_refresh;
+     char *enc_buf, *dec_buf;
+};
+
+static int hc_buf_size = VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD;
+
+static inline unsigned int get16(const unsigned char *p)
+{
+     return (p[0] << 8) | p[1];
+}
+
+static inline unsigned long get32(const unsigned char *p)
+{
+     return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+	    ((unsigned long)p[2] << 8) | p[3];
+}
+
+static inline void put16(unsigned char *p, unsigned int v)
+{
+     p[0] = v >> 8; p[1] = v;
+}
+
+static inline void put32(unsigned char *p, unsigned long v)
+{
+     p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/* LEB128 style variable length integers, at most 5 bytes */
+static inline int put_var(unsigned char *p, unsigned long v)
+{
+     int n = 0;
+
+     v &= 0xffffffffUL;
+     while( v > 0x7f ){
+	p[n++] = (v & 0x7f) | 0x80;
+	v >>= 7;
+     }
+     p[n++] = v;
+     return n;
+}
+
+static inline int get_var(const unsigned char *p, int len, unsigned long *v)
+{
+     int n = 0, shift = 0;
+
+     *v = 0;
+     while( n < len && n < 5 ){
+	*v |= (unsigned long)(p[n] & 0x7f) << shift;
+	if( !(p[n++] & 0x80) ){
+	   *v &= 0xffffffffUL;
+	   return n;
+	}
+	shift += 7;
+     }
+     return -1;
+}
+
+static unsigned int ip_csum(const unsigned char *hdr, int len)
+{
+     unsigned long sum = 0;
+     int i;
+
+     for(i = 0; i < len; i += 2)
+	sum += get16(hdr + i);
+     while( sum >> 16 )
+	sum = (sum & 0xffff) + (sum >> 16);
+     return ~sum & 0xffff;
+}
+
+/*
+ * Check if the packet can be compressed.
+ * Returns length of the IP + L4 headers or 0.
+ */
+static int hc_parse(const unsigned char *pkt, int len)
+{
+     int l4len;
+
+     if( len < 20 || (pkt[0] != 0x45) )
+	return 0;	/* Not IPv4 or has IP options */
+     if( get16(pkt + 2) != len )
+	return 0;
+     if( get16(pkt + 6) & 0x3fff )
+	return 0;	/* Fragment */
+
+     switch( pkt[9] ){
+	case IPPROTO_TCP:
+	   if( len < 40 )
+	      return 0;
+	   l4len = (pkt[32] >> 4) * 4;
+	   if( l4len < 20 || 20 + l4len > len || 20 + l4len > HC_MAX_HDR )
+	      return 0;
+	   return 20 + l4len;
+
+	case IPPROTO_UDP:
+	   if( len < 28 || get16(pkt + 24) != len - 20 )
+	      return 0;
+	   return 28;
+     }
+     return 0;
+}
+
+/* Same flow: addresses, protocol and ports */
+static inline int hc_same_flow(const unsigned char *a, const unsigned char *b)
+{
+     return a[9] == b[9] && !memcmp(a + 12, b + 12, 12);
+}
+
+static struct hc_ctx * hc_enc_lookup(struct hc_state *hs, const unsigned char *pkt, int *fresh)
+{
+     struct hc_ctx *c, *lru = hs->enc_ctx;
+     int i;
+
+     for(i = 0; i < HC_MAX_CTX; i++){
+	c = &hs->enc_ctx[i];
+	if( c->valid && hc_same_flow(c->hdr, pkt) ){
+	   *fresh = 0;
+	   return c;
+	}
+	if( !c->valid || (lru->valid && c->used < lru->used) )
+	   lru = c;
+     }
+     /* Reuse least recently used context */
+     lru->valid = 0;
+     *fresh = 1;
+     return lru;
+}
+
+static int alloc_hcomp(struct lfd_mod *mod, struct vtun_host *host)
+{
+     struct hc_state *hs;
+
+     if( !(hs = mod->priv = calloc(1, sizeof(struct hc_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate header compressor state");
+	return 1;
+     }
+
+     hs->hc_refresh = (host->flags & VTUN_UDP) ? HC_REFRESH_UDP : HC_REFRESH_TCP;
+
+     if( !(hs->enc_buf = lfd_alloc(hc_buf_size)) ||
+	 !(hs->dec_buf = lfd_alloc(hc_buf_size)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate buffer for the header compressor");
+	return 1;
+     }
+
+     vtun_syslog(LOG_INFO, "Header compression initialized");
+     return 0;
+}
+
+static int free_hcomp(struct lfd_mod *mod)
+{
+     struct hc_state *hs = mod->priv;
+
+     if( !hs )
+	return 0;
+
+     if( hs->enc_buf )
+	lfd_free(hs->enc_buf);
+     if( hs->dec_buf )
+	lfd_free(hs->dec_buf);
+     free(hs); mod->priv = NULL;
+     return 0;
+}
+
+/* Build compressed header. Returns header length or 0 if a full header is needed. */
+static int hc_comp_hdr(struct hc_state *hs, struct hc_ctx *c,
+		       const unsigned char *pkt, int hlen, unsigned char *out)
+{
+     const unsigned char *ref = c->hdr;
+     unsigned char *p = out + 4, mask = 0;
+     unsigned long d;
+
+     /* Fields which must never change within the context */
+     if( hlen != c->hlen || (pkt[6] & 0x40) != (ref[6] & 0x40) )
+	return 0;
+
+     if( pkt[1] != ref[1] ){
+	mask |= HC_M_TOS;
+	*p++ = pkt[1];
+     }
+     if( pkt[8] != ref[8] ){
+	mask |= HC_M_TTL;
+	*p++ = pkt[8];
+     }
+     if( (d = (get16(pkt + 4) - get16(ref + 4)) & 0xffff) ){
+	mask |= HC_M_ID;
+	p += put_var(p, d);
+     }
+
+     if( pkt[9] == IPPROTO_TCP ){
+	*p++ = pkt[33];		/* TCP flags */
+
+	if( (d = (get32(pkt + 24) - get32(ref + 24)) & 0xffffffffUL) ){
+	   if( d > HC_MAX_DELTA )
+	      return 0;
+	   mask |= HC_M_SEQ;
+	   p += put_var(p, d);
+	}
+	if( (d = (get32(pkt + 28) - get32(ref + 28)) & 0xffffffffUL) ){
+	   if( d > HC_MAX_DELTA )
+	      return 0;
+	   mask |= HC_M_ACK;
+	   p += put_var(p, d);
+	}
+	if( get16(pkt + 34) != get16(ref + 34) ){
+	   mask |= HC_M_WIN;
+	   memcpy(p, pkt + 34, 2); p += 2;
+	}
+	memcpy(p, pkt + 36, 2); p += 2;		/* Checksum */
+	if( get16(pkt + 38) != get16(ref + 38) ){
+	   mask |= HC_M_URG;
+	   memcpy(p, pkt + 38, 2); p += 2;
+	}
+	if( hlen > 40 && memcmp(pkt + 40, ref + 40, hlen - 40) ){
+	   mask |= HC_M_OPT;
+	   memcpy(p, pkt + 40, hlen - 40); p += hlen - 40;
+	}
+     } else {
+	memcpy(p, pkt + 26, 2); p += 2;		/* Checksum */
+     }
+
+     out[0] = HC_COMP;
+     out[1] = c - hs->enc_ctx;
+     out[2] = c->gen;
+     out[3] = mask;
+     return p - out;
+}
+
+static int comp_hcomp(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct hc_state *hs = mod->priv;
+     unsigned char *pkt = (unsigned char *) in;
+     unsigned char *buf = (unsigned char *) hs->enc_buf;
+     struct hc_ctx *c;
+     int hlen, clen, fresh;
+
+     if( !(hlen = hc_parse(pkt, len)) ){
+	buf[0] = HC_RAW;
+	memcpy(buf + 1, in, len);
+	*out = hs->enc_buf;
+	return len + 1;
+     }
+
+     c = hc_enc_lookup(hs, pkt, &fresh);
+     c->used = ++hs->hc_clock;
+
+     if( !fresh && c->count < hs->hc_refresh &&
+	 (clen = hc_comp_hdr(hs, c, pkt, hlen, buf)) ){
+	c->count++;
+	memcpy(buf + clen, in + hlen, len - hlen);
+	*out = hs->enc_buf;
+	return clen + len - hlen;
+     }
+
+     /* Send full header and make it the new reference */
+     c->valid = 1;
+     c->gen++;
+     c->count = 0;
+     c->hlen = hlen;
+     memcpy(c->hdr, pkt, hlen);
+
+     buf[0] = HC_FULL;
+     buf[1] = c - hs->enc_ctx;
+     buf[2] = c->gen;
+     memcpy(buf + 3, in, len);
+     *out = hs->enc_buf;
+     return len + 3;
+}
+
+static int decomp_hcomp(struct lfd_mod *mod, int len, char *in, char **out)
+{
+     struct hc_state *hs = mod->priv;
+     unsigned char *p = (unsigned char *) in, *end = p + len;
+     unsigned char *pkt = (unsigned char *) hs->dec_buf;
+     unsigned char mask;
+     unsigned long d;
+     struct hc_ctx *c;
+     int hlen, n;
+
+     if( len < 1 )
+	return -1;
+
+     switch( p[0] ){
+	case HC_RAW:
+	   *out = in + 1;
+	   return len - 1;
+
+	case HC_FULL:
+	   if( len < 3 || p[1] >= HC_MAX_CTX ||
+	       !(hlen = hc_parse(p + 3, len - 3)) || hlen > HC_MAX_HDR )
+	      return -1;
+	   c = &hs->dec_ctx[p[1]];
+	   c->valid = 1;
+	   c->gen = p[2];
+	   c->hlen = hlen;
+	   memcpy(c->hdr, p + 3, hlen);
+	   *out = in + 3;
+	   return len - 3;
+
+	case HC_COMP:
+	   break;
+
+	default:
+	   return -1;
+     }
+
+     if( len < 4 || p[1] >= HC_MAX_CTX )
+	return -1;
+     c = &hs->dec_ctx[p[1]];
+     if( !c->valid || c->gen != p[2] ){
+	/* Reference header was lost, wait for the next full header */
+	return 0;
+     }
+     mask = p[3];
+     p += 4;
+
+     hlen = c->hlen;
+     memcpy(pkt, c->hdr, hlen);
+
+     if( mask & HC_M_TOS ){
+	if( p >= end ) return -1;
+	pkt[1] = *p++;
+     }
+     if( mask & HC_M_TTL ){
+	if( p >= end ) return -1;
+	pkt[8] = *p++;
+     }
+     if( mask & HC_M_ID ){
+	if( (n = get_var(p, end - p, &d)) < 0 ) return -1;
+	put16(pkt + 4, get16(pkt + 4) + d);
+	p += n;
+     }
+
+     if( pkt[9] == IPPROTO_TCP ){
+	if( p >= end ) return -1;
+	pkt[33] = *p++;
+
+	if( mask & HC_M_SEQ ){
+	   if( (n = get_var(p, end - p, &d)) < 0 ) return -1;
+	   put32(pkt + 24, get32(pkt + 24) + d);
+	   p += n;
+	}
+	if( mask & HC_M_ACK ){
+	   if( (n = get_var(p, end - p, &d)) < 0 ) return -1;
+	   put32(pkt + 28, get32(pkt + 28) + d);
+	   p += n;
+	}
+	if( mask & HC_M_WIN ){
+	   if( end - p < 2 ) return -1;
+	   memcpy(pkt + 34, p, 2); p += 2;
+	}
+	if( end - p < 2 ) return -1;
+	memcpy(pkt + 36, p, 2); p += 2;
+	if( mask & HC_M_URG ){
+	   if( end - p < 2 ) return -1;
+	   memcpy(pkt + 38, p, 2); p += 2;
+	}
+	if( mask & HC_M_OPT ){
+	   if( end - p < hlen - 40 ) return -1;
+	   memcpy(pkt + 40, p, hlen - 40); p += hlen - 40;
+	}
+     } else {
+	if( end - p < 2 ) return -1;
+	memcpy(pkt + 26, p, 2); p += 2;
+     }
+
+     n = end - p;
+     if( hlen + n > hc_buf_size )
+	return -1;
+     memcpy(pkt + hlen, p, n);
+
+     /* Lengths and IP checksum are implied */
+     put16(pkt + 2, hlen + n);
+     if( pkt[9] == IPPROTO_UDP )
+	put16(pkt + 24, hlen - 20 + n);
+     put16(pkt + 10, 0);
+     put16(pkt + 10, ip_csum(pkt, 20));
+
+     *out = hs->dec_buf;
+     return hlen + n;
+}
+
+struct lfd_mod lfd_hcomp = {
+     "HCOMP",
+     alloc_hcomp,
+     comp_hcomp,
+     NULL,
+     decomp_hcomp,
+     NULL,
+     free_hcomp,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL
+};
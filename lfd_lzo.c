@@ -39,31 +39,41 @@
 #include "lzo1x.h"
 #include "lzoutil.h"
 
-static lzo_byte *zbuf;
-static lzo_voidp wmem;
 static int zbuf_size = VTUN_FRAME_SIZE * VTUN_FRAME_SIZE / 64 + 16 + 3;
 
-/* Pointer to compress function */
-static int (*lzo1x_compress)(const lzo_byte *src, lzo_uint  src_len,
-		   	    lzo_byte *dst, lzo_uint *dst_len,
-		   	    lzo_voidp wrkmem);
+struct lzo_state {
+     lzo_byte *zbuf;
+     lzo_voidp wmem;
+
+     /* Pointer to compress function */
+     int (*lzo1x_compress)(const lzo_byte *src, lzo_uint  src_len,
+			   lzo_byte *dst, lzo_uint *dst_len,
+			   lzo_voidp wrkmem);
+};
+
 /* 
  * Initialize compressor/decompressor.
  * Allocate the buffers.
  */  
 
-static int alloc_lzo(struct vtun_host *host)
+static int alloc_lzo(struct lfd_mod *mod, struct vtun_host *host)
 {
      int zlevel = host->zlevel ? host->zlevel : 1;
+     struct lzo_state *z;
      lzo_uint mem;
 
+     if( !(z = mod->priv = calloc(1, sizeof(struct lzo_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate compressor state");
+	return 1;
+     }
+
      switch( zlevel ){
 	case 9:
-	   lzo1x_compress = lzo1x_999_compress;
+	   z->lzo1x_compress = lzo1x_999_compress;
            mem = LZO1X_999_MEM_COMPRESS;
            break;
 	default: 	   
- 	   lzo1x_compress = lzo1x_1_15_compress;
+ 	   z->lzo1x_compress = lzo1x_1_15_compress;
            mem = LZO1X_1_15_MEM_COMPRESS;
            break;
      }
@@ -72,11 +82,11 @@ static int alloc_lzo(struct vtun_host *host)
 	vtun_syslog(LOG_ERR,"Can't initialize compressor");
 	return 1;
      }	
-     if( !(zbuf = lfd_alloc(zbuf_size)) ){
+     if( !(z->zbuf = lfd_alloc(zbuf_size)) ){
 	vtun_syslog(LOG_ERR,"Can't allocate buffer for the compressor");
 	return 1;
      }	
-     if( !(wmem = lzo_malloc(mem)) ){
+     if( !(z->wmem = lzo_malloc(mem)) ){
 	vtun_syslog(LOG_ERR,"Can't allocate buffer for the compressor");
 	return 1;
      }	
@@ -91,10 +101,17 @@ static int alloc_lzo(struct vtun_host *host)
  * Free the buffer.
  */  
 
-static int free_lzo()
+static int free_lzo(struct lfd_mod *mod)
 {
-     lfd_free(zbuf); zbuf = NULL;
-     lzo_free(wmem); wmem = NULL;
+     struct lzo_state *z = mod->priv;
+
+     if( !z )
+	return 0;
+
+     if( z->zbuf )
+	lfd_free(z->zbuf);
+     lzo_free(z->wmem);
+     free(z); mod->priv = NULL;
      return 0;
 }
 
@@ -102,34 +119,42 @@ static int free_lzo()
  * This functions _MUST_ consume all incoming bytes in one pass,
  * that's why we expand buffer dynamicly.
  */  
-static int comp_lzo(int len, char *in, char **out)
+static int comp_lzo(struct lfd_mod *mod, int len, char *in, char **out)
 { 
+     struct lzo_state *z = mod->priv;
      lzo_uint zlen = 0;    
      int err;
      
-     if( (err=lzo1x_compress((void *)in,len,zbuf,&zlen,wmem)) != LZO_E_OK ){
+     if( (err=z->lzo1x_compress((void *)in,len,z->zbuf,&zlen,z->wmem)) != LZO_E_OK ){
         vtun_syslog(LOG_ERR,"Compress error %d",err);
         return -1;
      }
 
-     *out = (void *)zbuf;
+     *out = (void *)z->zbuf;
      return zlen;
 }
 
-static int decomp_lzo(int len, char *in, char **out)
+static int decomp_lzo(struct lfd_mod *mod, int len, char *in, char **out)
 {
+     struct lzo_state *z = mod->priv;
      lzo_uint zlen = 0;
      int err;
 
-     if( (err=lzo1x_decompress((void *)in,len,zbuf,&zlen,wmem)) != LZO_E_OK ){
+     if( (err=lzo1x_decompress((void *)in,len,z->zbuf,&zlen,z->wmem)) != LZO_E_OK ){
         vtun_syslog(LOG_ERR,"Decompress error %d",err);
         return -1;
      }
 
-     *out = (void *) zbuf;
+     *out = (void *) z->zbuf;
      return zlen;
 }
 
+/* Frames are compressed one by one, nothing to hand off */
+static int save_lzo(struct lfd_mod *mod, char *buf, int size)
+{
+     return 0;
+}
+
 struct lfd_mod lfd_lzo = {
      "LZO",
      alloc_lzo,
@@ -139,12 +164,18 @@ struct lfd_mod lfd_lzo = {
      NULL,
      free_lzo,
      NULL,
+     NULL,
+     save_lzo,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
      NULL
 };
 
 #else  /* HAVE_LZO */
 
-static int no_lzo(struct vtun_host *host)
+static int no_lzo(struct lfd_mod *mod, struct vtun_host *host)
 {
      vtun_syslog(LOG_INFO, "LZO compression is not supported");
      return -1;
@@ -152,7 +183,8 @@ static int no_lzo(struct vtun_host *host)
 
 struct lfd_mod lfd_lzo = {
      "LZO",
-     no_lzo, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+     no_lzo, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+     NULL, NULL, NULL
 };
 
 #endif /* HAVE_LZO */
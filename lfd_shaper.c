@@ -38,31 +38,48 @@
 
 #ifdef HAVE_SHAPER 
 
-static unsigned long bytes, max_speed;
-static struct timeval curr_time, last_time;
+struct shaper_state {
+     unsigned long bytes, max_speed;
+     struct timeval curr_time, last_time;
+};
 
 /* 
  * Initialization function.
  */
-static int shaper_init(struct vtun_host *host)
+static int shaper_init(struct lfd_mod *mod, struct vtun_host *host)
 {
+     struct shaper_state *sh;
+
+     if( !(sh = mod->priv = calloc(1, sizeof(struct shaper_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate shaper state");
+	return 1;
+     }
+
      /* Calculate max speed bytes/sec */
-     max_speed = host->spd_out / 8 * 1024;
+     sh->max_speed = host->spd_out / 8 * 1024;
    
      /* Compensation for delays, nanosleep and so on */ 
-     max_speed += 400;
+     sh->max_speed += 400;
 
-     bytes = 0;
+     sh->bytes = 0;
      
      vtun_syslog(LOG_INFO,"Traffic shaping(speed %dK) initialized.", host->spd_out);	
      return 0;
 }
 
+static int shaper_free(struct lfd_mod *mod)
+{
+     free(mod->priv); mod->priv = NULL;
+     return 0;
+}
+
 /* Shaper counter */
-static int shaper_counter(int len, char *in, char **out)
+static int shaper_counter(struct lfd_mod *mod, int len, char *in, char **out)
 { 
+     struct shaper_state *sh = mod->priv;
+
      /* Just count incoming bytes */
-     bytes += len;
+     sh->bytes += len;
 
      *out = in;
      return len;
@@ -94,21 +111,22 @@ static unsigned long inline tv2ms(struct timeval tv)
  * higher than maximal speed stop accepting input 
  * until the speed become lower or equal to maximal.
  */
-static int shaper_avail(void)
+static int shaper_avail(struct lfd_mod *mod)
 { 
-     static struct timeval tv;
+     struct shaper_state *sh = mod->priv;
+     struct timeval tv;
      register unsigned long speed;
 
      /* Let me know if you have faster and better time source. */
-     gettimeofday(&curr_time,NULL);
+     gettimeofday(&sh->curr_time,NULL);
 
-     timersub(&curr_time,&last_time,&tv);
+     timersub(&sh->curr_time,&sh->last_time,&tv);
 
      /* Calculate current speed bytes/sec. 
       * (tv2ms never returns 0) */ 	
-     speed = bytes * 1000 / tv2ms(tv); 
+     speed = sh->bytes * 1000 / tv2ms(tv); 
 	
-     if( speed > max_speed ){
+     if( speed > sh->max_speed ){
 	/* 
 	 * Sleep about 1 microsec(actual sleep might be longer). 
 	 * This is actually the hack to reduce CPU usage. 
@@ -121,15 +139,31 @@ static int shaper_avail(void)
 	return 0;
      }
 
-     if( curr_time.tv_sec > last_time.tv_sec ){
-        last_time = curr_time;
-        bytes = 0;
+     if( sh->curr_time.tv_sec > sh->last_time.tv_sec ){
+        sh->last_time = sh->curr_time;
+        sh->bytes = 0;
      }
 
      /* Accept input */
      return  1;
 }
 
+/* New speed from the reloaded config */
+static int shaper_update(struct lfd_mod *mod, struct vtun_host *host)
+{
+     struct shaper_state *sh = mod->priv;
+
+     sh->max_speed = host->spd_out / 8 * 1024 + 400;
+     vtun_syslog(LOG_INFO,"Traffic shaping speed changed to %dK", host->spd_out);
+     return 0;
+}
+
+/* Speed is measured again after the handoff */
+static int shaper_save(struct lfd_mod *mod, char *buf, int size)
+{
+     return 0;
+}
+
 struct lfd_mod lfd_shaper = {
      "Shaper",
      shaper_init,
@@ -137,6 +171,12 @@ struct lfd_mod lfd_shaper = {
      shaper_avail,
      NULL,
      NULL,
+     shaper_free,
+     NULL,
+     NULL,
+     shaper_save,
+     NULL,
+     shaper_update,
      NULL,
      NULL,
      NULL
@@ -144,7 +184,7 @@ struct lfd_mod lfd_shaper = {
 
 #else  /* HAVE_SHAPER */
 
-static int no_shaper(struct vtun_host *host)
+static int no_shaper(struct lfd_mod *mod, struct vtun_host *host)
 {
      vtun_syslog(LOG_INFO, "Traffic shaping is not supported");
      return -1;
@@ -152,7 +192,8 @@ static int no_shaper(struct vtun_host *host)
 
 struct lfd_mod lfd_shaper = {
      "Shaper",
-     no_shaper, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+     no_shaper, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+     NULL, NULL, NULL
 };
 
 #endif /* HAVE_SHAPER */
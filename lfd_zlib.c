@@ -37,34 +37,43 @@
 
 #include <zlib.h>
 
-static z_stream zi, zd; 
-static unsigned char *zbuf;
-static int zbuf_size = VTUN_FRAME_SIZE + 200;
+struct zlib_state {
+     z_stream zi, zd;
+     unsigned char *zbuf;
+     int zbuf_size;
+};
 
 /* 
  * Initialize compressor/decompressor.
  * Allocate the buffer.
  */  
-static int zlib_alloc(struct vtun_host *host)
+static int zlib_alloc(struct lfd_mod *mod, struct vtun_host *host)
 {
      int zlevel = host->zlevel ? host->zlevel : 1;
+     struct zlib_state *z;
 
-     zd.zalloc = (alloc_func)0;
-     zd.zfree  = (free_func)0;
-     zd.opaque = (voidpf)0;
-     zi.zalloc = (alloc_func)0;
-     zi.zfree  = (free_func)0;
-     zi.opaque = (voidpf)0;
+     if( !(z = mod->priv = calloc(1, sizeof(struct zlib_state))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate compressor state");
+	return 1;
+     }
+     z->zbuf_size = VTUN_FRAME_SIZE + 200;
+
+     z->zd.zalloc = (alloc_func)0;
+     z->zd.zfree  = (free_func)0;
+     z->zd.opaque = (voidpf)0;
+     z->zi.zalloc = (alloc_func)0;
+     z->zi.zfree  = (free_func)0;
+     z->zi.opaque = (voidpf)0;
     
-     if( deflateInit(&zd, zlevel ) != Z_OK ){
+     if( deflateInit(&z->zd, zlevel ) != Z_OK ){
 	vtun_syslog(LOG_ERR,"Can't initialize compressor");
 	return 1;
      }	
-     if( inflateInit(&zi) != Z_OK ){
+     if( inflateInit(&z->zi) != Z_OK ){
 	vtun_syslog(LOG_ERR,"Can't initialize decompressor");
 	return 1;
      }	
-     if( !(zbuf = (void *) lfd_alloc(zbuf_size)) ){
+     if( !(z->zbuf = (void *) lfd_alloc(z->zbuf_size)) ){
 	vtun_syslog(LOG_ERR,"Can't allocate buffer for the compressor");
 	return 1;
      }
@@ -78,23 +87,30 @@ static int zlib_alloc(struct vtun_host *host)
  * Free the buffer.
  */  
 
-static int zlib_free()
+static int zlib_free(struct lfd_mod *mod)
 {
-     deflateEnd(&zd);
-     inflateEnd(&zi);
+     struct zlib_state *z = mod->priv;
 
-     lfd_free(zbuf); zbuf = NULL;
+     if( !z )
+	return 0;
+
+     deflateEnd(&z->zd);
+     inflateEnd(&z->zi);
+
+     if( z->zbuf )
+	lfd_free(z->zbuf);
+     free(z); mod->priv = NULL;
 
      return 0;
 }
 
-static int expand_zbuf(z_stream *zs, int len)
+static int expand_zbuf(struct zlib_state *z, z_stream *zs, int len)
 {
-     if( !(zbuf = lfd_realloc(zbuf,zbuf_size+len)) )
+     if( !(z->zbuf = lfd_realloc(z->zbuf,z->zbuf_size+len)) )
          return -1;
-     zs->next_out = zbuf + zbuf_size;
+     zs->next_out = z->zbuf + z->zbuf_size;
      zs->avail_out = len;
-     zbuf_size += len;     
+     z->zbuf_size += len;     
 
      return 0;
 }
@@ -104,60 +120,62 @@ static int expand_zbuf(z_stream *zs, int len)
  * That's why we expand buffer dynamically.
  * Practice shows that buffer will not grow larger that 16K.
  */  
-static int zlib_comp(int len, char *in, char **out)
+static int zlib_comp(struct lfd_mod *mod, int len, char *in, char **out)
 { 
+     struct zlib_state *z = mod->priv;
      int oavail, olen = 0;    
      int err;
  
-     zd.next_in = (void *) in;
-     zd.avail_in = len;
-     zd.next_out = (void *) zbuf;
-     zd.avail_out = zbuf_size;
+     z->zd.next_in = (void *) in;
+     z->zd.avail_in = len;
+     z->zd.next_out = (void *) z->zbuf;
+     z->zd.avail_out = z->zbuf_size;
     
      while(1) {
-        oavail = zd.avail_out;
-        if( (err=deflate(&zd, Z_SYNC_FLUSH)) != Z_OK ){
+        oavail = z->zd.avail_out;
+        if( (err=deflate(&z->zd, Z_SYNC_FLUSH)) != Z_OK ){
            vtun_syslog(LOG_ERR,"Deflate error %d",err);
            return -1;
         }
-        olen += oavail - zd.avail_out;
-        if(!zd.avail_in)
+        olen += oavail - z->zd.avail_out;
+        if(!z->zd.avail_in)
 	   break;
 
-        if( expand_zbuf(&zd,100) ) {
+        if( expand_zbuf(z,&z->zd,100) ) {
 	   vtun_syslog( LOG_ERR, "Can't expand compression buffer");
            return -1;
 	}
      }
-     *out = (void *) zbuf;
+     *out = (void *) z->zbuf;
      return olen;
 }
 
-static int zlib_decomp(int len, char *in, char **out)
+static int zlib_decomp(struct lfd_mod *mod, int len, char *in, char **out)
 {
+     struct zlib_state *z = mod->priv;
      int oavail = 0, olen = 0;     
      int err;
 
-     zi.next_in = (void *) in;
-     zi.avail_in = len;
-     zi.next_out = (void *) zbuf;
-     zi.avail_out = zbuf_size;
+     z->zi.next_in = (void *) in;
+     z->zi.avail_in = len;
+     z->zi.next_out = (void *) z->zbuf;
+     z->zi.avail_out = z->zbuf_size;
 
      while(1) {
-        oavail = zi.avail_out;
-        if( (err=inflate(&zi, Z_SYNC_FLUSH)) != Z_OK ) {
+        oavail = z->zi.avail_out;
+        if( (err=inflate(&z->zi, Z_SYNC_FLUSH)) != Z_OK ) {
            vtun_syslog(LOG_ERR,"Inflate error %d len %d", err, len);
            return -1;
         }
-        olen += oavail - zi.avail_out;
-        if(!zi.avail_in)
+        olen += oavail - z->zi.avail_out;
+        if(!z->zi.avail_in)
 	   break;
-        if( expand_zbuf(&zi,100) ) {
+        if( expand_zbuf(z,&z->zi,100) ) {
 	   vtun_syslog( LOG_ERR, "Can't expand compression buffer");
            return -1;
 	}
      }
-     *out = (void *) zbuf;
+     *out = (void *) z->zbuf;
      return olen;
 }
 
@@ -170,12 +188,18 @@ struct lfd_mod lfd_zlib = {
      NULL,
      zlib_free,
      NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
+     NULL,
      NULL
 };
 
 #else  /* HAVE_ZLIB */
 
-static int no_zlib(struct vtun_host *host)
+static int no_zlib(struct lfd_mod *mod, struct vtun_host *host)
 {
      vtun_syslog(LOG_INFO, "ZLIB compression is not supported");
      return -1;
@@ -183,7 +207,8 @@ static int no_zlib(struct vtun_host *host)
 
 struct lfd_mod lfd_zlib = {
      "ZLIB",
-     no_zlib, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+     no_zlib, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+     NULL, NULL, NULL
 };
 
 #endif /* HAVE_ZLIB */
@@ -35,12 +35,21 @@
 #include <syslog.h>
 #include <errno.h>
 
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+
 #include "vtun.h"
 #include "linkfd.h"
 #include "lib.h"
+#include "netlib.h"
 
 volatile sig_atomic_t __io_canceled = 0;
 
+#ifdef HAVE_POSIX_SPAWN
+extern char **environ;
+#endif
+
 #ifndef HAVE_SETPROC_TITLE
 /* Functions to manipulate with program title */
 
@@ -282,53 +291,169 @@ static void split_args(char *str, char **argv)
 }
  
 #ifdef HAVE_WORKING_FORK
-int run_cmd(void *d, void *opt)
+/* 
+ * Start the program of the command, keep fd away from it.
+ * Returns pid or -1. 
+ */
+static pid_t spawn_cmd(struct vtun_cmd *cmd, struct vtun_sopt *opt, int fd)
 {
-     struct vtun_cmd *cmd = d;	
-     char *argv[50], *args;
-     int pid, st;
+     char *argv[50], *args, *prog = cmd->prog;
+     pid_t pid;
 
-     switch( (pid=fork()) ){
-	case 0:
-	   break;
-	case -1:
-	   vtun_syslog(LOG_ERR,"Couldn't fork()");
-	   return 0;
-	default:
-    	   if( cmd->flags & VTUN_CMD_WAIT ){
-	      /* Wait for termination */
-	      if( waitpid(pid,&st,0) > 0 && (WIFEXITED(st) && WEXITSTATUS(st)) )
-		 vtun_syslog(LOG_INFO,"Command [%s %.20s] error %d", 
-				cmd->prog ? cmd->prog : "sh",
-				cmd->args ? cmd->args : "", 
-				WEXITSTATUS(st) );
-	   }
-    	   if( cmd->flags & VTUN_CMD_DELAY ){
-	      struct timespec tm = { VTUN_DELAY_SEC, 0 };
-	      /* Small delay hack to sleep after pppd start.
-	       * Until I have no good solution for solving 
-	       * PPP + route problem  */
-	      nanosleep(&tm, NULL);
-	   }
-	   return 0;	 
-     }
+     /* Arguments are split in place */
+     if( (args = subst_opt(cmd->args, opt)) == cmd->args && args )
+        args = strdup(args);
 
-     args = subst_opt(cmd->args, opt);
-     if( !cmd->prog ){
+     if( !prog ){
 	/* Run using shell */
-	cmd->prog = "/bin/sh";
+	prog = "/bin/sh";
         argv[0] = "sh";	
 	argv[1] = "-c";
 	argv[2] = args;
 	argv[3] = NULL;
      } else {
-        argv[0] = cmd->prog;	
+        argv[0] = prog;	
         split_args(args, argv + 1);
      }
-     execv(cmd->prog, argv);
 
-     vtun_syslog(LOG_ERR,"Couldn't exec program %s", cmd->prog);
-     exit(1);
+#ifdef HAVE_POSIX_SPAWN
+     {
+        /* Address space is not copied, unlike fork() */
+        posix_spawn_file_actions_t fa;
+	int err;
+
+        posix_spawn_file_actions_init(&fa);
+	if( fd >= 0 )
+	   posix_spawn_file_actions_addclose(&fa, fd);
+	if( (err = posix_spawn(&pid, prog, &fa, NULL, argv, environ)) ){
+	   vtun_syslog(LOG_ERR,"Couldn't exec program %s: %s", prog, 
+				strerror(err));
+	   pid = -1;
+	}
+        posix_spawn_file_actions_destroy(&fa);
+     }
+#else
+     switch( (pid=fork()) ){
+	case 0:
+	   if( fd >= 0 )
+	      close(fd);
+	   execv(prog, argv);
+
+	   vtun_syslog(LOG_ERR,"Couldn't exec program %s", prog);
+	   exit(1);
+	case -1:
+	   vtun_syslog(LOG_ERR,"Couldn't fork()");
+	   break;
+     }
+#endif
+     free(args);
+     return pid;
+}
+
+/* Wait for termination */
+static void wait_cmd(struct vtun_cmd *cmd, pid_t pid)
+{
+     int st;
+
+     if( waitpid(pid,&st,0) > 0 && (WIFEXITED(st) && WEXITSTATUS(st)) )
+	vtun_syslog(LOG_INFO,"Command [%s %.20s] error %d", 
+			cmd->prog ? cmd->prog : "sh",
+			cmd->args ? cmd->args : "", 
+			WEXITSTATUS(st) );
+}
+
+int run_cmd(void *d, void *opt)
+{
+     struct vtun_cmd *cmd = d;	
+     char *args;
+     int watch = -1;
+     pid_t pid;
+
+     if( cmd->flags & VTUN_CMD_NETLINK ){
+        /* Queued, sent by run_cmds() with the ones which follow */
+        args = subst_opt(cmd->args, opt);
+	nl_cmd(((struct vtun_sopt *)opt)->dev, args);
+	if( args != cmd->args )
+	   free(args);
+	return 0;
+     }
+     /* Program may depend on what is queued */
+     nl_flush();
+
+     if( cmd->flags & VTUN_CMD_DELAY )
+        watch = nl_link_watch();
+
+     if( (pid = spawn_cmd(cmd, opt, watch)) < 0 ){
+	if( watch >= 0 )
+	   close(watch);
+	return 0;
+     }
+
+     if( cmd->flags & VTUN_CMD_WAIT )
+	wait_cmd(cmd, pid);
+
+     if( cmd->flags & VTUN_CMD_DELAY ){
+	struct timespec tm = { VTUN_DELAY_SEC, 0 };
+	/* Next commands need the link pppd brings up.
+	 * Without netlink sleep for the time it may take. */
+	if( watch >= 0 )
+	   nl_link_wait(watch, pid, VTUN_DELAY_SEC);
+	else
+	   nanosleep(&tm, NULL);
+     }
+     return 0;	 
+}
+
+/* 
+ * Run list of commands, netlink ones are sent in batches.
+ * Programs of a 'parallel' block are started together and 
+ * waited for at the end of the block.
+ */
+#define VTUN_CMD_PAR_MAX 64
+
+void run_cmds(llist *cmds, struct vtun_sopt *opt)
+{
+     struct {
+        struct vtun_cmd *cmd;
+	pid_t pid;
+     } par[VTUN_CMD_PAR_MAX];
+     struct vtun_cmd *cmd;
+     llist_elm *e;
+     int i, n = 0;
+     pid_t pid;
+
+     for( e = cmds->head; e; e = e->next ){
+	cmd = e->data;
+
+	if( !(cmd->flags & VTUN_CMD_PARALLEL) || 
+	     (cmd->flags & (VTUN_CMD_NETLINK | VTUN_CMD_DELAY)) ){
+	   run_cmd(cmd, opt);
+	} else {
+	   if( n == VTUN_CMD_PAR_MAX ){
+	      for( i = 0; i < n; i++ )
+		 wait_cmd(par[i].cmd, par[i].pid);
+	      n = 0;
+	   }
+	   nl_flush();
+	   if( (pid = spawn_cmd(cmd, opt, -1)) > 0 && 
+		(cmd->flags & VTUN_CMD_WAIT) ){
+	      par[n].cmd = cmd;
+	      par[n].pid = pid;
+	      n++;
+	   }
+	}
+
+	if( cmd->flags & VTUN_CMD_SYNC ){
+	   /* End of the block */
+	   nl_flush();
+	   for( i = 0; i < n; i++ )
+	      wait_cmd(par[i].cmd, par[i].pid);
+	   n = 0;
+	}
+     }
+     nl_flush();
+     for( i = 0; i < n; i++ )
+	wait_cmd(par[i].cmd, par[i].pid);
 }
 #endif
 
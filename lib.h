@@ -44,11 +44,16 @@
   #define min(a,b)    ( (a)<(b) ? (a):(b) )
 #endif
 
+#ifndef max
+  #define max(a,b)    ( (a)>(b) ? (a):(b) )
+#endif
+
 int readn_t(int fd, void *buf, size_t count, time_t timeout);
 int print_p(int f, const char *ftm, ...);
 
 #ifdef HAVE_WORKING_FORK
 int  run_cmd(void *d, void *opt);
+void run_cmds(llist *cmds, struct vtun_sopt *opt);
 #endif
 void free_sopt(struct vtun_sopt *opt);
 
@@ -58,31 +58,37 @@ int send_a_packet = 0;
  */
 static struct vtun_host *lfd_host;
 
-static struct lfd_mod *lfd_mod_head = NULL, *lfd_mod_tail = NULL;
-
 /* Modules functions*/
 
-/* Add module to the end of modules list */
-static void lfd_add_mod(struct lfd_mod *mod)
+/* Add copy of the module to the end of modules list */
+static void lfd_add_mod(struct lfd_link *lnk, struct lfd_mod *tmpl)
 {
-     if( !lfd_mod_head ){
-        lfd_mod_head = lfd_mod_tail = mod;
+     struct lfd_mod *mod;
+
+     if( lnk->nmods == LINKFD_MAX_MODS )
+	return;
+     mod = &lnk->mods[lnk->nmods++];
+     memcpy(mod, tmpl, sizeof(struct lfd_mod));
+     mod->priv = NULL;
+
+     if( !lnk->head ){
+        lnk->head = lnk->tail = mod;
 	mod->next = mod->prev = NULL;
      } else {
-        lfd_mod_tail->next = mod;
-        mod->prev = lfd_mod_tail;
+        lnk->tail->next = mod;
+        mod->prev = lnk->tail;
         mod->next = NULL;
-        lfd_mod_tail = mod;
+        lnk->tail = mod;
      }
 }
 
 /*  Initialize and allocate each module */
-static int lfd_alloc_mod(struct vtun_host *host)
+static int lfd_alloc_mod(struct lfd_link *lnk)
 {
-     struct lfd_mod *mod = lfd_mod_head;
+     struct lfd_mod *mod = lnk->head;
 
      while( mod ){
-        if( mod->alloc && (mod->alloc)(host) )
+        if( mod->alloc && (mod->alloc)(mod, lnk->host) )
 	   return 1; 
 	mod = mod->next;
      } 
@@ -90,72 +96,494 @@ static int lfd_alloc_mod(struct vtun_host *host)
      return 0;
 }
 
+/* Set up each module from the state saved by lfd_save() */
+static int lfd_restore_mod(struct lfd_link *lnk, char *buf, int len)
+{
+     struct lfd_mod *mod;
+     int mlen;
+
+     if( len < sizeof(int) )
+        return 1;
+     memcpy(&mlen, buf, sizeof(int));
+     if( mlen != lnk->nmods )
+        return 1;
+     buf += sizeof(int);
+     len -= sizeof(int);
+
+     for(mod = lnk->head; mod; mod = mod->next){
+        if( len < sizeof(int) )
+	   return 1;
+	memcpy(&mlen, buf, sizeof(int));
+	buf += sizeof(int);
+	len -= sizeof(int);
+	if( mlen < 0 || mlen > len )
+	   return 1;
+
+        if( mod->restore ){
+	   if( (mod->restore)(mod, lnk->host, buf, mlen) )
+	      return 1;
+	} else if( mod->alloc && (mod->alloc)(mod, lnk->host) )
+	   return 1;
+	buf += mlen;
+	len -= mlen;
+     }
+
+     return len != 0;
+}
+
 /* Free all modules */
-static int lfd_free_mod(void)
+static int lfd_free_mod(struct lfd_link *lnk)
 {
-     struct lfd_mod *mod = lfd_mod_head;
+     struct lfd_mod *mod = lnk->head;
 
      while( mod ){
-        if( mod->free && (mod->free)() )
+        if( mod->free && (mod->free)(mod) )
 	   return 1;
 	mod = mod->next;
      } 
-     lfd_mod_head = lfd_mod_tail = NULL;
+     lnk->head = lnk->tail = NULL;
+     lnk->nmods = 0;
      return 0;
 }
 
- /* Run modules down (from head to tail) */
-static inline int lfd_run_down(int len, char *in, char **out)
+ /* Run modules down (from mod to tail) */
+static inline int lfd_run_down_from(struct lfd_mod *mod, int len, char *in, char **out)
 {
-     register struct lfd_mod *mod;
-     
      *out = in;
-     for(mod = lfd_mod_head; mod && len > 0; mod = mod->next )
+     for(; mod && len > 0; mod = mod->next )
         if( mod->encode ){
-           len = (mod->encode)(len, in, out);
+           len = (mod->encode)(mod, len, in, out);
            in = *out;
         }
      return len;
 }
 
-/* Run modules up (from tail to head) */
-static inline int lfd_run_up(int len, char *in, char **out)
+/* Run modules up (from mod to head) */
+static inline int lfd_run_up_from(struct lfd_mod *mod, int len, char *in, char **out)
 {
-     register struct lfd_mod *mod;
-     
      *out = in;
-     for(mod = lfd_mod_tail; mod && len > 0; mod = mod->prev )
+     for(; mod && len > 0; mod = mod->prev )
         if( mod->decode ){
-	   len = (mod->decode)(len, in, out);
+	   len = (mod->decode)(mod, len, in, out);
            in = *out;
 	}
      return len;
 }
 
+ /* Run modules down (from head to tail) */
+static inline int lfd_run_down(struct lfd_link *lnk, int len, char *in, char **out)
+{
+     return lfd_run_down_from(lnk->head, len, in, out);
+}
+
+/* Run modules up (from tail to head) */
+static inline int lfd_run_up(struct lfd_link *lnk, int len, char *in, char **out)
+{
+     return lfd_run_up_from(lnk->tail, len, in, out);
+}
+
+/* 
+ * Write an encoded frame to the network.
+ * Returns -1 if the session has to be closed.
+ */
+static int lfd_proto_write(struct lfd_link *lnk, char *buf, int len)
+{
+     if( lnk->proto_write(lnk->host->rmt_fd, buf, len) < 0 )
+        return -1;
+     lnk->host->stat.comp_out += len;
+     return 0;
+}
+
+/* Pass extra frames generated by the modules down to the network */
+static int lfd_flush_down(struct lfd_link *lnk)
+{
+     register struct lfd_mod *mod;
+     char *in, *out;
+     int len;
+
+     for(mod = lnk->head; mod; mod = mod->next ){
+        if( !mod->pending_encode )
+	   continue;
+	while( (len = (mod->pending_encode)(mod, &in)) > 0 ){
+	   if( (len = lfd_run_down_from(mod->next, len, in, &out)) == -1 )
+	      return -1;
+	   if( len && lfd_proto_write(lnk, out, len) < 0 )
+	      return -1;
+	}
+     }
+     return 0;
+}
+
+/* Pass extra frames generated by the modules up to the device */
+static int lfd_flush_up(struct lfd_link *lnk)
+{
+     register struct lfd_mod *mod;
+     char *in, *out;
+     int len;
+
+     for(mod = lnk->tail; mod; mod = mod->prev ){
+        if( !mod->pending_decode )
+	   continue;
+	while( (len = (mod->pending_decode)(mod, &in)) > 0 ){
+	   if( (len = lfd_run_up_from(mod->prev, len, in, &out)) == -1 )
+	      return -1;
+	   if( len && lnk->dev_write(lnk->host->loc_fd, out, len) < 0 &&
+	       errno != EAGAIN && errno != EINTR )
+	      return -1;
+	   lnk->host->stat.byte_in += len;
+	}
+     }
+     return 0;
+}
+
 /* Check if modules are accepting the data(down) */
-static inline int lfd_check_down(void)
+int lfd_check_down(struct lfd_link *lnk)
 {
      register struct lfd_mod *mod;
      int err = 1;
  
-     for(mod = lfd_mod_head; mod && err > 0; mod = mod->next )
+     for(mod = lnk->head; mod && err > 0; mod = mod->next )
         if( mod->avail_encode )
-           err = (mod->avail_encode)();
+           err = (mod->avail_encode)(mod);
      return err;
 }
 
 /* Check if modules are accepting the data(up) */
-static inline int lfd_check_up(void)
+int lfd_check_up(struct lfd_link *lnk)
 {
      register struct lfd_mod *mod;
      int err = 1;
 
-     for(mod = lfd_mod_tail; mod && err > 0; mod = mod->prev)
+     for(mod = lnk->tail; mod && err > 0; mod = mod->prev)
         if( mod->avail_decode )
-           err = (mod->avail_decode)();
+           err = (mod->avail_decode)(mod);
 
      return err;
 }
+
+/* 
+ * Decode data frame in the link buffer and write it to the device.
+ * Returns -2 if the frame doesn't decode, -1 if the session 
+ * has to be closed.
+ */
+static int lfd_net_frame(struct lfd_link *lnk, int len)
+{
+     struct vtun_host *host = lnk->host;
+     char *out;
+
+     host->stat.comp_in += len; 
+     if( (len=lfd_run_up(lnk,len,lnk->buf,&out)) == -1 )
+        return -2;
+     if( len && lnk->dev_write(host->loc_fd,out,len) < 0 ){
+        if( errno != EAGAIN && errno != EINTR )
+	   return -1;
+	return 0;
+     }
+     host->stat.byte_in += len; 
+
+     return lfd_flush_up(lnk);
+}
+
+/* 
+ * Process frame read from the network into the link buffer.
+ * Decode it and pass it to the local device.
+ * Returns -1 if the session has to be closed.
+ */
+int lfd_net_input(struct lfd_link *lnk, int len)
+{
+     struct vtun_host *host = lnk->host;
+     int fl;
+
+     lnk->idle = 0;
+
+     /* Handle frame flags */
+     fl = len & ~VTUN_FSIZE_MASK;
+     len = len & VTUN_FSIZE_MASK;
+     if( fl ){
+        if( fl==VTUN_BAD_FRAME ){
+	   vtun_syslog(LOG_ERR, "Received bad frame");
+	   return 0;
+	}
+	if( fl==VTUN_ECHO_REQ ){
+	   /* Send ECHO reply */
+	   if( lnk->proto_write(host->rmt_fd, lnk->buf, VTUN_ECHO_REP) < 0 )
+	      return -1;
+	   return 0;
+	}
+	if( fl==VTUN_ECHO_REP ){
+	   /* Just ignore ECHO reply */
+	   return 0;
+	}
+	if( fl==VTUN_CONN_CLOSE ){
+	   vtun_syslog(LOG_INFO,"Connection closed by other side");
+	   return -1;
+	}
+     }   
+
+     return lfd_net_frame(lnk, len) < 0 ? -1 : 0;
+}
+
+/* 
+ * Frame which came from an address the session wasn't seen at.
+ * It is taken only if decryption proves it is from the peer,
+ * replayed and forged frames don't pass.
+ * Returns 1 if the frame was taken, 0 if it was dropped and
+ * -1 if the session has to be closed.
+ */
+int lfd_net_probe(struct lfd_link *lnk, int len)
+{
+     if( (len & ~VTUN_FSIZE_MASK) || !(lnk->host->flags & VTUN_ENCRYPT) )
+        return 0;
+
+     switch( lfd_net_frame(lnk, len) ){
+     case -2:
+        return 0;
+     case -1:
+        return -1;
+     }
+     lnk->idle = 0;
+     return 1;
+}
+
+/* Encode the device frame in lnk->buf and pass it to the network */
+static int lfd_dev_send(struct lfd_link *lnk, int len)
+{
+     struct vtun_host *host = lnk->host;
+     char *out;
+
+     host->stat.byte_out += len; 
+     if( (len=lfd_run_down(lnk,len,lnk->buf,&out)) == -1 )
+        return -1;
+     if( len && lfd_proto_write(lnk, out, len) < 0 )
+        return -1;
+
+     return lfd_flush_down(lnk);
+}
+
+/* 
+ * Read frame from the local device, encode it and pass 
+ * it to the network.
+ * Returns -1 if the session has to be closed.
+ */
+int lfd_dev_input(struct lfd_link *lnk)
+{
+     struct vtun_host *host = lnk->host;
+     int len;
+
+     if( (len = lnk->dev_read(host->loc_fd, lnk->buf, VTUN_FRAME_SIZE)) < 0 ){
+        if( errno != EAGAIN && errno != EINTR )
+	   return -1;
+	return 0;
+     }
+     if( !len )
+        return -1;
+
+     return lfd_dev_send(lnk, len);
+}
+
+/* Send the frames tunnel_buffer() kept while the client reconnected */
+int lfd_dev_flush(struct lfd_link *lnk)
+{
+     struct vtun_host *host = lnk->host;
+     unsigned short flen;
+     int off = 0, cnt = 0, err = 0;
+
+     while( off < host->rbuf_len ){
+        memcpy(&flen, host->rbuf + off, sizeof(flen));
+	memcpy(lnk->buf, host->rbuf + off + sizeof(flen), flen);
+	off += sizeof(flen) + flen;
+	if( (err = lfd_dev_send(lnk, flen)) < 0 )
+	   break;
+	cnt++;
+     }
+     host->rbuf_len = 0;
+
+     if( cnt )
+        vtun_syslog(LOG_INFO,"Session %s sent %d buffered frames", host->host, cnt);
+     return err;
+}
+
+/* 
+ * Keep-alive check, called every ka_interval.
+ * Returns -1 if the other side is gone.
+ */
+int lfd_keepalive(struct lfd_link *lnk)
+{
+     struct vtun_host *host = lnk->host;
+
+     if( lnk->idle > host->ka_maxfail ){
+        vtun_syslog(LOG_INFO,"Session %s network timeout", host->host);
+	return -1;
+     }
+     if( lnk->idle++ > 0 ){  /* No input frames, check connection with ECHO */
+        if( lnk->proto_write(host->rmt_fd, lnk->buf, VTUN_ECHO_REQ) < 0 ){
+	   vtun_syslog(LOG_ERR,"Failed to send ECHO_REQ");
+	   return -1;
+	}
+     }
+     return 0;
+}
+
+/* Build modules stack of the session */
+static void lfd_stack(struct lfd_link *lnk)
+{
+     struct vtun_host *host = lnk->host;
+
+     if(host->flags & VTUN_HCOMP){
+	if( (host->flags & VTUN_TYPE_MASK) == VTUN_TUN )
+	   lfd_add_mod(lnk, &lfd_hcomp);
+	else
+	   vtun_syslog(LOG_INFO,"Header compression is supported for tun tunnels only");
+     }
+
+     if(host->flags & VTUN_DEDUP){
+	if( host->flags & VTUN_TCP )
+	   lfd_add_mod(lnk, &lfd_dedup);
+	else
+	   vtun_syslog(LOG_INFO,"Redundancy elimination is supported over TCP only");
+     }
+
+     if(host->flags & VTUN_ZLIB)
+	lfd_add_mod(lnk, &lfd_zlib);
+
+     if(host->flags & VTUN_LZO)
+	lfd_add_mod(lnk, &lfd_lzo);
+
+     /* Parity has to be encrypted like the data it protects */
+     if(host->flags & VTUN_FEC){
+	if( host->flags & VTUN_UDP )
+	   lfd_add_mod(lnk, &lfd_fec);
+	else
+	   vtun_syslog(LOG_INFO,"Forward error correction is supported over UDP only");
+     }
+
+     if(host->flags & VTUN_ENCRYPT)
+	 lfd_add_mod(lnk, &lfd_encrypt);
+
+     if(host->flags & VTUN_SHAPE)
+	lfd_add_mod(lnk, &lfd_shaper);
+}
+
+/* 
+ * Set up the linker and the modules for the session, 
+ * from the saved state if there is one.
+ */
+static struct lfd_link * lfd_new(struct vtun_host *host, char *state, int len)
+{
+     struct lfd_link *lnk;
+     int err;
+
+     if( !(lnk = calloc(1, sizeof(struct lfd_link))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate the linker"); 
+        return NULL; 
+     }
+     lnk->host = host;
+
+     lnk->dev_write   = dev_write;
+     lnk->dev_read    = dev_read;
+     lnk->proto_write = proto_write;
+     lnk->proto_read  = proto_read;
+
+     lfd_stack(lnk);
+
+     err = state ? lfd_restore_mod(lnk, state, len) : lfd_alloc_mod(lnk);
+     if( err ){
+	lfd_free_mod(lnk);
+	free(lnk);
+	return NULL;
+     }
+
+     if( !(lnk->buf = lfd_alloc(VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate buffer for the linker"); 
+	lfd_free_mod(lnk);
+	free(lnk);
+        return NULL; 
+     }
+
+     return lnk;
+}
+
+struct lfd_link * lfd_open(struct vtun_host *host)
+{
+     return lfd_new(host, NULL, 0);
+}
+
+/* Linker of the session handed off by another process */
+struct lfd_link * lfd_restore(struct vtun_host *host, char *buf, int len)
+{
+     return lfd_new(host, buf, len);
+}
+
+/* 
+ * Save state of the modules for lfd_restore().
+ * Returns its length, -1 if some module can't be handed off.
+ */
+int lfd_save(struct lfd_link *lnk, char *buf, int size)
+{
+     struct lfd_mod *mod;
+     int len, mlen;
+
+     if( size < sizeof(int) )
+        return -1;
+     memcpy(buf, &lnk->nmods, sizeof(int));
+     len = sizeof(int);
+
+     for(mod = lnk->head; mod; mod = mod->next){
+        if( !mod->save || size - len < sizeof(int) )
+	   return -1;
+	mlen = (mod->save)(mod, buf + len + sizeof(int), size - len - sizeof(int));
+	if( mlen < 0 )
+	   return -1;
+	memcpy(buf + len, &mlen, sizeof(int));
+	len += sizeof(int) + mlen;
+     }
+
+     return len;
+}
+
+/* Release the linker, the other end is not told */
+void lfd_release(struct lfd_link *lnk)
+{
+     lfd_free_mod(lnk);
+     lfd_free(lnk->buf);
+     free(lnk);
+}
+
+/* 
+ * Adopt the parameters a running session can change from the
+ * reloaded definition of its host. Returns 1 if any changed.
+ */
+int lfd_update(struct lfd_link *lnk, struct vtun_host *h)
+{
+     struct vtun_host *host = lnk->host;
+     struct lfd_mod *mod;
+     int changed = 0;
+
+     if( host->ka_interval != h->ka_interval || host->ka_maxfail != h->ka_maxfail ){
+        host->ka_interval = h->ka_interval;
+	host->ka_maxfail = h->ka_maxfail;
+	changed = 1;
+     }
+
+     /* Shaper is in the stack only if the session started with it */
+     if( (host->flags & h->flags & VTUN_SHAPE) &&
+	 (host->spd_in != h->spd_in || host->spd_out != h->spd_out) ){
+        host->spd_in = h->spd_in;
+	host->spd_out = h->spd_out;
+	for(mod = lnk->head; mod; mod = mod->next)
+	   if( mod->update )
+	      mod->update(mod, host);
+	changed = 1;
+     }
+     return changed;
+}
+
+/* Notify other end and release the linker */
+void lfd_close(struct lfd_link *lnk)
+{
+     lnk->proto_write(lnk->host->rmt_fd, lnk->buf, VTUN_CONN_CLOSE);
+     lfd_release(lnk);
+}
 		
 /********** Linker *************/
 /* Termination flag */
@@ -179,10 +607,34 @@ static void sig_hup(int sig)
 static volatile sig_atomic_t ka_need_verify = 0;
 static time_t stat_timer = 0, ka_timer = 0; 
 
+/* Open statistic file of the session */
+void lfd_stat_open(struct vtun_host *host)
+{
+     char file[40];
+
+     snprintf(file, sizeof file, "%s/%.20s", VTUN_STAT_DIR, host->host);
+     if( (host->stat.file=fopen(file, "a")) ){
+        setvbuf(host->stat.file, NULL, _IOLBF, 0);
+     } else
+        vtun_syslog(LOG_ERR, "Can't open stats file %s", file);
+}
+
+/* Dump statistic counters of the session */
+void lfd_stat_write(struct vtun_host *host, time_t tm)
+{
+     char stm[20];
+
+     if( !host->stat.file )
+        return;
+     strftime(stm, sizeof(stm)-1, "%b %d %H:%M:%S", localtime(&tm)); 
+     fprintf(host->stat.file,"%s %lu %lu %lu %lu\n", stm, 
+	host->stat.byte_in, host->stat.byte_out,
+	host->stat.comp_in, host->stat.comp_out); 
+}
+
 static void sig_alarm(int sig)
 {
      static time_t tm_old, tm = 0;
-     static char stm[20];
  
      tm_old = tm;
      tm = time(NULL);
@@ -194,10 +646,7 @@ static void sig_alarm(int sig)
      }
 
      if( (lfd_host->flags & VTUN_STAT) && (stat_timer -= tm-tm_old) <= 0){
-        strftime(stm, sizeof(stm)-1, "%b %d %H:%M:%S", localtime(&tm)); 
-        fprintf(lfd_host->stat.file,"%s %lu %lu %lu %lu\n", stm, 
-	   lfd_host->stat.byte_in, lfd_host->stat.byte_out,
-	   lfd_host->stat.comp_in, lfd_host->stat.comp_out); 
+        lfd_stat_write(lfd_host, tm);
 	stat_timer = VTUN_STAT_IVAL;
      }
 
@@ -215,26 +664,24 @@ static void sig_usr1(int sig)
      lfd_host->stat.comp_in = lfd_host->stat.comp_out = 0; 
 }
 
-static int lfd_linker(void)
+static int lfd_linker(struct lfd_link *lnk)
 {
      int fd1 = lfd_host->rmt_fd;
      int fd2 = lfd_host->loc_fd; 
-     register int len, fl;
+     register int len;
      struct timeval tv;
-     char *buf, *out;
+     char *buf = lnk->buf, *out;
      fd_set fdset;
-     int maxfd, idle = 0, tmplen;
+     int maxfd, tmplen;
 
-     if( !(buf = lfd_alloc(VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD)) ){
-	vtun_syslog(LOG_ERR,"Can't allocate buffer for the linker"); 
-        return 0; 
-     }
-	
      /* Delay sending of first UDP packet over broken NAT routers
 	because we will probably be disconnected.  Wait for the remote
 	end to send us something first, and use that connection. */
-     if (!VTUN_USE_NAT_HACK(lfd_host))
-        proto_write(fd1, buf, VTUN_ECHO_REQ);
+     if (!VTUN_USE_NAT_HACK(lfd_host)){
+        lnk->proto_write(fd1, buf, VTUN_ECHO_REQ);
+	if( lfd_host->rbuf_len )
+	   lfd_dev_flush(lnk);
+     }
 
      maxfd = (fd1 > fd2 ? fd1 : fd2) + 1;
 
@@ -250,6 +697,9 @@ static int lfd_linker(void)
  	tv.tv_sec  = lfd_host->ka_interval;
 	tv.tv_usec = 0;
 
+	if( proto_fdset )
+	   proto_fdset(&fdset, &maxfd, &tv);
+
 	if( (len = select(maxfd, &fdset, NULL, NULL, &tv)) < 0 ){
 	   if( errno != EAGAIN && errno != EINTR )
 	      break;
@@ -258,16 +708,8 @@ static int lfd_linker(void)
 	} 
 
 	if( ka_need_verify ){
-	  if( idle > lfd_host->ka_maxfail ){
-	    vtun_syslog(LOG_INFO,"Session %s network timeout", lfd_host->host);
+	  if( lfd_keepalive(lnk) < 0 )
 	    break;
-	  }
-	  if (idle++ > 0) {  /* No input frames, check connection with ECHO */
-	    if( proto_write(fd1, buf, VTUN_ECHO_REQ) < 0 ){
-	      vtun_syslog(LOG_ERR,"Failed to send ECHO_REQ");
-	      break;
-	    }
-	  }
 	  ka_need_verify = 0;
 	}
 
@@ -276,73 +718,38 @@ static int lfd_linker(void)
            send_a_packet = 0;
            tmplen = 1;
 	   lfd_host->stat.byte_out += tmplen; 
-	   if( (tmplen=lfd_run_down(tmplen,buf,&out)) == -1 )
+	   if( (tmplen=lfd_run_down(lnk,tmplen,buf,&out)) == -1 )
+	      break;
+	   if( tmplen && lfd_proto_write(lnk, out, tmplen) < 0 )
 	      break;
-	   if( tmplen && proto_write(fd1, out, tmplen) < 0 )
+	   if( lfd_flush_down(lnk) < 0 )
 	      break;
-	   lfd_host->stat.comp_out += tmplen; 
         }
 
 	/* Read frames from network(fd1), decode and pass them to 
          * the local device (fd2) */
-	if( FD_ISSET(fd1, &fdset) && lfd_check_up() ){
-	   idle = 0;  ka_need_verify = 0;
-	   if( (len=proto_read(fd1, buf)) <= 0 )
+	if( (FD_ISSET(fd1, &fdset) || (proto_ready && proto_ready(&fdset))) &&
+	    lfd_check_up(lnk) ){
+	   ka_need_verify = 0;
+	   if( (len=lnk->proto_read(fd1, buf)) <= 0 )
 	      break;
-
-	   /* Handle frame flags */
-	   fl = len & ~VTUN_FSIZE_MASK;
-           len = len & VTUN_FSIZE_MASK;
-	   if( fl ){
-	      if( fl==VTUN_BAD_FRAME ){
-		 vtun_syslog(LOG_ERR, "Received bad frame");
-		 continue;
-	      }
-	      if( fl==VTUN_ECHO_REQ ){
-		 /* Send ECHO reply */
-	 	 if( proto_write(fd1, buf, VTUN_ECHO_REP) < 0 )
-		    break;
-		 continue;
-	      }
-   	      if( fl==VTUN_ECHO_REP ){
-		 /* Just ignore ECHO reply, ka_need_verify==0 already */
-		 continue;
-	      }
-	      if( fl==VTUN_CONN_CLOSE ){
-	         vtun_syslog(LOG_INFO,"Connection closed by other side");
+	   if( proto_unproven && proto_unproven() ){
+	      if( (len = lfd_net_probe(lnk, len)) < 0 )
 		 break;
-	      }
-	   }   
-
-	   lfd_host->stat.comp_in += len; 
-	   if( (len=lfd_run_up(len,buf,&out)) == -1 )
-	      break;	
-	   if( len && dev_write(fd2,out,len) < 0 ){
-              if( errno != EAGAIN && errno != EINTR )
-                 break;
-              else
-                 continue;
-           }
-	   lfd_host->stat.byte_in += len; 
+	      if( len )
+		 proto_proven();
+	   } else if( lfd_net_input(lnk, len) < 0 )
+	      break;
+	   /* With the NAT hack buffered frames wait for the remote end too */
+	   if( lfd_host->rbuf_len && lfd_dev_flush(lnk) < 0 )
+	      break;
 	}
 
 	/* Read data from the local device(fd2), encode and pass it to 
          * the network (fd1) */
-	if( FD_ISSET(fd2, &fdset) && lfd_check_down() ){
-	   if( (len = dev_read(fd2, buf, VTUN_FRAME_SIZE)) < 0 ){
-	      if( errno != EAGAIN && errno != EINTR )
-	         break;
-	      else
-		 continue;
-	   }
-	   if( !len ) break;
-	
-	   lfd_host->stat.byte_out += len; 
-	   if( (len=lfd_run_down(len,buf,&out)) == -1 )
+	if( FD_ISSET(fd2, &fdset) && lfd_check_down(lnk) ){
+	   if( lfd_dev_input(lnk) < 0 )
 	      break;
-	   if( len && proto_write(fd1, out, len) < 0 )
-	      break;
-	   lfd_host->stat.comp_out += len; 
 	}
      }
      if( !linker_term && errno )
@@ -352,10 +759,6 @@ static int lfd_linker(void)
        lfd_host->persist = 0;
      }
 
-     /* Notify other end about our close */
-     proto_write(fd1, buf, VTUN_CONN_CLOSE);
-     lfd_free(buf);
-
      return 0;
 }
 
@@ -363,6 +766,7 @@ static int lfd_linker(void)
 int linkfd(struct vtun_host *host)
 {
      struct sigaction sa, sa_oldterm, sa_oldint, sa_oldhup;
+     struct lfd_link *lnk;
      int old_prio;
 
      lfd_host = host;
@@ -370,20 +774,7 @@ int linkfd(struct vtun_host *host)
      old_prio=getpriority(PRIO_PROCESS,0);
      setpriority(PRIO_PROCESS,0,LINKFD_PRIO);
 
-     /* Build modules stack */
-     if(host->flags & VTUN_ZLIB)
-	lfd_add_mod(&lfd_zlib);
-
-     if(host->flags & VTUN_LZO)
-	lfd_add_mod(&lfd_lzo);
-
-     if(host->flags & VTUN_ENCRYPT)
-	 lfd_add_mod(&lfd_encrypt);
-
-     if(host->flags & VTUN_SHAPE)
-	lfd_add_mod(&lfd_shaper);
-
-     if(lfd_alloc_mod(host))
+     if( !(lnk = lfd_open(host)) )
 	return 0;
 
      memset(&sa, 0, sizeof(sa));
@@ -404,23 +795,17 @@ int linkfd(struct vtun_host *host)
 
      /* Initialize statstic dumps */
      if( host->flags & VTUN_STAT ){
-	char file[40];
-
         sa.sa_handler=sig_alarm;
         sigaction(SIGALRM,&sa,NULL);
         sa.sa_handler=sig_usr1;
         sigaction(SIGUSR1,&sa,NULL);
 
-	snprintf(file, sizeof file, "%s/%.20s", VTUN_STAT_DIR, host->host);
-	if( (host->stat.file=fopen(file, "a")) ){
-	   setvbuf(host->stat.file, NULL, _IOLBF, 0);
-	} else
-	   vtun_syslog(LOG_ERR, "Can't open stats file %s", file);
+	lfd_stat_open(host);
      }
 
      io_init();
 
-     lfd_linker();
+     lfd_linker(lnk);
 
      if( host->flags & (VTUN_STAT|VTUN_KEEP_ALIVE) ){
         alarm(0);
@@ -428,7 +813,7 @@ int linkfd(struct vtun_host *host)
 	  fclose(host->stat.file);
      }
 
-     lfd_free_mod();
+     lfd_close(lnk);
      
      sigaction(SIGTERM,&sa_oldterm,NULL);
      sigaction(SIGINT,&sa_oldint,NULL);
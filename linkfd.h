@@ -71,17 +71,68 @@ int linkfd(struct vtun_host *host);
 /* Module */
 struct lfd_mod {
    char *name;
-   int (*alloc)(struct vtun_host *host);
-   int (*encode)(int len, char *in, char **out);
-   int (*avail_encode)(void);
-   int (*decode)(int len, char *in, char **out);
-   int (*avail_decode)(void);
-   int (*free)(void);
+   int (*alloc)(struct lfd_mod *mod, struct vtun_host *host);
+   int (*encode)(struct lfd_mod *mod, int len, char *in, char **out);
+   int (*avail_encode)(struct lfd_mod *mod);
+   int (*decode)(struct lfd_mod *mod, int len, char *in, char **out);
+   int (*avail_decode)(struct lfd_mod *mod);
+   int (*free)(struct lfd_mod *mod);
+   /* Extra frames generated by the module (parity, recovered frames).
+    * Called until they return 0, output goes to the next modules. */
+   int (*pending_encode)(struct lfd_mod *mod, char **out);
+   int (*pending_decode)(struct lfd_mod *mod, char **out);
+   /* Handoff of the session to another process. save returns the
+    * length of the state or -1, restore sets the module up from it
+    * instead of alloc. Modules without save can't be handed off. */
+   int (*save)(struct lfd_mod *mod, char *buf, int size);
+   int (*restore)(struct lfd_mod *mod, struct vtun_host *host, char *buf, int len);
+   /* Parameters of the running session changed, called by lfd_update() */
+   int (*update)(struct lfd_mod *mod, struct vtun_host *host);
+
+   /* Session state, set up by alloc */
+   void *priv;
 
    struct lfd_mod *next;
    struct lfd_mod *prev;
 };
 
+/* Linker state of one session.
+ * Modules are private copies of the templates below. */
+#define LINKFD_MAX_MODS 8
+
+struct lfd_link {
+   struct vtun_host *host;
+   struct lfd_mod mods[LINKFD_MAX_MODS];
+   int  nmods;
+   struct lfd_mod *head;
+   struct lfd_mod *tail;
+
+   char *buf;
+   int  idle;
+
+   /* Drivers the session was started with */
+   int (*dev_write)(int fd, char *buf, int len);
+   int (*dev_read)(int fd, char *buf, int len);
+   int (*proto_write)(int fd, char *buf, int len);
+   int (*proto_read)(int fd, char *buf);
+};
+
+struct lfd_link * lfd_open(struct vtun_host *host);
+struct lfd_link * lfd_restore(struct vtun_host *host, char *buf, int len);
+int  lfd_save(struct lfd_link *lnk, char *buf, int size);
+void lfd_close(struct lfd_link *lnk);
+void lfd_release(struct lfd_link *lnk);
+int  lfd_update(struct lfd_link *lnk, struct vtun_host *h);
+int  lfd_check_up(struct lfd_link *lnk);
+int  lfd_check_down(struct lfd_link *lnk);
+int  lfd_net_input(struct lfd_link *lnk, int len);
+int  lfd_net_probe(struct lfd_link *lnk, int len);
+int  lfd_dev_input(struct lfd_link *lnk);
+int  lfd_dev_flush(struct lfd_link *lnk);
+int  lfd_keepalive(struct lfd_link *lnk);
+void lfd_stat_open(struct vtun_host *host);
+void lfd_stat_write(struct vtun_host *host, time_t tm);
+
 /* External LINKFD modules */
 
 extern struct lfd_mod lfd_zlib;
@@ -89,5 +140,8 @@ extern struct lfd_mod lfd_lzo;
 extern struct lfd_mod lfd_encrypt;
 extern struct lfd_mod lfd_legacy_encrypt;
 extern struct lfd_mod lfd_shaper;
+extern struct lfd_mod lfd_hcomp;
+extern struct lfd_mod lfd_dedup;
+extern struct lfd_mod lfd_fec;
 
 #endif
@@ -112,6 +112,34 @@ failed:
     return -1;
 }
 
+/* 
+ * Take a device from the pool dev0 .. dev<size-1>, returns opened fd.
+ * Devices are persistent, the one in use by another session is busy.
+ * Stores dev name in the first arg.
+ */  
+static int tun_pool_common(char *dev, int size, int istun)
+{
+    char name[IFNAMSIZ];
+    int i, fd, on = 1;
+
+    for(i=0; i < size; i++){
+       if( snprintf(name, sizeof(name), "%s%d", dev, i) >= sizeof(name) )
+          break;
+       if( (fd = tun_open_common(name, istun)) < 0 )
+          continue;
+       if( ioctl(fd, TUNSETPERSIST, on) < 0 )
+          vtun_syslog(LOG_ERR,"Can't make %s persistent. %s(%d)", 
+			name, strerror(errno), errno);
+       strcpy(dev, name);
+       return fd;
+    }
+    errno = EBUSY;
+    return -1;
+}
+
+int tun_pool_open(char *dev, int size) { return tun_pool_common(dev, size, 1); }
+int tap_pool_open(char *dev, int size) { return tun_pool_common(dev, size, 0); }
+
 #else
 
 # define tun_open_common(dev, type) tun_open_common0(dev, type)
@@ -33,6 +33,20 @@
 #include <signal.h>
 #include <errno.h>
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_PTHREAD_MUTEX_CONSISTENT) && defined(HAVE_SYS_MMAN_H)
+#define HAVE_REGISTRY 1
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
 #include "vtun.h"
 #include "linkfd.h"
 #include "lib.h" 
@@ -106,41 +120,245 @@ pid_t read_lock(char * file)
   return pid;
 }
 
+/* 
+ * Session registry. Server processes share it in memory mapped before
+ * they are forked, so the session of a host is found without the lock
+ * directory. The mutex is robust, a process which dies holding it
+ * doesn't block the others. inetd servers have no common parent and
+ * use the lock files.
+ */
+#ifdef HAVE_REGISTRY
+#define REG_SLOTS 4096
+#define REG_NAME  256
+
+struct reg_slot {
+   pid_t pid;			/* 0 if the host has no session */
+   char  host[REG_NAME];	/* Slots are never freed */
+};
+
+struct registry {
+   pthread_mutex_t lock;
+   struct reg_slot slot[REG_SLOTS];
+};
+
+static struct registry *reg;
+
+void lock_init(void)
+{
+  pthread_mutexattr_t attr;
+
+  reg = mmap(NULL, sizeof(struct registry), PROT_READ|PROT_WRITE,
+	     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( reg == MAP_FAILED ){
+     vtun_syslog(LOG_ERR, "Can't map session registry, using lock files");
+     reg = NULL;
+     return;
+  }
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  if( pthread_mutex_init(&reg->lock, &attr) ){
+     vtun_syslog(LOG_ERR, "Can't create session registry, using lock files");
+     munmap(reg, sizeof(struct registry));
+     reg = NULL;
+  }
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void reg_enter(void)
+{
+  /* Owner died, slots are consistent after each store */
+  if( pthread_mutex_lock(&reg->lock) == EOWNERDEAD )
+     pthread_mutex_consistent(&reg->lock);
+}
+
+static void reg_leave(void)
+{
+  pthread_mutex_unlock(&reg->lock);
+}
+
+/* Slot of the host, a free one is taken for it if add is set */
+static struct reg_slot *reg_slot(const char *host, int add)
+{
+  struct reg_slot *s;
+  unsigned int h = 2166136261U, i;
+  const char *p;
+
+  for(p = host; *p; p++)
+     h = (h ^ (unsigned char)*p) * 16777619U;
+
+  for(i = 0; i < REG_SLOTS; i++){
+     s = &reg->slot[(h + i) % REG_SLOTS];
+     if( !strcmp(s->host, host) )
+        return s;
+     if( !s->host[0] ){
+        if( !add )
+	   return NULL;
+	s->pid = 0;
+	strcpy(s->host, host);
+	return s;
+     }
+  }
+  return NULL;
+}
+
+/* Owner of the host's session, 0 if there is none */
+static pid_t reg_owner(struct reg_slot *s)
+{
+  if( s->pid && s->pid != getpid() && kill(s->pid, 0) < 0 && errno == ESRCH )
+     /* Died without unlocking */
+     s->pid = 0;
+  return s->pid;
+}
+#else
+void lock_init(void)
+{
+}
+#endif
+
+/* 
+ * Terminate the process of the old session and wait until it exits.
+ * Returns 1 if it had to be killed, it didn't unlock the host then.
+ */
+static int kill_session(pid_t pid)
+{
+  struct timespec tm;
+  int fd = -1, i;
+
+  vtun_syslog(LOG_INFO, "Killing old connection (process %d)", pid);
+#if defined(SYS_pidfd_open) && defined(HAVE_POLL_H)
+  /* Exit of the process wakes us up */
+  fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  if( kill(pid, SIGTERM) < 0 && errno != ESRCH ){
+     vtun_syslog(LOG_ERR, "Can't kill process %d. %s",pid,strerror(errno));
+     if( fd >= 0 )
+        close(fd);
+     return -1;
+  }
+
+  /* Give it a time(up to 5 secs) to terminate */
+#if defined(SYS_pidfd_open) && defined(HAVE_POLL_H)
+  if( fd >= 0 ){
+     struct pollfd pfd;
+
+     pfd.fd = fd;
+     pfd.events = POLLIN;
+     while( poll(&pfd, 1, 5000) < 0 && errno == EINTR )
+        ;
+     close(fd);
+  } else
+#endif
+  for(i=0; i < 10 && !kill(pid, 0); i++ ){
+     tm.tv_sec = 0; tm.tv_nsec = 500000000; 
+     nanosleep(&tm, NULL);
+  }
+
+  /* Make sure it's dead */		 
+  if( !kill(pid, SIGKILL) ){
+     vtun_syslog(LOG_ERR, "Process %d ignored TERM, killed with KILL", pid);
+     return 1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_REGISTRY
+static int reg_lock_host(struct vtun_host *host)
+{
+  struct reg_slot *s;
+  pid_t pid;
+
+  reg_enter();
+  if( !(s = reg_slot(host->host, 1)) ){
+     reg_leave();
+     vtun_syslog(LOG_ERR, "Session registry is full");
+     return -1;
+  }
+  if( !(pid = reg_owner(s)) || pid == getpid() ){
+     s->pid = getpid();
+     reg_leave();
+     return 0;
+  }
+  reg_leave();
+
+  /* Other workers can't be killed, the host stays with them */
+  if( vtun.svr_type == VTUN_EVENT ){
+     vtun_syslog(LOG_INFO, "Host %s is served by worker %d", host->host, pid);
+     return -1;
+  }
+  if( host->multi != VTUN_MULTI_KILL || kill_session(pid) < 0 )
+     return -1;
+
+  /* Another client may have taken it meanwhile */
+  reg_enter();
+  if( s->pid == pid || !reg_owner(s) ){
+     s->pid = getpid();
+     pid = 0;
+  }
+  reg_leave();
+
+  return pid ? -1 : 0;
+}
+
+static void reg_unlock_host(struct vtun_host *host)
+{
+  struct reg_slot *s;
+
+  reg_enter();
+  /* Session which was killed must not unlock its successor */
+  if( (s = reg_slot(host->host, 0)) && s->pid == getpid() )
+     s->pid = 0;
+  reg_leave();
+}
+#endif
+
 int lock_host(struct vtun_host * host)
 {
   char lock_file[255];
-  struct timespec tm;
-  int pid, i;
+  int pid;
 
   if( host->multi == VTUN_MULTI_ALLOW )
      return 0;
 
+  if( vtun.svr_type == VTUN_EVENT ){
+     /* Sessions of this process are locked in memory */
+     if( ev_lock_host(host) < 0 )
+        return -1;
+     if( vtun.workers <= 1 )
+        return 0;
+  }
+
+#ifdef HAVE_REGISTRY
+  if( reg && strlen(host->host) < REG_NAME )
+     return reg_lock_host(host);
+#endif
+
   snprintf(lock_file, sizeof lock_file, "%s/%s", VTUN_LOCK_DIR, host->host);
 
+  if( vtun.svr_type == VTUN_EVENT ){
+     /* Other workers can't be killed, the host stays with them */
+     if( (pid = read_lock(lock_file)) > 0 && pid != getpid() ){
+        vtun_syslog(LOG_INFO, "Host %s is served by worker %d", host->host, pid);
+        return -1;
+     }
+     if( pid == getpid() )
+        return 0;
+     return create_lock(lock_file);
+  }
+
   /* Check if lock already exists. */
   if( (pid = read_lock(lock_file)) > 0 ){ 
      /* Old process is alive */
      switch( host->multi ){
 	case VTUN_MULTI_KILL:
-           vtun_syslog(LOG_INFO, "Killing old connection (process %d)", pid);
-           if( kill(pid, SIGTERM) < 0 && errno != ESRCH ){
-              vtun_syslog(LOG_ERR, "Can't kill process %d. %s",pid,strerror(errno));
-              return -1;
-           }
-           /* Give it a time(up to 5 secs) to terminate */
-	   for(i=0; i < 10 && !kill(pid, 0); i++ ){
-              tm.tv_sec = 0; tm.tv_nsec = 500000000; 
-              nanosleep(&tm, NULL);
+	   switch( kill_session(pid) ){
+	      case -1:
+	         return -1;
+	      case 1:
+   	         /* Remove lock */
+                 if( unlink(lock_file) < 0 )
+                    vtun_syslog(LOG_ERR, "Unable to remove lock %s", lock_file);
 	   }
-
-	   /* Make sure it's dead */		 
-           if( !kill(pid, SIGKILL) ){
-              vtun_syslog(LOG_ERR, "Process %d ignored TERM, killed with KILL", pid);
-   	      /* Remove lock */
-              if( unlink(lock_file) < 0 )
-                 vtun_syslog(LOG_ERR, "Unable to remove lock %s", lock_file);
-	   }
-
 	   break;
         case VTUN_MULTI_DENY:
            return -1;
@@ -155,6 +373,15 @@ void unlock_host(struct vtun_host *host)
 
   if( host->multi == VTUN_MULTI_ALLOW )
      return;
+  if( vtun.svr_type == VTUN_EVENT && vtun.workers <= 1 )
+     return;
+
+#ifdef HAVE_REGISTRY
+  if( reg && strlen(host->host) < REG_NAME ){
+     reg_unlock_host(host);
+     return;
+  }
+#endif
 
   snprintf(lock_file, sizeof lock_file, "%s/%s", VTUN_LOCK_DIR, host->host);
 
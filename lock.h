@@ -25,7 +25,11 @@
 
 pid_t read_lock(char * host);
 int   create_lock(char * host);
+void  lock_init(void);
 int   lock_host(struct vtun_host * host);
 void  unlock_host(struct vtun_host * host);
 
+/* Event server keeps the locks in memory */
+int   ev_lock_host(struct vtun_host * host);
+
 #endif /* _VTUN_LOCK_H */
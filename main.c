@@ -43,7 +43,7 @@
 #include "lib.h"
 #include "compat.h"
 
-#define OPTSTRING "mif:P:L:t:npq"
+#define OPTSTRING "mif:P:L:t:npqH"
 #ifdef HAVE_WORKING_FORK
 #  define SERVOPT_STRING "s"
 #else
@@ -55,7 +55,7 @@ struct vtun_opts vtun;
 struct vtun_host default_host;
 
 static void write_pid(void);
-static void reread_config(int sig);
+static void reread_config(void);
 static void usage(void);
 
 extern int optind,opterr,optopt;
@@ -63,6 +63,8 @@ extern char *optarg;
 
 /* for the NATHack bit.  Is our UDP session connected? */
 int is_rmt_fd_connected=1;
+/* Our ID on the server's shared UDP socket, 0 if it isn't used */
+unsigned int udp_session_id=0;
 
 int main(int argc, char *argv[], char *env[])
 {
@@ -83,6 +85,11 @@ int main(int argc, char *argv[], char *env[])
      vtun.cfg_file = VTUN_CONFIG_FILE;
      vtun.persist = -1;
      vtun.timeout = -1;
+     vtun.workers = -1;
+     vtun.backlog = -1;
+     vtun.fastopen = -1;
+     vtun.udpmux = -1;
+     vtun.ratelimit = -1;
 
      /* Dup strings because parser will try to free them */
      vtun.ppp   = strdup("/usr/sbin/pppd");
@@ -90,6 +97,7 @@ int main(int argc, char *argv[], char *env[])
      vtun.route = strdup("/sbin/route");
      vtun.fwall = strdup("/sbin/ipchains");
      vtun.iproute = strdup("/sbin/ip");
+     vtun.keycache = NULL;
 
      vtun.svr_name = NULL;
      vtun.svr_addr = NULL;
@@ -146,12 +154,23 @@ int main(int argc, char *argv[], char *env[])
 	    case 'q':
 		vtun.quiet = 1;
 		break;
+	    case 'H':
+		vtun.handoff = 1;
+		break;
 	    default:
 		usage();
 	        exit(1);
 	}
      }
-     reread_config(0);
+
+     /* Keys are derived as the config is read */
+#ifdef HAVE_SODIUM
+    if (sodium_init() != 0) {
+	abort();
+    }
+#endif
+
+     reread_config();
 
      if (vtun.syslog != LOG_DAEMON) {
 	/* Restart logging to syslog using specified facility  */
@@ -186,6 +205,16 @@ int main(int argc, char *argv[], char *env[])
 	vtun.persist = 0;
      if(vtun.timeout == -1)
 	vtun.timeout = VTUN_TIMEOUT;
+     if(vtun.workers == -1)
+	vtun.workers = 1;
+     if(vtun.backlog == -1)
+	vtun.backlog = VTUN_BACKLOG;
+     if(vtun.fastopen == -1)
+	vtun.fastopen = 0;
+     if(vtun.udpmux == -1)
+	vtun.udpmux = 0;
+     if(vtun.ratelimit == -1)
+	vtun.ratelimit = 0;
 
      switch( vtun.svr_type ){
 	case -1:
@@ -199,12 +228,6 @@ int main(int argc, char *argv[], char *env[])
 	   break;
      }
 
-#ifdef HAVE_SODIUM
-    if (sodium_init() != 0) {
-	abort();
-    }
-#endif
-
      if( daemon ){
 #ifdef HAVE_WORKING_FORK
 	if( dofork && fork() )
@@ -227,13 +250,15 @@ int main(int argc, char *argv[], char *env[])
      }
 
      if(vtun.svr){
+        /* Servers reload the config from their main loops, a
+	   signal handler can't derive keys or write the caches */
         memset(&sa,0,sizeof(sa));
-        sa.sa_handler=reread_config;
+        sa.sa_handler=SIG_IGN;
         sigaction(SIGHUP,&sa,NULL);
 
         init_title(argc,argv,env,"vtund[s]: ");
 
-	if( vtun.svr_type == VTUN_STAND_ALONE ){
+	if( vtun.svr_type == VTUN_STAND_ALONE || vtun.svr_type == VTUN_EVENT ){
 #ifdef HAVE_WORKING_FORK
 	   write_pid();
 #else
@@ -270,7 +295,7 @@ static void write_pid(void)
      fclose(f);
 }
 
-static void reread_config(int sig)
+static void reread_config(void)
 {
      if( !read_config(vtun.cfg_file) ){
 	vtun_syslog(LOG_ERR,"No hosts defined");
@@ -284,7 +309,7 @@ static void usage(void)
      printf("Usage: \n");
      printf("  Server:\n");
 #ifdef HAVE_WORKING_FORK
-     printf("\tvtund <-s|-i> [-f file] [-P port] [-L local address]\n");
+     printf("\tvtund <-s|-i> [-f file] [-P port] [-L local address] [-H]\n");
 #else
      printf("\tvtund <-i> [-f file] [-P port] [-L local address]\n");
 #endif
@@ -0,0 +1,733 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Multipath UDP transport.
+ *
+ * The client opens one UDP socket per configured source address or
+ * interface, all of them sending to the server's UDP port. The server
+ * keeps its single socket unconnected and learns the address of every
+ * path from the frames it receives on it. A path moves to an address
+ * only with a data frame which decrypts, probes from an unknown address
+ * are just answered there. Such a frame still goes through the reorder
+ * buffer and is checked when it comes out of it in order.
+ *
+ * Both ends probe every path, keep a smoothed RTT and the loss reported
+ * by the other end, and spread frames over the live paths with a smooth
+ * weighted round robin. A path which stops answering probes gets no
+ * more frames until it answers again.
+ *
+ * Frames carry a session wide sequence number and are put back in order
+ * by a bounded reorder buffer before they reach the modules (encryption
+ * rejects reordered frames). A missing frame is waited for about as long
+ * as the RTT spread of the paths, then it is given up.
+ *
+ * Wire format, the first byte is type | path:
+ *   MP_DATA:  b0 | path seq(2) | seq(4) | frame
+ *   MP_CTRL:  b0 | frame flags(2)
+ *   MP_PROBE: b0 | stamp(4)
+ *   MP_REPLY: b0 | stamp(4) | loss
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include "vtun.h"
+#include "lib.h"
+#include "netlib.h"
+#include "driver.h"
+
+#define MP_MAX_PATHS	8
+#define MP_REORDER	256	/* Frames held by the reorder buffer */
+#define MP_PROBE_IVAL	200	/* ms */
+#define MP_DEAD_TIME	1000	/* ms without a probe reply */
+#define MP_HOLD_MIN	10	/* ms, wait for a missing frame */
+#define MP_HOLD_MAX	500
+#define MP_LOSS_WIN	64	/* Frames per loss sample */
+
+/* Frame types */
+#define MP_DATA		0x00
+#define MP_CTRL		0x10
+#define MP_PROBE	0x20
+#define MP_REPLY	0x30
+#define MP_TYPE_MASK	0xf0
+#define MP_PATH_MASK	0x0f
+
+#define MP_HDR		7	/* Longest header (MP_DATA) */
+#define MP_SLOT		(VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD)
+
+struct mp_path {
+     int  fd;
+     int  known;		/* Peer address is known */
+     struct sockaddr_in peer;
+
+     unsigned short tx_seq;
+     unsigned long tx_frames, rx_frames;
+
+     /* Loss of the frames we receive on this path, 1/256 */
+     int  rx_started;
+     unsigned short rx_base;
+     int  rx_count;
+     int  rx_loss;
+
+     /* Sending side, loss as reported by the other end */
+     int  loss;
+     unsigned long srtt;	/* ms, 0 - no sample yet */
+     unsigned long last_ack;	/* Last probe reply */
+     int  up;
+     unsigned long last_probe;
+     long cur;			/* Weighted round robin state */
+};
+
+static struct mp_path mp_paths[MP_MAX_PATHS];
+static int mp_npaths;
+static int mp_fds[MP_MAX_PATHS], mp_nfds, mp_rr;
+
+static unsigned int mp_tx_seq;
+
+/* Data frame just read came from an address not proven to be the peer's */
+static struct mp_path *mp_cand;
+static struct sockaddr_in mp_cand_addr;
+
+/* Reorder buffer, with the unproven address each frame came from */
+static char *mp_rbuf;
+static int mp_rlen[MP_REORDER], mp_nbuf;
+static struct mp_path *mp_rcand[MP_REORDER];
+static struct sockaddr_in mp_raddr[MP_REORDER];
+static unsigned int mp_rx_next, mp_skip_to;
+static unsigned long mp_gap_since;
+
+static unsigned long mp_now(void)
+{
+     struct timeval tv;
+
+     gettimeofday(&tv, NULL);
+     return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+static void mp_init_path(struct mp_path *p, int fd, struct sockaddr_in *peer)
+{
+     memset(p, 0, sizeof(*p));
+     p->fd = fd;
+     if( peer ){
+	p->peer = *peer;
+	p->known = 1;
+     }
+}
+
+/* Open client path bound to the address or interface */
+static int mp_open_path(void *d, void *u)
+{
+     struct vtun_addr *addr = d;
+     struct sockaddr_in saddr;
+     int s;
+
+     if( mp_npaths == MP_MAX_PATHS ){
+	vtun_syslog(LOG_ERR,"Too many paths, %s ignored", addr->name);
+	return 0;
+     }
+     if( generic_addr(&saddr, addr) < 0 )
+	return 0;
+
+     if( (s = socket(AF_INET,SOCK_DGRAM,0)) == -1 ){
+	vtun_syslog(LOG_ERR,"Can't create socket");
+	return 0;
+     }
+#ifdef SO_BINDTODEVICE
+     if( addr->type == VTUN_ADDR_IFACE )
+	setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, addr->name, strlen(addr->name) + 1);
+#endif
+     if( bind(s,(struct sockaddr *)&saddr,sizeof(saddr)) ||
+	 connect(s,(struct sockaddr *)u,sizeof(struct sockaddr_in)) ){
+	vtun_syslog(LOG_ERR,"Can't set up path %s. %s(%d)", addr->name, strerror(errno), errno);
+	close(s);
+	return 0;
+     }
+
+     mp_init_path(&mp_paths[mp_npaths++], s, u);
+     mp_fds[mp_nfds++] = s;
+     return 0;
+}
+
+/*
+ * Set up the paths on top of the UDP socket created by udp_session().
+ * peer is the address of the other end's UDP socket.
+ */
+int mpath_session(struct vtun_host *host, struct sockaddr_in *peer)
+{
+     struct sockaddr sa;
+
+     memset(mp_paths, 0, sizeof(mp_paths));
+     mp_npaths = mp_nfds = mp_rr = 0;
+     mp_tx_seq = mp_rx_next = mp_skip_to = 0;
+     mp_nbuf = 0;
+     memset(mp_rlen, 0, sizeof(mp_rlen));
+
+     if( !mp_rbuf && !(mp_rbuf = malloc(MP_REORDER * MP_SLOT)) ){
+	vtun_syslog(LOG_ERR,"Can't allocate reorder buffer");
+	return -1;
+     }
+
+     /* Path 0 is the socket of the UDP session */
+     mp_init_path(&mp_paths[0], host->rmt_fd, peer);
+     mp_paths[0].last_ack = mp_now();
+     mp_paths[0].up = 1;
+     mp_fds[mp_nfds++] = host->rmt_fd;
+
+     if( vtun.svr ){
+	/* Other paths come from other addresses */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_family = AF_UNSPEC;
+	connect(host->rmt_fd, &sa, sizeof(sa));
+
+	for(mp_npaths = 1; mp_npaths < MP_MAX_PATHS; mp_npaths++)
+	   mp_init_path(&mp_paths[mp_npaths], host->rmt_fd, NULL);
+     } else {
+	mp_npaths = 1;
+	llist_trav(&host->paths, mp_open_path, peer);
+     }
+
+     vtun_syslog(LOG_INFO,"Multipath session initialized, %d local path(s)", mp_nfds);
+     return 0;
+}
+
+/* Close the path sockets, path 0 is closed with the session */
+void mpath_close(void)
+{
+     struct mp_path *p;
+     int i;
+
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( !p->known )
+	   continue;
+	vtun_syslog(LOG_INFO,"Path %d: rtt %lums, loss %d%%, frames out %lu, in %lu",
+		    i, p->srtt, p->loss * 100 / 256, p->tx_frames, p->rx_frames);
+     }
+     for(i = 1; i < mp_nfds; i++)
+	close(mp_fds[i]);
+     mp_nfds = mp_npaths = 0;
+}
+
+static int mp_send(struct mp_path *p, unsigned char *hdr, int hlen, char *buf, int len)
+{
+     struct msghdr msg;
+     struct iovec iv[2];
+
+     iv[0].iov_base = hdr;
+     iv[0].iov_len  = hlen;
+     iv[1].iov_base = buf;
+     iv[1].iov_len  = len;
+
+     memset(&msg, 0, sizeof(msg));
+     msg.msg_iov = iv;
+     msg.msg_iovlen = len ? 2 : 1;
+     if( p->fd == mp_fds[0] && vtun.svr ){
+	msg.msg_name = &p->peer;
+	msg.msg_namelen = sizeof(p->peer);
+     }
+
+     /* A failing path must not take the session down */
+     while( sendmsg(p->fd, &msg, 0) < 0 ){
+	if( errno != EINTR )
+	   return 0;
+     }
+     return hlen + len;
+}
+
+static inline int mp_alive(struct mp_path *p, unsigned long now)
+{
+     return p->known && p->last_ack && now - p->last_ack < MP_DEAD_TIME;
+}
+
+static long mp_weight(struct mp_path *p)
+{
+     unsigned long rtt = p->srtt ? p->srtt : 100;
+
+     return (1000000L / (rtt + 1)) * 256 / (256 + 8 * p->loss);
+}
+
+/* Path which answered last, used when none looks alive */
+static struct mp_path * mp_fallback(void)
+{
+     struct mp_path *p, *best = NULL;
+     int i;
+
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( p->known && (!best || p->last_ack > best->last_ack) )
+	   best = p;
+     }
+     return best;
+}
+
+/* Path for the next data frame */
+static struct mp_path * mp_pick(unsigned long now)
+{
+     struct mp_path *p, *best = NULL;
+     long total = 0, w;
+     int i;
+
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( !mp_alive(p, now) )
+	   continue;
+	w = mp_weight(p);
+	p->cur += w;
+	total  += w;
+	if( !best || p->cur > best->cur )
+	   best = p;
+     }
+     if( !best )
+	return mp_fallback();
+
+     best->cur -= total;
+     return best;
+}
+
+/* Path for control frames */
+static struct mp_path * mp_best(unsigned long now)
+{
+     struct mp_path *p, *best = NULL;
+     int i;
+
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( mp_alive(p, now) && (!best || mp_weight(p) > mp_weight(best)) )
+	   best = p;
+     }
+     return best ? best : mp_fallback();
+}
+
+/* How long a missing frame is waited for */
+static unsigned long mp_hold_time(unsigned long now)
+{
+     unsigned long min = 0, max = 0, hold;
+     struct mp_path *p;
+     int i;
+
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( !mp_alive(p, now) || !p->srtt )
+	   continue;
+	if( !min || p->srtt < min )
+	   min = p->srtt;
+	if( p->srtt > max )
+	   max = p->srtt;
+     }
+     hold = max - min + MP_HOLD_MIN;
+     return hold > MP_HOLD_MAX ? MP_HOLD_MAX : hold;
+}
+
+int mpath_write(int fd, char *buf, int len)
+{
+     unsigned long now = mp_now();
+     unsigned char hdr[MP_HDR];
+     struct mp_path *p;
+     int fl = len & ~VTUN_FSIZE_MASK, i;
+
+     if( fl ){
+	hdr[1] = fl >> 8; hdr[2] = fl;
+
+	/* Close notification goes everywhere */
+	if( fl == VTUN_CONN_CLOSE ){
+	   for(i = 0; i < mp_npaths; i++)
+	      if( mp_paths[i].known ){
+		 hdr[0] = MP_CTRL | i;
+		 mp_send(&mp_paths[i], hdr, 3, NULL, 0);
+	      }
+	   return 0;
+	}
+	if( !(p = mp_best(now)) )
+	   return 0;
+	hdr[0] = MP_CTRL | (p - mp_paths);
+	return mp_send(p, hdr, 3, NULL, 0);
+     }
+
+     if( !(p = mp_pick(now)) )
+	return 0;
+
+     hdr[0] = MP_DATA | (p - mp_paths);
+     hdr[1] = p->tx_seq >> 8;  hdr[2] = p->tx_seq;
+     hdr[3] = mp_tx_seq >> 24; hdr[4] = mp_tx_seq >> 16;
+     hdr[5] = mp_tx_seq >> 8;  hdr[6] = mp_tx_seq;
+     p->tx_seq++;
+     mp_tx_seq++;
+     p->tx_frames++;
+
+     return mp_send(p, hdr, MP_HDR, buf, len);
+}
+
+static void mp_probe(struct mp_path *p, unsigned long now)
+{
+     unsigned char hdr[MP_HDR];
+     unsigned int stamp = now;
+
+     hdr[0] = MP_PROBE | (p - mp_paths);
+     hdr[1] = stamp >> 24; hdr[2] = stamp >> 16;
+     hdr[3] = stamp >> 8;  hdr[4] = stamp;
+     mp_send(p, hdr, 5, NULL, 0);
+     p->last_probe = now;
+}
+
+/* Loss of the frames received on the path */
+static void mp_rx_account(struct mp_path *p, unsigned short pseq)
+{
+     unsigned short d;
+     int lost;
+
+     if( !p->rx_started ){
+	p->rx_started = 1;
+	p->rx_base = pseq;
+	p->rx_count = 0;
+     }
+
+     d = pseq - p->rx_base;
+     if( d >= 0x8000 )
+	return;	/* Reordered behind the sample */
+
+     if( d >= MP_LOSS_WIN ){
+	lost = d - p->rx_count;
+	if( lost < 0 )
+	   lost = 0;
+	p->rx_loss = (p->rx_loss * 3 + lost * 255 / d) / 4;
+	p->rx_base = pseq;
+	p->rx_count = 0;
+     }
+     p->rx_count++;
+}
+
+/* Next in order frame from the reorder buffer, 0 if none */
+static int mp_release(char *buf, unsigned long now)
+{
+     int slot, len;
+
+     while( mp_nbuf ){
+	slot = mp_rx_next % MP_REORDER;
+	if( (len = mp_rlen[slot]) ){
+	   memcpy(buf, mp_rbuf + slot * MP_SLOT, len);
+	   mp_rlen[slot] = 0;
+	   mp_cand = mp_rcand[slot];
+	   mp_cand_addr = mp_raddr[slot];
+	   mp_nbuf--;
+	   mp_rx_next++;
+	   if( mp_nbuf && !mp_rlen[mp_rx_next % MP_REORDER] )
+	      mp_gap_since = now;
+	   return len;
+	}
+	if( now - mp_gap_since < mp_hold_time(now) &&
+	    (int)(mp_skip_to - mp_rx_next) <= 0 )
+	   return 0;
+
+	/* Give up on the missing frame */
+	mp_rx_next++;
+     }
+     return 0;
+}
+
+static int mp_releasable(unsigned long now)
+{
+     return mp_nbuf && ( mp_rlen[mp_rx_next % MP_REORDER] ||
+			 now - mp_gap_since >= mp_hold_time(now) ||
+			 (int)(mp_skip_to - mp_rx_next) > 0 );
+}
+
+/*
+ * Returns frame length if it can go up right away.
+ * cand is the path of a frame from an unproven address, NULL otherwise.
+ */
+static int mp_data(unsigned int seq, char *buf, int len, unsigned long now,
+		   struct mp_path *cand, struct sockaddr_in *from)
+{
+     int d = seq - mp_rx_next, slot;
+
+     if( d < 0 )
+	return 0;	/* Late or duplicate */
+
+     if( d == 0 ){
+	if( cand ){
+	   mp_cand = cand;
+	   mp_cand_addr = *from;
+	}
+	mp_rx_next++;
+	if( mp_nbuf && !mp_rlen[mp_rx_next % MP_REORDER] )
+	   mp_gap_since = now;
+	return len;
+     }
+
+     if( d >= MP_REORDER ){
+	/* Unproven sequence numbers don't move the window */
+	if( cand )
+	   return 0;
+	/* Flush the buffer up to the new frame's window */
+	if( (int)(seq - MP_REORDER + 1 - mp_skip_to) > 0 )
+	   mp_skip_to = seq - MP_REORDER + 1;
+	return 0;
+     }
+
+     slot = seq % MP_REORDER;
+     if( !len )
+	return 0;
+     if( mp_rlen[slot] ){
+	/* A frame from a known address replaces an unproven one */
+	if( cand || !mp_rcand[slot] )
+	   return 0;
+     } else {
+	if( !mp_nbuf )
+	   mp_gap_since = now;
+	mp_nbuf++;
+     }
+     memcpy(mp_rbuf + slot * MP_SLOT, buf, len);
+     mp_rlen[slot] = len;
+     mp_rcand[slot] = cand;
+     if( cand )
+	mp_raddr[slot] = *from;
+     return 0;
+}
+
+/*
+ * Receive one datagram from fd.
+ * Returns -1 if there is nothing to read, 0 if the datagram was
+ * consumed here and the frame length (or flags) otherwise.
+ */
+static int mp_recv(int fd, char *buf, unsigned long now)
+{
+     unsigned char hdr[MP_HDR];
+     struct sockaddr_in from;
+     struct mp_path *p;
+     struct msghdr msg;
+     struct iovec iv[2];
+     unsigned int stamp;
+     int rlen, idx;
+
+     iv[0].iov_base = hdr;
+     iv[0].iov_len  = MP_HDR;
+     iv[1].iov_base = buf;
+     iv[1].iov_len  = VTUN_FRAME_SIZE + VTUN_FRAME_OVERHEAD;
+
+     memset(&msg, 0, sizeof(msg));
+     msg.msg_name = &from;
+     msg.msg_namelen = sizeof(from);
+     msg.msg_iov = iv;
+     msg.msg_iovlen = 2;
+
+     while( (rlen = recvmsg(fd, &msg, MSG_DONTWAIT)) < 0 ){
+	if( errno != EINTR )
+	   return -1;
+     }
+     if( rlen < 3 )
+	return 0;
+
+     idx = hdr[0] & MP_PATH_MASK;
+     if( idx >= mp_npaths )
+	return 0;
+     p = &mp_paths[idx];
+
+     if( vtun.svr && (!p->known ||
+		      from.sin_addr.s_addr != p->peer.sin_addr.s_addr ||
+		      from.sin_port != p->peer.sin_port) ){
+	/* Anybody can send from there. Probes are answered where they
+	 * came from, the path follows data frames if they decrypt once
+	 * they are in order, see mpath_proven(). */
+	switch( hdr[0] & MP_TYPE_MASK ){
+	   case MP_PROBE:
+	      if( rlen < 5 )
+		 return 0;
+	      hdr[0] = MP_REPLY | idx;
+	      hdr[5] = p->rx_loss;
+	      sendto(fd, hdr, 6, 0, (struct sockaddr *) &from, sizeof(from));
+	      return 0;
+
+	   case MP_DATA:
+	      if( rlen <= MP_HDR )
+		 return 0;
+	      return mp_data(((unsigned int)hdr[3] << 24) | (hdr[4] << 16) |
+			     (hdr[5] << 8) | hdr[6], buf, rlen - MP_HDR, now,
+			     p, &from);
+	}
+	return 0;
+     }
+     if( !vtun.svr && p->fd != fd )
+	return 0;
+     p->rx_frames++;
+
+     switch( hdr[0] & MP_TYPE_MASK ){
+	case MP_DATA:
+	   if( rlen < MP_HDR )
+	      return 0;
+	   mp_rx_account(p, (hdr[1] << 8) | hdr[2]);
+	   return mp_data(((unsigned int)hdr[3] << 24) | (hdr[4] << 16) |
+			  (hdr[5] << 8) | hdr[6], buf, rlen - MP_HDR, now,
+			  NULL, NULL);
+
+	case MP_CTRL:
+	   return ((hdr[1] << 8) | hdr[2]) & ~VTUN_FSIZE_MASK;
+
+	case MP_PROBE:
+	   if( rlen < 5 )
+	      return 0;
+	   hdr[0] = MP_REPLY | idx;
+	   hdr[5] = p->rx_loss;
+	   mp_send(p, hdr, 6, NULL, 0);
+	   return 0;
+
+	case MP_REPLY:
+	   if( rlen < 6 )
+	      return 0;
+	   stamp = ((unsigned int)hdr[1] << 24) | (hdr[2] << 16) |
+		   (hdr[3] << 8) | hdr[4];
+	   stamp = (unsigned int) now - stamp;
+	   if( !stamp )
+	      stamp = 1;
+	   p->srtt = p->srtt ? (p->srtt * 7 + stamp) / 8 : stamp;
+	   p->loss = hdr[5];
+	   p->last_ack = now;
+	   if( !p->up ){
+	      vtun_syslog(LOG_INFO,"Path %d is up", idx);
+	      p->up = 1;
+	   }
+	   return 0;
+     }
+     return 0;
+}
+
+int mpath_read(int fd, char *buf)
+{
+     unsigned long now = mp_now();
+     int i, len;
+
+     mp_cand = NULL;
+
+     if( (len = mp_release(buf, now)) > 0 )
+	return len;
+
+     for(i = 0; i < mp_nfds; i++){
+	fd = mp_fds[(mp_rr + i) % mp_nfds];
+	while( (len = mp_recv(fd, buf, now)) >= 0 )
+	   if( len ){
+	      mp_rr = (mp_rr + i + 1) % mp_nfds;
+	      return len;
+	   }
+     }
+
+     if( (len = mp_release(buf, now)) > 0 )
+	return len;
+
+     /* Nothing for the linker, treated as an ignored echo reply */
+     return VTUN_ECHO_REP;
+}
+
+/*
+ * Called by the linker before it waits. Adds the path sockets to fds,
+ * sends due probes and shortens tv to the next path event.
+ */
+void mpath_fdset(fd_set *fds, int *maxfd, struct timeval *tv)
+{
+     unsigned long now = mp_now(), wait, t;
+     struct mp_path *p;
+     int i;
+
+     for(i = 0; i < mp_nfds; i++){
+	FD_SET(mp_fds[i], fds);
+	if( mp_fds[i] >= *maxfd )
+	   *maxfd = mp_fds[i] + 1;
+     }
+
+     wait = tv->tv_sec * 1000UL + tv->tv_usec / 1000;
+     for(i = 0; i < mp_npaths; i++){
+	p = &mp_paths[i];
+	if( !p->known )
+	   continue;
+	if( p->up && !mp_alive(p, now) ){
+	   vtun_syslog(LOG_INFO,"Path %d is down", i);
+	   p->up = 0;
+	}
+	if( now - p->last_probe >= MP_PROBE_IVAL )
+	   mp_probe(p, now);
+	t = p->last_probe + MP_PROBE_IVAL - now;
+	if( t < wait )
+	   wait = t;
+     }
+
+     if( mp_releasable(now) )
+	wait = 0;
+     else if( mp_nbuf ){
+	t = mp_gap_since + mp_hold_time(now);
+	t = t > now ? t - now : 0;
+	if( t < wait )
+	   wait = t;
+     }
+
+     tv->tv_sec  = wait / 1000;
+     tv->tv_usec = (wait % 1000) * 1000;
+}
+
+/* Did the last frame of mpath_read() come from an unproven address */
+int mpath_unproven(void)
+{
+     return mp_cand != NULL;
+}
+
+/* That frame decrypted, move its path to the address */
+void mpath_proven(void)
+{
+     struct mp_path *p = mp_cand;
+
+     if( !p )
+	return;
+     mp_cand = NULL;
+
+     p->peer = mp_cand_addr;
+     if( !p->known ){
+	p->known = 1;
+	vtun_syslog(LOG_INFO,"Path %d from %s:%d", (int)(p - mp_paths),
+		    inet_ntoa(p->peer.sin_addr), ntohs(p->peer.sin_port));
+     } else
+	vtun_syslog(LOG_INFO,"Path %d moved to %s:%d", (int)(p - mp_paths),
+		    inet_ntoa(p->peer.sin_addr), ntohs(p->peer.sin_port));
+     p->rx_frames++;
+}
+
+/* Is there anything for mpath_read() */
+int mpath_ready(fd_set *fds)
+{
+     int i;
+
+     for(i = 0; i < mp_nfds; i++)
+	if( FD_ISSET(mp_fds[i], fds) )
+	   return 1;
+     return mp_releasable(mp_now());
+}
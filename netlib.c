@@ -146,8 +146,37 @@ int udp_session(struct vtun_host *host)
 {
      struct sockaddr_in saddr; 
      short port;
-     int s,opt;
+     socklen_t len;
+     int s,opt,type;
      extern int is_rmt_fd_connected;
+     extern unsigned int udp_session_id;
+
+     /* Session was set up over UDP, the socket is connected already */
+     len = sizeof(type);
+     if( !getsockopt(host->rmt_fd,SOL_SOCKET,SO_TYPE,&type,&len) && type == SOCK_DGRAM ){
+        len = sizeof(saddr);
+        if( getsockname(host->rmt_fd,(struct sockaddr *)&saddr,&len) ){
+           vtun_syslog(LOG_ERR,"Can't get socket name");
+           return -1;
+        }
+        host->sopt.lport = ntohs(saddr.sin_port);
+
+        len = sizeof(saddr);
+        if( getpeername(host->rmt_fd,(struct sockaddr *)&saddr,&len) ){
+           /* Shared socket of the event server, it addresses the peer itself */
+           if( errno == ENOTCONN && host->sid )
+              return host->rmt_fd;
+           vtun_syslog(LOG_ERR,"Can't get peer name");
+           return -1;
+        }
+        host->sopt.rport = ntohs(saddr.sin_port);
+        is_rmt_fd_connected=1;
+        udp_session_id = host->sid;
+
+        if( (host->flags & VTUN_MPATH) && mpath_session(host, &saddr) < 0 )
+           return -1;
+        return host->rmt_fd;
+     }
 
      if( (s=socket(AF_INET,SOCK_DGRAM,0))== -1 ){
         vtun_syslog(LOG_ERR,"Can't create socket");
@@ -164,8 +193,8 @@ int udp_session(struct vtun_host *host)
         return -1;
      }
 
-     opt = sizeof(saddr);
-     if( getsockname(s,(struct sockaddr *)&saddr,&opt) ){
+     len = sizeof(saddr);
+     if( getsockname(s,(struct sockaddr *)&saddr,&len) ){
         vtun_syslog(LOG_ERR,"Can't get socket name");
         return -1;
      }
@@ -184,8 +213,8 @@ int udp_session(struct vtun_host *host)
         return -1;
      }
 
-     opt = sizeof(saddr);
-     if( getpeername(host->rmt_fd,(struct sockaddr *)&saddr,&opt) ){
+     len = sizeof(saddr);
+     if( getpeername(host->rmt_fd,(struct sockaddr *)&saddr,&len) ){
         vtun_syslog(LOG_ERR,"Can't get peer name");
         return -1;
      }
@@ -209,10 +238,16 @@ int udp_session(struct vtun_host *host)
      
      host->sopt.rport = htons(port);
 
+     /* Frames to the server's shared socket carry our ID */
+     udp_session_id = host->sid;
+
      /* Close TCP socket and replace with UDP socket */	
      close(host->rmt_fd); 
      host->rmt_fd = s;	
 
+     if( (host->flags & VTUN_MPATH) && mpath_session(host, &saddr) < 0 )
+        return -1;
+
      vtun_syslog(LOG_INFO,"UDP connection initialized");
      return s;
 }
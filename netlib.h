@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -40,4 +41,18 @@ int local_addr(struct sockaddr_in *addr, struct vtun_host *host, int con);
 int server_addr(struct sockaddr_in *addr, struct vtun_host *host);
 int generic_addr(struct sockaddr_in *addr, struct vtun_addr *vaddr);
 
+/* Interface configuration over rtnetlink */
+int nl_cmd(char *dev, char *args);
+int nl_flush(void);
+int nl_link_watch(void);
+int nl_link_wait(int fd, pid_t pid, int timeout);
+
+/* Multipath UDP */
+int  mpath_session(struct vtun_host *host, struct sockaddr_in *peer);
+void mpath_close(void);
+void mpath_fdset(fd_set *fds, int *maxfd, struct timeval *tv);
+int  mpath_ready(fd_set *fds);
+int  mpath_unproven(void);
+void mpath_proven(void);
+
 #endif /* _VTUN_NETDEV_H */
@@ -0,0 +1,453 @@
+/*
+    VTun - Virtual Tunnel over TCP/IP network.
+
+    Copyright (C) 1998-2008  Maxim Krasnyansky <max_mk@yahoo.com>
+
+    VTun has been derived from VPPP package by Maxim Krasnyansky.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+/*
+ * Interface configuration over rtnetlink, without running ifconfig,
+ * route or ip for every command.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <poll.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "vtun.h"
+#include "lib.h"
+#include "netlib.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * Commands follow ip(8), the device is the session's one
+ * unless 'dev' is given:
+ *   link set [dev D] [up|down] [mtu N]
+ *   addr add|del A[/N] [peer P[/N]] [dev D]
+ *   route add|del|replace P[/N]|default [via G] [metric M] [dev D]
+ * Commands are queued, nl_flush() sends them in one message
+ * and waits for the answers.
+ */
+#define NL_BUF     8192
+#define NL_MSG_MAX 256		/* Longest message of one command */
+#define NL_CMDS    (NL_BUF / NLMSG_SPACE(sizeof(struct ifinfomsg)))
+#define NL_ARGS    16
+
+static struct {
+   char  buf[NL_BUF];
+   int   len;
+   int   n;
+   char *cmd[NL_CMDS];		/* Text of the queued commands for the log */
+} nl;
+
+struct nl_addr {
+   int           family;
+   int           bits;
+   unsigned char a[16];
+};
+
+static int nl_parse_addr(const char *str, struct nl_addr *addr)
+{
+   char tmp[64], *p;
+   int max;
+
+   snprintf(tmp, sizeof tmp, "%s", str);
+   addr->bits = -1;
+   if( (p = strchr(tmp, '/')) ){
+      *p++ = '\0';
+      addr->bits = atoi(p);
+   }
+   if( inet_pton(AF_INET, tmp, addr->a) == 1 )
+      addr->family = AF_INET;
+   else if( inet_pton(AF_INET6, tmp, addr->a) == 1 )
+      addr->family = AF_INET6;
+   else
+      return -1;
+
+   max = addr->family == AF_INET ? 32 : 128;
+   if( addr->bits < 0 )
+      addr->bits = max;
+   return addr->bits > max ? -1 : 0;
+}
+
+static int nl_alen(int family)
+{
+   return family == AF_INET ? 4 : 16;
+}
+
+/* Start the message of a command, it's queued by nl_attr() calls */
+static struct nlmsghdr *nl_msg(int type, int flags, const void *body, int len)
+{
+   struct nlmsghdr *h;
+
+   if( nl.len + NL_MSG_MAX > NL_BUF || nl.n == NL_CMDS )
+      nl_flush();
+
+   h = (struct nlmsghdr *)(nl.buf + nl.len);
+   memset(h, 0, NL_MSG_MAX);
+   h->nlmsg_len   = NLMSG_LENGTH(len);
+   h->nlmsg_type  = type;
+   h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+   h->nlmsg_seq   = nl.n + 1;
+   memcpy(NLMSG_DATA(h), body, len);
+
+   return h;
+}
+
+static void nl_attr(struct nlmsghdr *h, int type, const void *data, int len)
+{
+   struct rtattr *rta = (struct rtattr *)((char *)h + NLMSG_ALIGN(h->nlmsg_len));
+
+   rta->rta_type = type;
+   rta->rta_len  = RTA_LENGTH(len);
+   memcpy(RTA_DATA(rta), data, len);
+   h->nlmsg_len = NLMSG_ALIGN(h->nlmsg_len) + RTA_SPACE(len);
+}
+
+/* Message is complete, keep it in the batch */
+static void nl_queue(struct nlmsghdr *h, const char *args)
+{
+   nl.cmd[nl.n++] = strdup(args);
+   nl.len += NLMSG_ALIGN(h->nlmsg_len);
+}
+
+static int nl_link(int ifindex, char **argv)
+{
+   struct ifinfomsg ifi;
+   struct nlmsghdr *h;
+   unsigned int mtu = 0;
+
+   memset(&ifi, 0, sizeof ifi);
+   ifi.ifi_family = AF_UNSPEC;
+   ifi.ifi_index  = ifindex;
+
+   for( ; *argv; argv++){
+      if( !strcmp(*argv, "up") ){
+         ifi.ifi_change |= IFF_UP;
+	 ifi.ifi_flags  |= IFF_UP;
+      } else if( !strcmp(*argv, "down") ){
+         ifi.ifi_change |= IFF_UP;
+	 ifi.ifi_flags  &= ~IFF_UP;
+      } else if( !strcmp(*argv, "mtu") && argv[1] ){
+         mtu = strtoul(*++argv, NULL, 10);
+      } else
+         return -1;
+   }
+
+   h = nl_msg(RTM_NEWLINK, 0, &ifi, sizeof ifi);
+   if( mtu )
+      nl_attr(h, IFLA_MTU, &mtu, sizeof mtu);
+   return 0;
+}
+
+static int nl_addr(int ifindex, int del, char **argv)
+{
+   struct ifaddrmsg ifa;
+   struct nlmsghdr *h;
+   struct nl_addr local, peer;
+   int has_peer = 0;
+
+   if( !*argv || nl_parse_addr(*argv++, &local) )
+      return -1;
+   for( ; *argv; argv++){
+      if( !strcmp(*argv, "peer") && argv[1] && !nl_parse_addr(argv[1], &peer) &&
+	  peer.family == local.family ){
+         has_peer = 1;
+	 argv++;
+      } else
+         return -1;
+   }
+
+   memset(&ifa, 0, sizeof ifa);
+   ifa.ifa_family    = local.family;
+   ifa.ifa_prefixlen = has_peer ? peer.bits : local.bits;
+   ifa.ifa_index     = ifindex;
+
+   h = nl_msg(del ? RTM_DELADDR : RTM_NEWADDR,
+	      del ? 0 : NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof ifa);
+   nl_attr(h, IFA_LOCAL, local.a, nl_alen(local.family));
+   nl_attr(h, IFA_ADDRESS, has_peer ? peer.a : local.a, nl_alen(local.family));
+   return 0;
+}
+
+static int nl_route(int ifindex, char *verb, char **argv)
+{
+   struct rtmsg rtm;
+   struct nlmsghdr *h;
+   struct nl_addr dst, via;
+   unsigned int metric = 0;
+   int has_via = 0, flags;
+
+   if( !strcmp(verb, "add") )
+      flags = NLM_F_CREATE | NLM_F_EXCL;
+   else if( !strcmp(verb, "replace") )
+      flags = NLM_F_CREATE | NLM_F_REPLACE;
+   else if( !strcmp(verb, "del") )
+      flags = 0;
+   else
+      return -1;
+
+   if( !*argv )
+      return -1;
+   if( !strcmp(*argv, "default") ){
+      memset(&dst, 0, sizeof dst);
+      dst.family = AF_UNSPEC;
+   } else if( nl_parse_addr(*argv, &dst) )
+      return -1;
+   for( argv++; *argv; argv++){
+      if( !strcmp(*argv, "via") && argv[1] && !nl_parse_addr(argv[1], &via) ){
+         has_via = 1;
+	 argv++;
+      } else if( !strcmp(*argv, "metric") && argv[1] ){
+         metric = strtoul(*++argv, NULL, 10);
+      } else
+         return -1;
+   }
+   if( dst.family == AF_UNSPEC )
+      dst.family = has_via ? via.family : AF_INET;
+   if( has_via && via.family != dst.family )
+      return -1;
+
+   memset(&rtm, 0, sizeof rtm);
+   rtm.rtm_family   = dst.family;
+   rtm.rtm_dst_len  = dst.bits;
+   rtm.rtm_table    = RT_TABLE_MAIN;
+   if( flags ){
+      rtm.rtm_protocol = RTPROT_BOOT;
+      rtm.rtm_scope    = has_via ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+      rtm.rtm_type     = RTN_UNICAST;
+   } else
+      rtm.rtm_scope    = RT_SCOPE_NOWHERE;
+
+   h = nl_msg(RTM_NEWROUTE, flags, &rtm, sizeof rtm);
+   if( !flags )
+      h->nlmsg_type = RTM_DELROUTE;
+   if( dst.bits )
+      nl_attr(h, RTA_DST, dst.a, nl_alen(dst.family));
+   if( has_via )
+      nl_attr(h, RTA_GATEWAY, via.a, nl_alen(via.family));
+   if( metric )
+      nl_attr(h, RTA_PRIORITY, &metric, sizeof metric);
+   nl_attr(h, RTA_OIF, &ifindex, sizeof ifindex);
+   return 0;
+}
+
+/*
+ * Queue the command for the device.
+ * Returns -1 if it is malformed.
+ */
+int nl_cmd(char *dev, char *args)
+{
+   char tmp[VTUN_MESG_SIZE], *argv[NL_ARGS], **arg;
+   int argc = 0, ifindex, ret = -1;
+
+   snprintf(tmp, sizeof tmp, "%s", args);
+   for(argv[argc] = strtok(tmp, " \t"); argv[argc] && argc < NL_ARGS - 1; )
+      argv[++argc] = strtok(NULL, " \t");
+   argv[argc] = NULL;
+
+   /* Device may be anywhere after the verb */
+   for(arg = argv; *arg; arg++){
+      if( !strcmp(*arg, "dev") && arg[1] ){
+         dev = arg[1];
+	 memmove(arg, arg + 2, (argc - (arg - argv) - 1) * sizeof(char *));
+	 argc -= 2;
+	 break;
+      }
+   }
+
+   if( argc < 2 ){
+      vtun_syslog(LOG_ERR, "Command [netlink %s] is incomplete", args);
+      return -1;
+   }
+   if( !dev || !(ifindex = if_nametoindex(dev)) ){
+      vtun_syslog(LOG_ERR, "Command [netlink %s] no device %s", args, dev ? dev : "");
+      return -1;
+   }
+
+   if( !strcmp(argv[0], "link") && !strcmp(argv[1], "set") )
+      ret = nl_link(ifindex, argv + 2);
+   else if( !strncmp(argv[0], "addr", 4) && !strcmp(argv[1], "add") )
+      ret = nl_addr(ifindex, 0, argv + 2);
+   else if( !strncmp(argv[0], "addr", 4) && !strcmp(argv[1], "del") )
+      ret = nl_addr(ifindex, 1, argv + 2);
+   else if( !strcmp(argv[0], "route") )
+      ret = nl_route(ifindex, argv[1], argv + 2);
+
+   if( ret < 0 ){
+      vtun_syslog(LOG_ERR, "Command [netlink %s] is malformed", args);
+      return -1;
+   }
+   nl_queue((struct nlmsghdr *)(nl.buf + nl.len), args);
+   return 0;
+}
+
+/*
+ * Send the queued commands and wait for the kernel to answer them.
+ * Returns -1 if any of them failed.
+ */
+int nl_flush(void)
+{
+   struct sockaddr_nl sa;
+   struct nlmsghdr *h;
+   struct nlmsgerr *err;
+   struct timeval tv = { VTUN_TIMEOUT, 0 };
+   char buf[NL_BUF];
+   int fd, len, left = nl.n, ret = 0, i;
+
+   if( !nl.n )
+      return 0;
+
+   memset(&sa, 0, sizeof sa);
+   sa.nl_family = AF_NETLINK;
+   if( (fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0 ||
+       sendto(fd, nl.buf, nl.len, 0, (struct sockaddr *)&sa, sizeof sa) != nl.len ){
+      vtun_syslog(LOG_ERR, "Can't send netlink commands. %s(%d)", strerror(errno), errno);
+      ret = -1;
+      left = 0;
+   } else
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+   while( left > 0 ){
+      if( (len = recv(fd, buf, sizeof buf, 0)) < 0 ){
+         if( errno == EINTR )
+	    continue;
+         vtun_syslog(LOG_ERR, "No answer to netlink commands. %s(%d)", strerror(errno), errno);
+	 ret = -1;
+	 break;
+      }
+      for(h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)){
+         if( h->nlmsg_type != NLMSG_ERROR )
+	    continue;
+	 err = NLMSG_DATA(h);
+	 i = h->nlmsg_seq - 1;
+	 if( err->error && i >= 0 && i < nl.n ){
+	    vtun_syslog(LOG_INFO, "Command [netlink %s] error %s", nl.cmd[i], strerror(-err->error));
+	    ret = -1;
+	 }
+	 left--;
+      }
+   }
+   if( fd >= 0 )
+      close(fd);
+
+   for(i = 0; i < nl.n; i++)
+      free(nl.cmd[i]);
+   nl.n = nl.len = 0;
+
+   return ret;
+}
+
+/*
+ * Socket which hears about links going up. It is opened before
+ * the program is started, so its event can't be missed.
+ */
+int nl_link_watch(void)
+{
+   struct sockaddr_nl sa;
+   int fd;
+
+   memset(&sa, 0, sizeof sa);
+   sa.nl_family = AF_NETLINK;
+   sa.nl_groups = RTMGRP_LINK;
+   if( (fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0 )
+      return -1;
+   if( bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 ){
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/*
+ * Wait up to timeout seconds for a PPP link to go up, or for
+ * the program pid which brings it up to exit. Closes fd.
+ * Returns 0 if the link is up.
+ */
+int nl_link_wait(int fd, pid_t pid, int timeout)
+{
+   struct pollfd pfd;
+   struct nlmsghdr *h;
+   struct ifinfomsg *ifi;
+   char buf[NL_BUF];
+   time_t end = time(NULL) + timeout;
+   int len, ret = -1;
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   while( ret && time(NULL) < end ){
+      /* Program is checked once a second */
+      if( poll(&pfd, 1, 1000) <= 0 ){
+         if( waitpid(pid, NULL, WNOHANG) == pid )
+	    break;
+	 continue;
+      }
+      if( (len = recv(fd, buf, sizeof buf, 0)) < 0 ){
+         if( errno == EINTR || errno == ENOBUFS )
+	    continue;
+	 break;
+      }
+      for(h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)){
+         if( h->nlmsg_type != RTM_NEWLINK )
+	    continue;
+	 ifi = NLMSG_DATA(h);
+	 if( ifi->ifi_type == ARPHRD_PPP &&
+	     (ifi->ifi_flags & IFF_UP) && (ifi->ifi_change & IFF_UP) )
+	    ret = 0;
+      }
+   }
+   close(fd);
+
+   return ret;
+}
+#else
+int nl_cmd(char *dev, char *args)
+{
+   vtun_syslog(LOG_ERR, "Command [netlink %s] is not supported on this system", args);
+   return -1;
+}
+
+int nl_flush(void)
+{
+   return 0;
+}
+
+int nl_link_watch(void)
+{
+   return -1;
+}
+
+int nl_link_wait(int fd, pid_t pid, int timeout)
+{
+   return -1;
+}
+#endif
@@ -29,7 +29,11 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -43,6 +47,10 @@
 #include <arpa/inet.h>
 #endif
 
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+
 #include <sodium.h>
 
 #include "vtun.h"
@@ -53,51 +61,39 @@
 #include "compat.h"
 #include "netlib.h"
 
-static volatile sig_atomic_t server_term;
+static volatile sig_atomic_t server_term, server_hup;
 static void sig_term(int sig)
 {
      vtun_syslog(LOG_INFO,"Terminated");
      server_term = VTUN_SIG_TERM;
 }
 
-static void connection(int sock)
+static void sig_hup(int sig)
 {
-     struct sockaddr_in my_addr, cl_addr;
-     struct vtun_host *host;
-     struct sigaction sa;
-     char *ip;
-     int opt;
-
-     randombytes_stir();
-     opt = sizeof(struct sockaddr_in);
-     if( getpeername(sock, (struct sockaddr *) &cl_addr, &opt) ){
-        vtun_syslog(LOG_ERR, "Can't get peer name");
-        exit(1);
-     }
-     opt = sizeof(struct sockaddr_in);
-     if( getsockname(sock, (struct sockaddr *) &my_addr, &opt) < 0 ){
-        vtun_syslog(LOG_ERR, "Can't get local socket address");
-        exit(1);
-     }
-
-     ip = strdup(inet_ntoa(cl_addr.sin_addr));
+     server_hup = 1;
+}
 
-     io_init();
+/* Run the session of the authenticated host, NULL if it was denied */
+static void session(struct vtun_host *host, int sock,
+		    struct sockaddr_in *my_addr, struct sockaddr_in *cl_addr)
+{
+     struct sigaction sa;
+     char *ip = strdup(inet_ntoa(cl_addr->sin_addr));
 
-     if( (host=auth_server(sock)) ){
+     if( host ){
         memset(&sa, 0, sizeof sa);
         sa.sa_handler=SIG_IGN;
 	sa.sa_flags=SA_NOCLDWAIT;;
         sigaction(SIGHUP,&sa,NULL);
 
 	vtun_syslog(LOG_INFO,"Session %s[%s:%d] opened", host->host, ip,
-					ntohs(cl_addr.sin_port) );
+					ntohs(cl_addr->sin_port) );
         host->rmt_fd = sock;
 
-        host->sopt.laddr = strdup(inet_ntoa(my_addr.sin_addr));
-        host->sopt.lport = vtun.bind_addr.port;
+        host->sopt.laddr = strdup(inet_ntoa(my_addr->sin_addr));
+        host->sopt.lport = ntohs(my_addr->sin_port);
         host->sopt.raddr = strdup(ip);
-	host->sopt.rport = ntohs(cl_addr.sin_port);
+	host->sopt.rport = ntohs(cl_addr->sin_port);
 
 	/* Start tunnel */
 	tunnel(host);
@@ -108,19 +104,74 @@ static void connection(int sock)
 	unlock_host(host);
      } else {
         vtun_syslog(LOG_INFO,"Denied connection from %s:%d", ip,
-					ntohs(cl_addr.sin_port) );
+					ntohs(cl_addr->sin_port) );
      }
      close(sock);
 
      exit(0);
 }
 
-#ifdef HAVE_WORKING_FORK
-static void listener(void)
+static void connection(int sock)
 {
-     struct sigaction sa;
      struct sockaddr_in my_addr, cl_addr;
-     int s, s1, opt;
+     socklen_t opt;
+
+     randombytes_stir();
+     opt = sizeof(struct sockaddr_in);
+     if( getpeername(sock, (struct sockaddr *) &cl_addr, &opt) ){
+        vtun_syslog(LOG_ERR, "Can't get peer name");
+        exit(1);
+     }
+     opt = sizeof(struct sockaddr_in);
+     if( getsockname(sock, (struct sockaddr *) &my_addr, &opt) < 0 ){
+        vtun_syslog(LOG_ERR, "Can't get local socket address");
+        exit(1);
+     }
+
+     io_init();
+
+     session(auth_server(sock), sock, &my_addr, &cl_addr);
+}
+
+/* 
+ * Session of a client which came over UDP. It gets its own
+ * socket connected to the client, the hello is in pkt.
+ */
+static void udp_connection(struct sockaddr_in *cl_addr, char *pkt, int len)
+{
+     struct sockaddr_in my_addr;
+     socklen_t opt;
+     int s;
+
+     randombytes_stir();
+     io_init();
+
+     if( generic_addr(&my_addr, &vtun.bind_addr) < 0 )
+        exit(1);
+     my_addr.sin_port = 0;
+     if( (s=socket(AF_INET,SOCK_DGRAM,0)) == -1 ||
+	 bind(s,(struct sockaddr *)&my_addr,sizeof(my_addr)) ||
+	 connect(s,(struct sockaddr *)cl_addr,sizeof(*cl_addr)) ){
+        vtun_syslog(LOG_ERR,"Can't create UDP socket for %s", inet_ntoa(cl_addr->sin_addr));
+	exit(1);
+     }
+     opt = sizeof(struct sockaddr_in);
+     if( getsockname(s, (struct sockaddr *) &my_addr, &opt) < 0 ){
+        vtun_syslog(LOG_ERR, "Can't get local socket address");
+        exit(1);
+     }
+
+     session(auth_server_udp(s, pkt, len), s, &my_addr, cl_addr);
+}
+
+/* Create listening socket of the server.
+ * With reuseport each worker binds its own socket and
+ * the kernel spreads connections between them.
+ */
+static int listen_socket(int reuseport)
+{
+     struct sockaddr_in my_addr;
+     int s, opt;
 
      memset(&my_addr, 0, sizeof(my_addr));
      my_addr.sin_family = AF_INET;
@@ -138,49 +189,443 @@ static void listener(void)
 
      opt=1;
      setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+     if( reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) ){
+	vtun_syslog(LOG_ERR,"Can't set SO_REUSEPORT. %s(%d)", strerror(errno), errno);
+	exit(1);
+     }
+#endif
 
      if( bind(s,(struct sockaddr *)&my_addr,sizeof(my_addr)) ){
 	      vtun_syslog(LOG_ERR,"Can't bind to the socket %s", inet_ntoa(my_addr.sin_addr));
 	      exit(1);
      }
 
-     if( listen(s, 10) ){
+#ifdef TCP_FASTOPEN
+     /* Accept the client's first message with its SYN */
+     opt = vtun.backlog;
+     if( vtun.fastopen > 0 &&
+	 setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) )
+	vtun_syslog(LOG_ERR,"Can't enable TCP Fast Open. %s(%d)", strerror(errno), errno);
+#endif
+
+     if( listen(s, vtun.backlog) ){
 	vtun_syslog(LOG_ERR,"Can't listen on the socket");
 	exit(1);
      }
 
+     return s;
+}
+
+/* UDP socket on the server's port for the datagram handshake */
+static int udp_listen_socket(void)
+{
+     struct sockaddr_in my_addr;
+     int s, opt;
+
+     if( generic_addr(&my_addr, &vtun.bind_addr) < 0 ||
+	 (s=socket(AF_INET,SOCK_DGRAM,0)) == -1 )
+	return -1;
+
+     opt=1;
+     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+     if( bind(s,(struct sockaddr *)&my_addr,sizeof(my_addr)) ){
+	vtun_syslog(LOG_ERR,"Can't bind to the UDP socket %s", inet_ntoa(my_addr.sin_addr));
+	close(s);
+	return -1;
+     }
+     return s;
+}
+
+/* 
+ * UDP sockets the event servers run their UDP sessions on, one per
+ * worker. They share the server's port and the kernel steers each
+ * datagram to the worker the session ID in front of it belongs to.
+ * Without steering every worker gets a port of its own.
+ */
+static void mux_sockets(int n, int *socks)
+{
+     struct sockaddr_in my_addr;
+     int i, opt = 1, steer = 1;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+     /* Socket index is the session ID modulo the number of workers */
+     struct sock_filter code[] = {
+	{ BPF_LD  | BPF_W   | BPF_ABS, 0, 0, 0 },
+	{ BPF_ALU | BPF_MOD | BPF_K,   0, 0, n },
+	{ BPF_RET | BPF_A,             0, 0, 0 },
+     };
+     struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+#else
+     steer = 0;
+#endif
+
+     for(i = 0; i < n; i++)
+        socks[i] = -1;
+     if( !vtun.udpmux )
+        return;
+
+     for(i = 0; i < n; i++){
+        if( generic_addr(&my_addr, &vtun.bind_addr) < 0 ||
+	    (socks[i] = socket(AF_INET,SOCK_DGRAM,0)) == -1 )
+	   break;
+	fcntl(socks[i], F_SETFD, FD_CLOEXEC);
+	setsockopt(socks[i], SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	/* Group keeps the order of binding, the first socket
+	 * holds the program for all of them */
+	if( n > 1 && steer &&
+	    (setsockopt(socks[i], SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) ||
+	     (!i && setsockopt(socks[i], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			       &prog, sizeof(prog)))) ){
+	   vtun_syslog(LOG_ERR,"Can't steer UDP sessions to workers. %s(%d)",
+		       strerror(errno), errno);
+	   steer = 0;
+	}
+#endif
+	if( n > 1 && !steer )
+	   my_addr.sin_port = 0;
+
+	if( bind(socks[i],(struct sockaddr *)&my_addr,sizeof(my_addr)) ){
+	   vtun_syslog(LOG_ERR,"Can't bind to the UDP socket %s", inet_ntoa(my_addr.sin_addr));
+	   close(socks[i]);
+	   socks[i] = -1;
+	   break;
+	}
+     }
+}
+
+#ifdef HAVE_WORKING_FORK
+/* 
+ * Accepts per second from one address. Addresses which
+ * hash to the same slot share the limit.
+ */
+#define RATE_BITS  10
+#define RATE_SLOTS (1 << RATE_BITS)
+static struct {
+     time_t tm;
+     int    count;
+} rate[RATE_SLOTS];
+
+static int rate_limited(struct sockaddr_in *addr)
+{
+     unsigned int i = (ntohl(addr->sin_addr.s_addr) * 2654435761U) >> (32 - RATE_BITS);
+     time_t now;
+
+     if( vtun.ratelimit <= 0 )
+        return 0;
+     if( rate[i].tm != (now = time(NULL)) ){
+        rate[i].tm = now;
+	rate[i].count = 0;
+     }
+     return ++rate[i].count > vtun.ratelimit;
+}
+
+/* 
+ * Connections greeted by the listener which haven't sent their
+ * first message yet. They get a process only when it passes
+ * auth_gate(). One address holds at most GATE_PER_ADDR of them,
+ * when the table is full the address which holds the most loses
+ * its oldest one.
+ */
+#define GATE_MAX 128
+#define GATE_PER_ADDR 4
+static struct {
+     int    fd;
+     time_t tm;
+     struct in_addr addr;
+} gates[GATE_MAX];
+
+/* Session processes don't keep connections of other clients */
+static void gates_close(void)
+{
+     int i;
+
+     for(i = 0; i < GATE_MAX; i++)
+        if( gates[i].fd >= 0 )
+	   close(gates[i].fd);
+}
+
+/* Oldest gate of the address, count is set to the number of its gates */
+static int gate_oldest(struct in_addr addr, int *count)
+{
+     int i, old = -1;
+
+     for(i = *count = 0; i < GATE_MAX; i++){
+        if( gates[i].fd < 0 || gates[i].addr.s_addr != addr.s_addr )
+	   continue;
+	(*count)++;
+	if( old < 0 || gates[i].tm < gates[old].tm )
+	   old = i;
+     }
+     return old;
+}
+
+static void gate_add(int fd, struct sockaddr_in *addr)
+{
+     int i, old, n, most = 0, slot = -1;
+
+     if( (old = gate_oldest(addr->sin_addr, &n)) >= 0 && n >= GATE_PER_ADDR )
+        slot = old;
+     for(i = 0; slot < 0 && i < GATE_MAX; i++)
+        if( gates[i].fd < 0 )
+	   slot = i;
+     if( slot < 0 ){
+        /* Table is full */
+	for(i = 0; i < GATE_MAX; i++)
+	   if( (old = gate_oldest(gates[i].addr, &n)) >= 0 && n > most ){
+	      most = n;
+	      slot = old;
+	   }
+     }
+     if( gates[slot].fd >= 0 )
+        close(gates[slot].fd);
+
+     auth_greet(fd);
+     gates[slot].fd = fd;
+     gates[slot].tm = time(NULL);
+     gates[slot].addr = addr->sin_addr;
+}
+
+/* Datagram on the UDP port, start a session for a valid hello */
+static void udp_request(int s, int u)
+{
+     struct sockaddr_in cl_addr;
+     char buf[VTUN_FRAME_SIZE];
+     socklen_t opt;
+     int len;
+
+     opt=sizeof(cl_addr);
+     if( (len=recvfrom(u,buf,sizeof(buf),MSG_DONTWAIT,(struct sockaddr *)&cl_addr,&opt)) <= 0 )
+	return;
+     if( !auth_udp_accept(u, &cl_addr, buf, len) || rate_limited(&cl_addr) )
+	return;
+
+     switch( fork() ){
+	case 0:
+	   close(s);
+	   close(u);
+	   gates_close();
+	   udp_connection(&cl_addr, buf, len);
+	   break;
+	case -1:
+	   vtun_syslog(LOG_ERR, "Couldn't fork()");
+	default:
+	   break;
+     }
+}
+
+/* Client's first message passed the gate, start its session */
+static void tcp_request(int s, int u, int s1)
+{
+     switch( fork() ){
+	case 0:
+	   close(s);
+	   if( u >= 0 )
+	      close(u);
+	   gates_close();
+	   connection(s1);
+	   break;
+	case -1:
+	   vtun_syslog(LOG_ERR, "Couldn't fork()");
+	default:
+	   close(s1);
+	   break;
+     }
+}
+
+static void listener(void)
+{
+     struct sigaction sa;
+     struct sockaddr_in cl_addr;
+     struct timeval tv;
+     fd_set fdset;
+     time_t now;
+     socklen_t opt;
+     int s, s1, u, i, fdmax, pending;
+
+     s = listen_socket(0);
+     u = udp_listen_socket();
+
      memset(&sa,0,sizeof(sa));
      sa.sa_flags = SA_NOCLDWAIT;
      sa.sa_handler=sig_term;
      sigaction(SIGTERM,&sa,NULL);
      sigaction(SIGINT,&sa,NULL);
-     server_term = 0;
+     sa.sa_handler=sig_hup;
+     sigaction(SIGHUP,&sa,NULL);
+     server_term = server_hup = 0;
+
+     for(i = 0; i < GATE_MAX; i++)
+        gates[i].fd = -1;
 
      set_title("waiting for connections on port %d", vtun.bind_addr.port);
 
      while( (!server_term) || (server_term == VTUN_SIG_HUP) ){
+	if( server_hup ){
+	   server_hup = 0;
+	   if( !read_config(vtun.cfg_file) )
+	      vtun_syslog(LOG_ERR,"No hosts defined");
+	}
+
+	FD_ZERO(&fdset);
+	FD_SET(s, &fdset);
+	if( u >= 0 )
+	   FD_SET(u, &fdset);
+	fdmax = max(s, u);
+	now = time(NULL);
+	for(i = pending = 0; i < GATE_MAX; i++){
+	   if( gates[i].fd < 0 )
+	      continue;
+	   if( now - gates[i].tm > vtun.timeout ){
+	      close(gates[i].fd);
+	      gates[i].fd = -1;
+	      continue;
+	   }
+	   FD_SET(gates[i].fd, &fdset);
+	   fdmax = max(fdmax, gates[i].fd);
+	   pending++;
+	}
+	/* Wake up to drop the clients which keep silent */
+	tv.tv_sec = 1; tv.tv_usec = 0;
+	if( select(fdmax + 1, &fdset, NULL, NULL, pending ? &tv : NULL) <= 0 )
+	   continue;
+	if( u >= 0 && FD_ISSET(u, &fdset) )
+	   udp_request(s, u);
+
+	for(i = 0; i < GATE_MAX; i++){
+	   if( gates[i].fd < 0 || !FD_ISSET(gates[i].fd, &fdset) )
+	      continue;
+	   switch( auth_gate(gates[i].fd) ){
+	      case 0:
+		 continue;
+	      case 1:
+		 s1 = gates[i].fd;
+		 gates[i].fd = -1;
+		 tcp_request(s, u, s1);
+		 break;
+	      default:
+		 close(gates[i].fd);
+		 gates[i].fd = -1;
+		 break;
+	   }
+	}
+
+	if( !FD_ISSET(s, &fdset) )
+	   continue;
+
         opt=sizeof(cl_addr);
 	if( (s1=accept(s,(struct sockaddr *)&cl_addr,&opt)) < 0 )
 	   continue;
+	if( rate_limited(&cl_addr) ){
+	   close(s1);
+	   continue;
+	}
+	gate_add(s1, &cl_addr);
+     }
+}
 
-	switch( fork() ){
-	   case 0:
-	      close(s);
-	      connection(s1);
-	      break;
-	   case -1:
-	      vtun_syslog(LOG_ERR, "Couldn't fork()");
-	   default:
-	      close(s1);
+/* Pre-forked event servers */
+
+static pid_t start_worker(int n, int sock, int usock)
+{
+     struct sigaction sa;
+     pid_t pid;
+
+     if( (pid = fork()) ){
+        if( pid < 0 )
+	   vtun_syslog(LOG_ERR, "Couldn't fork() worker %d", n);
+        return pid;
+     }
+
+     memset(&sa, 0, sizeof sa);
+     sa.sa_handler=SIG_IGN;
+     sa.sa_flags=SA_NOCLDWAIT;
+     sigaction(SIGCHLD,&sa,NULL);
+
+#ifdef SO_REUSEPORT
+     sock = listen_socket(1);
+#endif
+     event_server(sock, usock, n);
+     exit(0);
+}
+
+/* Run event server in every worker, restart the ones which die */
+static void workers(void)
+{
+     struct sigaction sa;
+     pid_t *pids, pid;
+     int i, n = vtun.workers, sock = -1, *usocks;
+
+     if( !(pids = calloc(n, sizeof(pid_t))) ||
+	 !(usocks = calloc(n, sizeof(int))) ){
+	vtun_syslog(LOG_ERR,"Can't allocate workers");
+	exit(1);
+     }
+
+#ifndef SO_REUSEPORT
+     /* Workers share one socket */
+     sock = listen_socket(0);
+#endif
+     /* Restarted workers get the same UDP socket, the kernel
+      * would renumber the sockets if one was closed */
+     mux_sockets(n, usocks);
+
+     memset(&sa,0,sizeof(sa));
+     sa.sa_handler=SIG_DFL;
+     sigaction(SIGCHLD,&sa,NULL);
+     sa.sa_handler=sig_term;
+     sigaction(SIGTERM,&sa,NULL);
+     sigaction(SIGINT,&sa,NULL);
+     sa.sa_handler=sig_hup;
+     sigaction(SIGHUP,&sa,NULL);
+     server_term = server_hup = 0;
+
+     for(i = 0; i < n; i++)
+        pids[i] = start_worker(i, sock, usocks[i]);
+
+     set_title("supervising %d workers on port %d", n, vtun.bind_addr.port);
+
+     while( !server_term ){
+	if( (pid = wait(NULL)) < 0 ){
+	   if( errno != EINTR )
+	      sleep(1);
+	   if( server_hup ){
+	      /* Workers reread config themselves */
+	      server_hup = 0;
+	      for(i = 0; i < n; i++)
+		 if( pids[i] > 0 )
+		    kill(pids[i], SIGHUP);
+	   }
+	}
+	for(i = 0; i < n; i++){
+	   if( pids[i] > 0 && pid != pids[i] )
+	      continue;
+	   if( server_term )
 	      break;
+	   if( pids[i] > 0 ){
+	      vtun_syslog(LOG_ERR,"Worker %d (process %d) exited, restarting", i, pid);
+	      sleep(1);
+	   }
+	   pids[i] = start_worker(i, sock, usocks[i]);
 	}
      }
+
+     for(i = 0; i < n; i++)
+        if( pids[i] > 0 )
+	   kill(pids[i], SIGTERM);
+     while( wait(NULL) > 0 || errno == EINTR )
+	;
+     free(pids);
+     free(usocks);
 }
 #endif
 
 void server(int sock)
 {
      struct sigaction sa;
+     int usock;
 
      memset(&sa, 0, sizeof sa);
      sa.sa_handler=SIG_IGN;
@@ -192,7 +637,22 @@ void server(int sock)
      sigaction(SIGUSR1,&sa,NULL);
 
      vtun_syslog(LOG_INFO,"VTUN server ver %s (%s)", VTUN_VER,
-		 vtun.svr_type == VTUN_INETD ? "inetd" : "stand" );
+		 vtun.svr_type == VTUN_INETD ? "inetd" :
+		 vtun.svr_type == VTUN_EVENT ? "event" : "stand" );
+
+     /* Tickets are useless if every connection has its own process */
+     if( vtun.svr_type != VTUN_INETD )
+        auth_ticket_init();
+
+     /* Processes forked from here share the session registry */
+     if( vtun.svr_type != VTUN_INETD )
+        lock_init();
+
+#ifdef HAVE_LINUX_IF_TUN_H
+     /* Inetd sessions create pool devices as they need them */
+     if( vtun.svr_type != VTUN_INETD )
+        llist_trav(&host_list, tunnel_pool, NULL);
+#endif
 
      switch( vtun.svr_type ){
 	case VTUN_STAND_ALONE:
@@ -205,5 +665,24 @@ void server(int sock)
         case VTUN_INETD:
 	   connection(sock);
 	   break;
+        case VTUN_EVENT:
+#ifdef HAVE_WORKING_FORK
+	   if( vtun.workers > 1 ){
+	      workers();
+	      break;
+	   }
+#endif
+	   if( vtun.handoff ){
+	      /* Listening sockets come from the running server too */
+	      if( vtun.workers > 1 || ev_takeover(&sock, &usock) ){
+		 vtun_syslog(LOG_ERR,"Can't take sessions over from the running server");
+		 break;
+	      }
+	      event_server(sock, usock, 0);
+	      break;
+	   }
+	   mux_sockets(1, &usock);
+	   event_server(listen_socket(0), usock, 0);
+	   break;
      }
 }
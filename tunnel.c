@@ -61,14 +61,18 @@ int (*dev_read)(int fd, char *buf, int len);
 
 int (*proto_write)(int fd, char *buf, int len);
 int (*proto_read)(int fd, char *buf);
+void (*proto_fdset)(fd_set *fds, int *maxfd, struct timeval *tv);
+int (*proto_ready)(fd_set *fds);
+int (*proto_unproven)(void);
+void (*proto_proven)(void);
 
-/* Initialize and start the tunnel.
+/* Open the device, set up the protocol and run the up commands.
    Returns:
       -1 - critical error
-      0  - normal close or noncritical error 
+      0  - tunnel is ready
+      1  - noncritical error, tunnel was not opened
 */
-   
-int tunnel(struct vtun_host *host)
+int tunnel_open(struct vtun_host *host)
 {
      int null_fd, pid, opt;
      int fd[2]={-1, -1};
@@ -79,6 +83,10 @@ int tunnel(struct vtun_host *host)
 	  (host->loc_fd >= 0) )
         interface_already_open = 1;
 
+     /* Resumed session keeps the routes of the previous one */
+     if( !(host->resumed && interface_already_open) )
+        tunnel_release(host);
+
      /* Initialize device. */
      if( host->dev ){
         strncpy(dev, host->dev, VTUN_DEV_LEN);
@@ -101,14 +109,22 @@ int tunnel(struct vtun_host *host)
 	      break;
 
            case VTUN_ETHER:
-	      if( (fd[0]=tap_open(dev)) < 0 ){
+	      if( host->pool > 0 && *dev )
+		 fd[0] = tap_pool_open(dev, host->pool);
+	      else
+		 fd[0] = tap_open(dev);
+	      if( fd[0] < 0 ){
 		 vtun_syslog(LOG_ERR,"Can't allocate tap device %s. %s(%d)", dev, strerror(errno), errno);
 		 return -1;
 	      }
 	      break;
 
 	   case VTUN_TUN:
-	      if( (fd[0]=tun_open(dev)) < 0 ){
+	      if( host->pool > 0 && *dev )
+		 fd[0] = tun_pool_open(dev, host->pool);
+	      else
+		 fd[0] = tun_open(dev);
+	      if( fd[0] < 0 ){
 		 vtun_syslog(LOG_ERR,"Can't allocate tun device %s. %s(%d)", dev, strerror(errno), errno);
 		 return -1;
 	      }
@@ -119,6 +135,10 @@ int tunnel(struct vtun_host *host)
      host->sopt.dev = strdup(dev);
 
      /* Initialize protocol. */
+     proto_fdset = NULL;
+     proto_ready = NULL;
+     proto_unproven = NULL;
+     proto_proven = NULL;
      switch( host->flags & VTUN_PROT_MASK ){
         case VTUN_TCP:
 	   opt=1;
@@ -130,6 +150,12 @@ int tunnel(struct vtun_host *host)
 	   proto_write = tcp_write;
 	   proto_read  = tcp_read;
 
+	   if( host->flags & VTUN_MPATH ){
+	      vtun_syslog(LOG_INFO,"Multipath is supported over UDP only");
+	      host->flags &= ~VTUN_MPATH;
+	   }
+	   host->flags &= ~VTUN_ARQ;
+
 	   break;
 
         case VTUN_UDP:
@@ -138,23 +164,41 @@ int tunnel(struct vtun_host *host)
 	      close(fd[1]);
 	      if( ! ( host->persist == VTUN_PERSIST_KEEPIF ) )
 		 close(fd[0]);
-	      return 0;
+	      return 1;
 	   } 	
 
- 	   proto_write = udp_write;
-	   proto_read = udp_read;
+	   if( host->flags & VTUN_MPATH ){
+	      proto_write = mpath_write;
+	      proto_read  = mpath_read;
+	      proto_fdset = mpath_fdset;
+	      proto_ready = mpath_ready;
+	      proto_unproven = mpath_unproven;
+	      proto_proven = mpath_proven;
+	   } else {
+ 	      proto_write = udp_write;
+	      proto_read = udp_read;
+	   }
+
+	   /* Reliable delivery for byte streams */
+	   if( (host->flags & VTUN_ARQ) && arq_init(host) < 0 ){
+	      close(fd[1]);
+	      if( ! ( host->persist == VTUN_PERSIST_KEEPIF ) )
+		 close(fd[0]);
+	      return 1;
+	   }
 
 	   break;
      }
 
 #ifdef HAVE_WORKING_FORK
+     if( !host->down_pending )
         switch( (pid=fork()) ){
 	   case -1:
 	      vtun_syslog(LOG_ERR,"Couldn't fork()");
 	      if( ! ( host->persist == VTUN_PERSIST_KEEPIF ) )
 		 close(fd[0]);
 	      close(fd[1]);
-	      return 0;
+	      return 1;
  	   case 0:
            /* do this only the first time when in persist = keep mode */
            if( ! interface_already_open ){
@@ -184,7 +228,7 @@ int tunnel(struct vtun_host *host)
            }
 	   /* Run list of up commands */
 	   set_title("%s running up commands", host->host);
-	   llist_trav(&host->up, run_cmd, &host->sopt);
+	   run_cmds(&host->up, &host->sopt);
 
 	   exit(0);           
 	}
@@ -224,14 +268,32 @@ int tunnel(struct vtun_host *host)
 	   break;
      }
 
-     opt = linkfd(host);
+     return 0;
+}
 
+/* Run the down commands and release the device and the connection */
+void tunnel_close(struct vtun_host *host)
+{
+     if( host->flags & VTUN_ARQ )
+	arq_close();
+     if( host->flags & VTUN_MPATH )
+	mpath_close();
+
+     if( host->persist == VTUN_PERSIST_KEEPIF && (host->ticket || host->buffer) ){
+        /* Session may be resumed or the client buffers the device
+	   while it reconnects, keep the routes until the next one */
+        free_sopt(&host->down_sopt);
+	host->down_sopt = host->sopt;
+	host->sopt.dev = host->sopt.laddr = host->sopt.raddr = NULL;
+	host->down_pending = 1;
+     } else {
 #ifdef HAVE_WORKING_FORK
-     set_title("%s running down commands", host->host);
-     llist_trav(&host->down, run_cmd, &host->sopt);
+	set_title("%s running down commands", host->host);
+	run_cmds(&host->down, &host->sopt);
 #else
-     vtun_syslog(LOG_ERR,"Couldn't run down commands: fork() not available");
+	vtun_syslog(LOG_ERR,"Couldn't run down commands: fork() not available");
 #endif
+     }
 
      if(! ( host->persist == VTUN_PERSIST_KEEPIF ) ) {
         set_title("%s closing", host->host);
@@ -239,11 +301,11 @@ int tunnel(struct vtun_host *host)
 	/* Gracefully destroy interface */
 	switch( host->flags & VTUN_TYPE_MASK ){
            case VTUN_TUN:
-	      tun_close(fd[0], dev);
+	      tun_close(host->loc_fd, host->sopt.dev);
 	      break;
 
            case VTUN_ETHER:
-	      tap_close(fd[0], dev);
+	      tap_close(host->loc_fd, host->sopt.dev);
 	      break;
 	}
 
@@ -252,7 +314,167 @@ int tunnel(struct vtun_host *host)
 
      /* Close all other fds */
      close(host->rmt_fd);
-     close(fd[1]);
+}
+
+/* Run the down commands postponed by tunnel_close() */
+void tunnel_release(struct vtun_host *host)
+{
+     if( !host->down_pending )
+        return;
+     host->down_pending = 0;
+
+#ifdef HAVE_WORKING_FORK
+     set_title("%s running down commands", host->host);
+     run_cmds(&host->down, &host->down_sopt);
+#endif
+     free_sopt(&host->down_sopt);
+}
+
+/* 
+ * Wait ms milliseconds before the client reconnects, reading the
+ * frames the kernel routes to the kept device meanwhile. Up to
+ * 'buffer' KB are stored in host->rbuf, the oldest frames are
+ * dropped to make room. linkfd() sends them over the next session.
+ * Returns -1 if interrupted by a signal.
+ */
+int tunnel_buffer(struct vtun_host *host, int ms)
+{
+     char buf[VTUN_FRAME_SIZE];
+     struct timeval tv, now, end;
+     unsigned short flen;
+     int size = host->buffer * 1024;
+     int fd = -1, len, off, drop = 0;
+     fd_set fdset;
+
+     if( host->persist == VTUN_PERSIST_KEEPIF && host->loc_fd >= 0 &&
+	 size > 0 && dev_read ){
+        if( !host->rbuf && !(host->rbuf = malloc(size)) )
+	   vtun_syslog(LOG_ERR,"Can't allocate reconnect buffer");
+	else
+	   fd = host->loc_fd;
+     }
+
+     gettimeofday(&end, NULL);
+     end.tv_sec  += ms / 1000;
+     end.tv_usec += (ms % 1000) * 1000;
+     if( end.tv_usec >= 1000000 ){
+        end.tv_sec++;
+	end.tv_usec -= 1000000;
+     }
+
+     for(;;){
+        gettimeofday(&now, NULL);
+	if( !timercmp(&now, &end, <) )
+	   break;
+	timersub(&end, &now, &tv);
+
+	FD_ZERO(&fdset);
+	if( fd >= 0 )
+	   FD_SET(fd, &fdset);
+	if( select(fd + 1, &fdset, NULL, NULL, &tv) < 0 ){
+	   if( errno == EINTR )
+	      return -1;
+	   break;
+	}
+	if( fd < 0 || !FD_ISSET(fd, &fdset) )
+	   continue;
+
+	if( (len = dev_read(fd, buf, sizeof(buf))) <= 0 ){
+	   if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+	      continue;
+	   break;
+	}
+	if( len + (int)sizeof(flen) > size ){
+	   drop++;
+	   continue;
+	}
+
+	/* Drop the oldest frames until the new one fits */
+	for( off = 0; host->rbuf_len - off + len + (int)sizeof(flen) > size; drop++ ){
+	   memcpy(&flen, host->rbuf + off, sizeof(flen));
+	   off += sizeof(flen) + flen;
+	}
+	if( off ){
+	   memmove(host->rbuf, host->rbuf + off, host->rbuf_len - off);
+	   host->rbuf_len -= off;
+	}
+
+	flen = len;
+	memcpy(host->rbuf + host->rbuf_len, &flen, sizeof(flen));
+	memcpy(host->rbuf + host->rbuf_len + sizeof(flen), buf, len);
+	host->rbuf_len += sizeof(flen) + len;
+     }
+
+     if( drop )
+        vtun_syslog(LOG_INFO,"Session %s buffer full, %d frames dropped",
+		host->host, drop);
+     return 0;
+}
+
+/* 
+ * Create the device pool of the host and bring the devices up.
+ * Sessions take their device from it, see tunnel_open().
+ */
+int tunnel_pool(void *d, void *u)
+{
+     struct vtun_host *host = d;
+     char dev[VTUN_DEV_LEN];
+     int i, n, *fd;
+
+     if( host->pool <= 0 )
+        return 0;
+     if( !host->dev ){
+        vtun_syslog(LOG_ERR,"%s: Device pool needs a device name", host->host);
+	return 0;
+     }
+     if( !(fd = malloc(host->pool * sizeof(int))) )
+        return 0;
+
+     /* Devices taken so far are busy, next open gets a new one */
+     for( n = 0; n < host->pool; n++ ){
+        strncpy(dev, host->dev, VTUN_DEV_LEN);
+	dev[VTUN_DEV_LEN-1]='\0';
+
+        switch( host->flags & VTUN_TYPE_MASK ){
+           case VTUN_ETHER:
+	      fd[n] = tap_pool_open(dev, host->pool);
+	      break;
+	   case VTUN_TUN:
+	      fd[n] = tun_pool_open(dev, host->pool);
+	      break;
+	   default:
+	      fd[n] = -1;
+	}
+	if( fd[n] < 0 )
+	   break;
+	nl_cmd(dev, "link set up");
+     }
+     nl_flush();
+
+     if( n < host->pool && (host->flags & (VTUN_ETHER | VTUN_TUN)) )
+        vtun_syslog(LOG_ERR,"%s: Created %d of %d pool devices. %s(%d)", 
+			host->host, n, host->pool, strerror(errno), errno);
+     for( i = 0; i < n; i++ )
+        close(fd[i]);
+     free(fd);
+     return 0;
+}
+
+/* Initialize and start the tunnel.
+   Returns:
+      -1 - critical error
+      0  - normal close or noncritical error 
+*/
+int tunnel(struct vtun_host *host)
+{
+     int opt;
+
+     if( (opt = tunnel_open(host)) )
+	return opt < 0 ? -1 : 0;
+
+     opt = linkfd(host);
+
+     tunnel_close(host);
 
      return opt;
 }
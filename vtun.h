@@ -37,9 +37,17 @@
 /* Number of seconds for delay after pppd startup*/
 #define VTUN_DELAY_SEC  10 
 
+/* Default length of the server's queue of pending connections */
+#define VTUN_BACKLOG 128
+
 /* Statistic interval in seconds */
 #define VTUN_STAT_IVAL  5*60  /* 5 min */
 
+/* Default and max size of the redundancy elimination cache in KB,
+ * references into it carry a 32 bit distance */
+#define VTUN_DEDUP_CACHE 4096
+#define VTUN_DEDUP_MAX   1048576
+
 /* Max lenght of device name */
 #define VTUN_DEV_LEN  20 
  
@@ -71,6 +79,9 @@ struct vtun_cmd {
 #define VTUN_CMD_WAIT	0x01 
 #define VTUN_CMD_DELAY  0x02
 #define VTUN_CMD_SHELL  0x04
+#define VTUN_CMD_NETLINK 0x08
+#define VTUN_CMD_PARALLEL 0x10
+#define VTUN_CMD_SYNC	0x20
 
 struct vtun_addr {
    char *name;
@@ -83,12 +94,17 @@ struct vtun_addr {
 #define VTUN_ADDR_NAME  0x02
 
 #define HOST_KEYBYTES 32
+#define HOST_PWIDBYTES 32
+
+#define HS_LEGACY_ONCE   1
+#define HS_LEGACY_SERVER 2
 
 struct vtun_host {
    char *host;
    char *passwd;
    unsigned char *akey;
    unsigned char *key;   
+   unsigned char pwid[HOST_PWIDBYTES];	/* ID of the forgotten password */
    char *dev;
 
    llist up;
@@ -100,6 +116,8 @@ struct vtun_host {
    int  spd_out;
    int  zlevel;
    int  cipher;
+   int  dedup;		/* Byte cache size in KB */
+   int  fec;		/* FEC group size, 0 - adaptive */
 
    int  rmt_fd;
    int  loc_fd;
@@ -110,6 +128,37 @@ struct vtun_host {
    /* Multiple connections */
    int  multi;
 
+   /* Size of the pool of persistent devices */
+   int  pool;
+
+   /* Device output kept while the client reconnects, in KB.
+    * Frames are stored with their length in front. */
+   int  buffer;
+   char *rbuf;
+   int  rbuf_len;
+
+   /* Next attempt uses the text handshake (HS_LEGACY_ONCE) or the
+    * server authenticated with it (HS_LEGACY_SERVER), or the server
+    * only speaks over TCP */
+   int  hs_legacy;
+   int  hs_tcp;
+
+   /* Resumption ticket from the server and its secret */
+   unsigned char *ticket;
+   int  ticket_len;
+   unsigned char *resume;
+   int  resumed;
+
+   /* Cookie for the handshake over UDP */
+   unsigned char cookie[16];
+
+   /* ID of the session on the server's shared UDP socket */
+   unsigned int sid;
+
+   /* Down commands postponed while the session may be resumed */
+   int  down_pending;
+   struct vtun_sopt down_sopt;
+
    /* Keep Alive */
    int ka_interval;
    int ka_maxfail;
@@ -117,6 +166,9 @@ struct vtun_host {
    /* Source address */
    struct vtun_addr src_addr;
 
+   /* Multipath source addresses (struct vtun_addr) */
+   llist paths;
+
    struct vtun_stat stat;
 
    struct vtun_sopt sopt;
@@ -140,6 +192,11 @@ extern llist host_list;
 #define VTUN_LZO        0x0002
 #define VTUN_SHAPE      0x0004
 #define VTUN_ENCRYPT    0x0008
+#define VTUN_HCOMP      0x00010000
+#define VTUN_DEDUP      0x00020000
+#define VTUN_FEC        0x00040000
+#define VTUN_MPATH      0x00080000
+#define VTUN_ARQ        0x00100000
 
 /* Cipher options */
 #define VTUN_ENC_AES256GCM      17
@@ -200,25 +257,44 @@ struct vtun_opts {
    char *route;		 /* Command to configure routing */
    char *fwall; 	 /* Command to configure FireWall */
    char *iproute;	 /* iproute command */
+   char *keycache;	 /* File with derived host keys */
 
    char *svr_name;       /* Server's host name */
    char *svr_addr;       /* Server's address (string) */
    struct vtun_addr bind_addr;	 /* Server should listen on this address */
    int  svr;		 /* 0=process is a client 1=process is a server */
    int  svr_type;	 /* Server mode */
+   int  workers;	 /* Number of event server processes */
+   int  backlog;	 /* Listen queue length */
+   int  fastopen;	 /* TCP Fast Open */
+   int  udpmux;		 /* UDP sessions share the server's socket */
+   int  ratelimit;	 /* Connections per second from one address */
+   int  handoff;	 /* Take the sessions over from the running server */
    int  syslog; 	 /* Facility to log messages to syslog under */
    int  quiet;		 /* Be quiet about common errors */
 };
 #define VTUN_STAND_ALONE	0 
 #define VTUN_INETD		1	
+#define VTUN_EVENT		2
 
 extern struct vtun_opts vtun;
 
 void server(int sock);
 void client(struct vtun_host *host);
 int  tunnel(struct vtun_host *host);
+int  tunnel_open(struct vtun_host *host);
+void tunnel_close(struct vtun_host *host);
+void tunnel_release(struct vtun_host *host);
+int  tunnel_buffer(struct vtun_host *host, int ms);
+int  tunnel_pool(void *d, void *u);
+void event_server(int sock, int usock, int worker);
+unsigned int ev_session_id(struct vtun_host *host);
+int  ev_takeover(int *sock, int *usock);
 int  read_config(char *file);
 struct vtun_host * find_host(char *host);
+struct vtun_host * lookup_host(char *host);
+struct vtun_host * dup_host(struct vtun_host *h);
+int  free_host(void *d, void *u);
 void clear_nat_hack_flags(int svr);
 
 #endif